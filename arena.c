@@ -0,0 +1,161 @@
+/* arena.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xutil.h"
+#include "arena.h"
+
+/*
+ * Small things that live as long as what they belong to, the symbols of
+ * a System.map or the ring map of a guest in follow mode, come out of an
+ * arena, which is released with it in one go.  Bigger buffers that come
+ * and go with each pass, like the copies of the ring, are taken from a
+ * buf_cache and put back there.
+ *
+ * Neither is locked: they belong to the thread working on the guest.
+ */
+#define ARENA_CHUNK         (64 * 1024)
+#define ARENA_ALIGN         (16)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_chunk *c = a->chunks;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (!c || c->size - c->used < size) {
+        c = xmalloc(sizeof(*c) + (size > ARENA_CHUNK ? size : ARENA_CHUNK));
+        c->size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        c->used = 0;
+        c->next = a->chunks;
+        a->chunks = c;
+    }
+
+    p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+void *arena_calloc(struct arena *a, size_t nmemb, size_t size)
+{
+    void *p = arena_alloc(a, nmemb * size);
+
+    memset(p, 0, nmemb * size);
+    return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+
+    return memcpy(arena_alloc(a, len), s, len);
+}
+
+void arena_release(struct arena *a)
+{
+    struct arena_chunk *c;
+
+    while ((c = a->chunks)) {
+        a->chunks = c->next;
+        xfree(c);
+    }
+}
+
+/* the size of a buffer is kept in front of it */
+#define BUF_MIN             (4096)
+
+struct buf_head {
+    size_t size;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+#define BUF_HEAD(buf)       ((struct buf_head *)(buf) - 1)
+
+static size_t buf_class(size_t size)
+{
+    size_t n = BUF_MIN;
+
+    while (n < size)
+        n <<= 1;
+
+    return n;
+}
+
+void *buf_get(struct buf_cache *c, size_t size)
+{
+    struct buf_head *h;
+    size_t n = buf_class(size);
+    int i;
+
+    for (i = 0; i < BUF_CACHE_SLOTS; i++) {
+        if (c->bufs[i] && BUF_HEAD(c->bufs[i])->size == n) {
+            h = BUF_HEAD(c->bufs[i]);
+            c->bufs[i] = NULL;
+            return h + 1;
+        }
+    }
+
+    h = xmalloc(sizeof(*h) + n);
+    h->size = n;
+    return h + 1;
+}
+
+/*
+ * Keep buf for a later buf_get(), in place of the smallest kept one if
+ * all slots are taken.
+ */
+void buf_put(struct buf_cache *c, void *buf)
+{
+    int i, min = -1;
+
+    if (!buf)
+        return;
+
+    for (i = 0; i < BUF_CACHE_SLOTS; i++) {
+        if (!c->bufs[i]) {
+            c->bufs[i] = buf;
+            return;
+        }
+        if (min < 0 || BUF_HEAD(c->bufs[i])->size < BUF_HEAD(c->bufs[min])->size)
+            min = i;
+    }
+
+    if (BUF_HEAD(c->bufs[min])->size < BUF_HEAD(buf)->size) {
+        xfree(BUF_HEAD(c->bufs[min]));
+        c->bufs[min] = buf;
+    } else {
+        xfree(BUF_HEAD(buf));
+    }
+}
+
+void buf_cache_release(struct buf_cache *c)
+{
+    int i;
+
+    for (i = 0; i < BUF_CACHE_SLOTS; i++) {
+        if (c->bufs[i])
+            xfree(BUF_HEAD(c->bufs[i]));
+        c->bufs[i] = NULL;
+    }
+}
@@ -0,0 +1,44 @@
+/* arena.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+/* memory handed out in order and given back all at once */
+struct arena {
+    struct arena_chunk *chunks;     /* the one in use first */
+};
+
+void *arena_alloc(struct arena *a, size_t size);
+void *arena_calloc(struct arena *a, size_t nmemb, size_t size);
+char *arena_strdup(struct arena *a, const char *s);
+void arena_release(struct arena *a);
+
+#define BUF_CACHE_SLOTS     (8)
+
+/* buffers of power of two sizes, kept when put back for the next get */
+struct buf_cache {
+    void *bufs[BUF_CACHE_SLOTS];
+};
+
+void *buf_get(struct buf_cache *c, size_t size);
+void buf_put(struct buf_cache *c, void *buf);
+void buf_cache_release(struct buf_cache *c);
+
+#endif
@@ -0,0 +1,311 @@
+/* bench.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include "xutil.h"
+#include "defs.h"
+#include "kvmdmesg.h"
+#include "bench.h"
+
+/*
+ * Read a synthetic guest through every backend, the way a library
+ * session does: open it, read the whole log, then refresh once more
+ * with nothing new.  The monitor backends talk to the mocks of mock.c,
+ * which count the round trips and the guest memory they hand out.
+ */
+enum bench_kind {
+    BENCH_FILE,
+    BENCH_DUMP,
+    BENCH_SOCKET,
+    BENCH_LIBVIRT,
+};
+
+struct bench_backend {
+    const char *name;
+    enum bench_kind kind;
+    int pmemsave;
+    int process;
+    int peek;
+};
+
+static const struct bench_backend backends[] = {
+    { "file",          BENCH_FILE,    0, 0, 0 },
+    { "dump",          BENCH_DUMP,    0, 0, 0 },
+    { "process",       BENCH_SOCKET,  0, 1, 0 },
+    { "qmp-pmemsave",  BENCH_SOCKET,  1, 0, 0 },
+    { "qmp-xp",        BENCH_SOCKET,  0, 0, 0 },
+    { "libvirt-peek",  BENCH_LIBVIRT, 0, 0, 1 },
+    { "libvirt-hmp",   BENCH_LIBVIRT, 0, 0, 0 },
+};
+
+#define NR_BACKENDS     (sizeof(backends) / sizeof(backends[0]))
+
+struct bench_result {
+    uint64_t open_ns;
+    uint64_t read_ns;
+    uint64_t idle_ns;
+    uint64_t calls;             /* of the read */
+    uint64_t bytes;
+    unsigned long records;
+    unsigned long text_bytes;
+    uint64_t text_hash;
+};
+
+static char socket_path[108];
+
+static void bench_record(const struct kvmdmesg_record *r, void *arg)
+{
+    struct bench_result *res = arg;
+
+    res->records++;
+    res->text_bytes += r->len;
+    res->text_hash = bench_hash(r->text, r->len, res->text_hash);
+}
+
+static void bench_nop(const struct kvmdmesg_record *r, void *arg)
+{
+    (void)r;
+    (void)arg;
+}
+
+static int bench_once(struct bench_guest *g, const struct bench_backend *b,
+        struct bench_result *res)
+{
+    struct kvmdmesg_options opts = { 0 };
+    struct kvmdmesg *s;
+    const char *guest;
+    uint64_t t0, t1, t2, calls;
+    int ret = 0;
+
+    switch (b->kind) {
+        case BENCH_FILE:    guest = g->image; break;
+        case BENCH_DUMP:    guest = g->dump; break;
+        case BENCH_SOCKET:  guest = socket_path; break;
+        default:            guest = BENCH_DOMAIN; break;
+    }
+
+    mock.pmemsave = b->pmemsave;
+    mock.process = b->process;
+    mock.peek = b->peek;
+    opts.no_cache = TRUE;           /* every run starts cold */
+
+    memset(res, 0, sizeof(*res));
+    res->text_hash = BENCH_HASH_INIT;
+    mock_reset();
+
+    t0 = xclock_ns();
+    if (!(s = kvmdmesg_open_options(guest, g->map, &opts)))
+        return -1;
+    t1 = xclock_ns();
+    calls = mock.calls;
+
+    if (kvmdmesg_refresh(s, bench_record, res) < 0)
+        ret = -1;
+    t2 = xclock_ns();
+    res->calls = mock.calls - calls;
+    res->bytes = mock.bytes;
+
+    if (kvmdmesg_refresh(s, bench_nop, NULL) < 0)
+        ret = -1;
+    res->idle_ns = xclock_ns() - t2;
+
+    kvmdmesg_close(s);
+
+    res->open_ns = t1 - t0;
+    res->read_ns = t2 - t1;
+    return ret;
+}
+
+static void bench_backend(struct bench_guest *g, const struct bench_backend *b, int runs)
+{
+    struct bench_result res, best = { 0 };
+    double secs;
+    int i, ok;
+
+    for (i = 0; i < runs; i++) {
+        if (bench_once(g, b, &res)) {
+            printf("%-14s  failed\n", b->name);
+            return;
+        }
+        if (!i || res.read_ns < best.read_ns)
+            best = res;
+    }
+
+    ok = best.records == g->records && best.text_bytes == g->text_bytes &&
+        best.text_hash == g->text_hash;
+    secs = best.read_ns / 1e9;
+
+    printf("%-14s %8.2f %9.2f %12.0f %8.1f %8lu %8.2f %8.2f  %s\n", b->name,
+            best.open_ns / 1e6, best.read_ns / 1e6,
+            secs ? best.records / secs : 0, secs ? best.text_bytes / secs / 1e6 : 0,
+            (unsigned long)best.calls, best.bytes / 1e6, best.idle_ns / 1e6,
+            ok ? "ok" : "MISMATCH");
+}
+
+/* the shim has the sonames libvirt_client.c asks for, see libvirt_shim.c */
+static int bench_load_shim(void)
+{
+    static const char *libs[] = { "libvirt.so.0", "libvirt-qemu.so.0" };
+    char exe[PATH_MAX], path[PATH_MAX + 32], *dir;
+    ssize_t n;
+    size_t i;
+
+    if ((n = readlink("/proc/self/exe", exe, sizeof(exe) - 1)) < 0)
+        return -1;
+    exe[n] = '\0';
+    dir = dirname(exe);
+
+    for (i = 0; i < sizeof(libs) / sizeof(libs[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, libs[i]);
+        if (!dlopen(path, RTLD_NOW | RTLD_GLOBAL)) {
+            fprintf(stderr, "%s\n", dlerror());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_selected(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    if (!list)
+        return TRUE;
+
+    for (p = list; (p = strstr(p, name)); p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void usage(const char *prog)
+{
+    size_t i;
+
+    fprintf(stderr, "Usage: %s [options]\n"
+            "\n"
+            "Options:\n"
+            "  -r, --rings=LIST    descriptor ring sizes as bits (default 10,13,16)\n"
+            "  -l, --latency=USEC  monitor round trip (default 100)\n"
+            "  -n, --runs=N        runs per backend, the fastest counts (default 3)\n"
+            "  -b, --backends=LIST only these backends:\n"
+            "                     ", prog);
+    for (i = 0; i < NR_BACKENDS; i++)
+        fprintf(stderr, " %s", backends[i].name);
+    fprintf(stderr, "\n  -d, --dir=DIR       scratch directory (default $TMPDIR or /tmp)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"rings",    required_argument, 0, 'r'},
+        {"latency",  required_argument, 0, 'l'},
+        {"runs",     required_argument, 0, 'n'},
+        {"backends", required_argument, 0, 'b'},
+        {"dir",      required_argument, 0, 'd'},
+        {"help",     no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    struct mock_server *server;
+    struct bench_guest g;
+    const char *rings = "10,13,16", *only = NULL, *tmp;
+    char dir[PATH_MAX], *p, *end;
+    int runs = 3, libvirt, bits, c;
+    size_t k;
+
+    dir[0] = '\0';
+    mock.latency_us = 100;
+
+    while ((c = getopt_long(argc, argv, "r:l:n:b:d:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'r': rings = optarg; break;
+            case 'l': mock.latency_us = strtoul(optarg, NULL, 10); break;
+            case 'n': runs = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'b': only = optarg; break;
+            case 'd': snprintf(dir, sizeof(dir), "%s/kvm-dmesg-bench.XXXXXX", optarg); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (!dir[0]) {
+        tmp = getenv("TMPDIR");
+        snprintf(dir, sizeof(dir), "%s/kvm-dmesg-bench.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    }
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        return 1;
+    }
+
+    libvirt = !bench_load_shim();
+    if (!libvirt)
+        fprintf(stderr, "libvirt shim not found, skipping the libvirt backends\n");
+
+    snprintf(socket_path, sizeof(socket_path), "%s/qmp.sock", dir);
+    if (!(server = mock_qmp_start(socket_path))) {
+        perror(socket_path);
+        rmdir(dir);
+        return 1;
+    }
+
+    for (p = (char *)rings; *p; p = end + (*end == ',')) {
+        bits = strtol(p, &end, 10);
+        if (end == p || bits < 4 || bits > 22) {
+            fprintf(stderr, "Invalid ring size: %s\n", p);
+            break;
+        }
+
+        if (bench_guest_create(&g, dir, bits) || bench_guest_write_dump(&g)) {
+            perror("guest");
+            bench_guest_destroy(&g);
+            break;
+        }
+        mock.guest = &g;
+
+        printf("\nring of 2^%d records, %lu KiB of text, %u us per monitor command\n\n",
+                bits, g.text_bytes / 1024, mock.latency_us);
+        printf("%-14s %8s %9s %12s %8s %8s %8s %8s  %s\n", "backend", "open ms",
+                "read ms", "records/s", "MB/s", "trips", "MB read", "idle ms", "check");
+
+        for (k = 0; k < NR_BACKENDS; k++) {
+            if (!bench_selected(only, backends[k].name))
+                continue;
+            if (backends[k].kind == BENCH_LIBVIRT && !libvirt)
+                continue;
+            bench_backend(&g, &backends[k], runs);
+        }
+
+        bench_guest_destroy(&g);
+    }
+
+    mock_qmp_stop(server);
+    rmdir(dir);
+
+    return 0;
+}
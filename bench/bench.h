@@ -0,0 +1,87 @@
+/* bench.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A guest that never ran: a sparse file of physical memory with the
+ * page tables, IDT, vmcoreinfo and printk_ringbuffer a 64 bit kernel
+ * would have, and the System.map that goes with it.  See guest.c.
+ */
+struct bench_guest {
+    char image[256];                /* flat physical memory */
+    char dump[256];                 /* the same as an ELF core */
+    char map[256];                  /* System.map */
+
+    char *mem;                      /* image, mapped */
+    size_t size;
+
+    int count_bits;                 /* of the descriptor ring */
+    unsigned long records;
+    unsigned long text_bytes;
+    uint64_t text_hash;             /* of all the text, in order */
+
+    /* what a vCPU of the guest has */
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t idtr;
+};
+
+int bench_guest_create(struct bench_guest *g, const char *dir, int count_bits);
+int bench_guest_write_dump(struct bench_guest *g);
+void bench_guest_destroy(struct bench_guest *g);
+
+uint64_t bench_hash(const void *buf, size_t len, uint64_t hash);
+
+#define BENCH_HASH_INIT     (0xcbf29ce484222325ULL)
+
+/*
+ * The monitor of the guest, as QEMU and libvirtd would answer it, see
+ * mock.c.  calls counts the round trips, bytes the guest memory handed
+ * out, both from zero again with mock_reset().
+ */
+struct bench_mock {
+    struct bench_guest *guest;
+    unsigned int latency_us;        /* per command */
+    int pmemsave;                   /* add-fd and pmemsave work */
+    int process;                    /* info mtree and gpa2hva work */
+    int peek;                       /* virDomainMemoryPeek works */
+
+    uint64_t calls;
+    uint64_t bytes;
+};
+
+extern struct bench_mock mock;
+
+struct mock_server;
+
+struct mock_server *mock_qmp_start(const char *path);
+void mock_qmp_stop(struct mock_server *s);
+void mock_reset(void);
+
+/* called by the libvirt shim, see libvirt_shim.c; peek answers a virError code */
+#define BENCH_VIR_ERR_NO_SUPPORT    (3)
+#define BENCH_VIR_ERR_INVALID_ARG   (8)
+
+int bench_libvirt_peek(unsigned long long start, size_t size, void *buffer);
+int bench_libvirt_hmp(const char *cmd, char **result);
+
+#define BENCH_DOMAIN        "kvm-dmesg-bench"
+
+#endif
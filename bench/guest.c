@@ -0,0 +1,515 @@
+/* guest.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "printk.h"
+#include "bench.h"
+
+/*
+ * The kernel of the guest is linked at the usual addresses and moved
+ * by KASLR: GUEST_KASLR in virtual and GUEST_PHYS_BASE in physical
+ * memory.  Its variables live in the image, everything the kernel
+ * allocates (vmcoreinfo, the printk ring) in the direct map.
+ *
+ * The file backend has no vCPU to ask and takes the page tables from
+ * GUEST_CR3 and the IDT from GUEST_IDTR, the read-only IDT alias in the
+ * cpu_entry_area, so that is where they are here as well.  The page
+ * tables also map the kernel image and all of the RAM in the direct
+ * map, and vmcoreinfo has its ELF note, for reading the guest without
+ * its System.map.
+ */
+#define START_KERNEL_MAP        (0xffffffff80000000UL)
+#define GUEST_KASLR             (0x0c000000UL)
+#define GUEST_PHYS_BASE         (0x02000000UL)
+#define GUEST_PAGE_OFFSET       (0xffff888000000000UL)
+#define GUEST_VMALLOC_BASE      (0xffffc90000000000UL)
+
+#define GUEST_CR3               (0x19872000UL)
+#define GUEST_CR4               (0x00350ef0UL)
+#define GUEST_IDTR              (0xffffffffff528000UL)
+
+#define GUEST_VMCOREINFO        (0x19880000UL)
+#define GUEST_VMCOREINFO_NOTE   (0x19881000UL)
+#define GUEST_RING              (0x1a000000UL)
+#define GUEST_RELEASE           "6.6.0-bench"
+
+/* in System.map */
+#define SYM_TEXT                (0xffffffff81000000UL)
+#define SYM_DIVIDE_ERROR        (0xffffffff81a00bd0UL)
+#define SYM_IDT_TABLE           (0xffffffff82a00000UL)
+#define SYM_VMCOREINFO_DATA     (0xffffffff82a01000UL)
+#define SYM_VMCOREINFO_SIZE     (0xffffffff82a01008UL)
+#define SYM_PAGE_OFFSET_BASE    (0xffffffff82a01010UL)
+#define SYM_VMALLOC_BASE        (0xffffffff82a01018UL)
+#define SYM_PRB                 (0xffffffff82a01020UL)
+#define SYM_PRINTK_RB_STATIC    (0xffffffff82a01040UL)
+#define SYM_INIT_UTS_NS         (0xffffffff82a02000UL)
+
+/* text symbols around the ones we need, for a map of the usual size */
+#define MAP_FILLER              (120000)
+
+#define PAGE                    (4096UL)
+#define PTE_PRESENT             (0x1UL)
+#define PTE_RW                  (0x2UL)
+#define PTE_PSE                 (0x80UL)
+#define PMD_SIZE                (2UL << 20)
+
+#define DESC_ID_MASK            (~(3UL << 62))
+#define DESC_SV_FINALIZED(id)   ((2UL << 62) | (id))
+
+static uint64_t kernel_phys(uint64_t sym)
+{
+    return sym + GUEST_KASLR - START_KERNEL_MAP + GUEST_PHYS_BASE;
+}
+
+static uint64_t kernel_virt(uint64_t sym)
+{
+    return sym + GUEST_KASLR;
+}
+
+static uint64_t direct_virt(uint64_t paddr)
+{
+    return GUEST_PAGE_OFFSET + paddr;
+}
+
+uint64_t bench_hash(const void *buf, size_t len, uint64_t hash)
+{
+    const unsigned char *p = buf;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static void put64(struct bench_guest *g, uint64_t paddr, uint64_t v)
+{
+    memcpy(g->mem + paddr, &v, sizeof(v));
+}
+
+/* 2M pages from va on, for size bytes from paddr, in the pmd page */
+static void guest_map_pmds(struct bench_guest *g, uint64_t pmd, uint64_t va,
+        uint64_t paddr, uint64_t size)
+{
+    uint64_t off;
+
+    for (off = 0; off < size; off += PMD_SIZE)
+        put64(g, pmd + (((va + off) >> 21) & 511) * 8,
+                (paddr + off) | PTE_PRESENT | PTE_RW | PTE_PSE);
+}
+
+/*
+ * The four levels down to the page of the IDT alias, the kernel image
+ * and the direct map, in the free pages that follow GUEST_CR3.
+ */
+static void guest_page_tables(struct bench_guest *g)
+{
+    uint64_t va = GUEST_IDTR;
+    uint64_t pud = GUEST_CR3 + PAGE, pmd = pud + PAGE, pte = pmd + PAGE;
+    uint64_t text_pmd = pte + PAGE, direct_pud = text_pmd + PAGE;
+    uint64_t direct_pmd = direct_pud + PAGE, paddr, size;
+
+    put64(g, GUEST_CR3 + ((va >> 39) & 511) * 8, pud | PTE_PRESENT | PTE_RW);
+    put64(g, pud + ((va >> 30) & 511) * 8, pmd | PTE_PRESENT | PTE_RW);
+    put64(g, pmd + ((va >> 21) & 511) * 8, pte | PTE_PRESENT | PTE_RW);
+    put64(g, pte + ((va >> 12) & 511) * 8, kernel_phys(SYM_IDT_TABLE) | PTE_PRESENT);
+
+    /* the kernel image, up to the end of its gigabyte or of RAM */
+    va = START_KERNEL_MAP;
+    size = g->size - GUEST_PHYS_BASE;
+    if (size > (1UL << 30))
+        size = 1UL << 30;
+    put64(g, pud + ((va >> 30) & 511) * 8, text_pmd | PTE_PRESENT | PTE_RW);
+    guest_map_pmds(g, text_pmd, va, GUEST_PHYS_BASE, size & ~(PMD_SIZE - 1));
+
+    /* a pmd page per gigabyte, as many as fit before vmcoreinfo */
+    va = GUEST_PAGE_OFFSET;
+    put64(g, GUEST_CR3 + ((va >> 39) & 511) * 8, direct_pud | PTE_PRESENT | PTE_RW);
+    for (paddr = 0; paddr < g->size && direct_pmd < GUEST_VMCOREINFO;
+            paddr += size, direct_pmd += PAGE) {
+        size = g->size - paddr < (1UL << 30) ? g->size - paddr : 1UL << 30;
+        put64(g, direct_pud + (((va + paddr) >> 30) & 511) * 8,
+                direct_pmd | PTE_PRESENT | PTE_RW);
+        guest_map_pmds(g, direct_pmd, va + paddr, paddr, size);
+    }
+}
+
+/* vector 0, the divide error gate */
+static void guest_idt(struct bench_guest *g)
+{
+    uint64_t handler = kernel_virt(SYM_DIVIDE_ERROR);
+    unsigned char *gate = (unsigned char *)g->mem + kernel_phys(SYM_IDT_TABLE);
+    uint16_t lo = handler, mid = handler >> 16, cs = 0x10;
+    uint32_t hi = handler >> 32;
+
+    memcpy(gate, &lo, 2);
+    memcpy(gate + 2, &cs, 2);
+    gate[5] = 0x8e;                 /* present, interrupt gate */
+    memcpy(gate + 6, &mid, 2);
+    memcpy(gate + 8, &hi, 4);
+}
+
+static void guest_vmcoreinfo(struct bench_guest *g)
+{
+    char *p = g->mem + GUEST_VMCOREINFO;
+    size_t n = 0, size = PAGE;
+
+#define VMCI(fmt, ...) (n += snprintf(p + n, size - n, fmt "\n", ##__VA_ARGS__))
+#define VMCI_SIZE(s) VMCI("SIZE(%s)=%zu", #s, sizeof(struct s))
+#define VMCI_OFFSET(s, m) VMCI("OFFSET(%s.%s)=%zu", #s, #m, offsetof(struct s, m))
+
+    VMCI("OSRELEASE=%s", GUEST_RELEASE);
+    VMCI("BUILD-ID=0000000000000000000000000000000000000000");
+    VMCI("PAGESIZE=%lu", PAGE);
+    VMCI("SYMBOL(init_uts_ns)=%lx", kernel_virt(SYM_INIT_UTS_NS));
+    VMCI("OFFSET(uts_namespace.name)=0");
+    VMCI("SYMBOL(node_online_map)=%lx", kernel_virt(0xffffffff82a02400UL));
+    VMCI("SYMBOL(swapper_pg_dir)=%lx", kernel_virt(0xffffffff82a03000UL));
+    VMCI("SYMBOL(_stext)=%lx", kernel_virt(SYM_TEXT));
+    VMCI("SYMBOL(vmap_area_list)=%lx", kernel_virt(0xffffffff82a02800UL));
+    VMCI("SYMBOL(prb)=%lx", kernel_virt(SYM_PRB));
+    VMCI("SYMBOL(printk_rb_static)=%lx", kernel_virt(SYM_PRINTK_RB_STATIC));
+    VMCI("SYMBOL(clear_seq)=%lx", kernel_virt(0xffffffff82a02c00UL));
+    VMCI_SIZE(printk_ringbuffer);
+    VMCI_OFFSET(printk_ringbuffer, desc_ring);
+    VMCI_OFFSET(printk_ringbuffer, text_data_ring);
+    VMCI_OFFSET(printk_ringbuffer, fail);
+    VMCI_SIZE(prb_desc_ring);
+    VMCI_OFFSET(prb_desc_ring, count_bits);
+    VMCI_OFFSET(prb_desc_ring, descs);
+    VMCI_OFFSET(prb_desc_ring, infos);
+    VMCI_OFFSET(prb_desc_ring, head_id);
+    VMCI_OFFSET(prb_desc_ring, tail_id);
+    VMCI_SIZE(prb_desc);
+    VMCI_OFFSET(prb_desc, state_var);
+    VMCI_OFFSET(prb_desc, text_blk_lpos);
+    VMCI_OFFSET(prb_data_blk_lpos, begin);
+    VMCI_OFFSET(prb_data_blk_lpos, next);
+    VMCI_SIZE(printk_info);
+    VMCI_OFFSET(printk_info, seq);
+    VMCI_OFFSET(printk_info, ts_nsec);
+    VMCI_OFFSET(printk_info, text_len);
+    VMCI_OFFSET(printk_info, caller_id);
+    VMCI_OFFSET(printk_info, dev_info);
+    VMCI_SIZE(dev_printk_info);
+    VMCI_OFFSET(dev_printk_info, subsystem);
+    VMCI_OFFSET(dev_printk_info, device);
+    VMCI_SIZE(prb_data_ring);
+    VMCI_OFFSET(prb_data_ring, size_bits);
+    VMCI_OFFSET(prb_data_ring, data);
+    VMCI_OFFSET(prb_data_ring, head_lpos);
+    VMCI_OFFSET(prb_data_ring, tail_lpos);
+    VMCI("SIZE(atomic_long_t)=%zu", sizeof(atomic_long_t));
+    VMCI("OFFSET(atomic_long_t.counter)=%zu", offsetof(atomic_long_t, counter));
+    VMCI("LENGTH(mem_section)=2048");
+    VMCI("NUMBER(phys_base)=%ld", (long)GUEST_PHYS_BASE);
+    VMCI("NUMBER(pgtable_l5_enabled)=0");
+    VMCI("KERNELOFFSET=%lx", GUEST_KASLR);
+    VMCI("CRASHTIME=1700000000");
+
+#undef VMCI_OFFSET
+#undef VMCI_SIZE
+#undef VMCI
+
+    /* the release in init_uts_ns, after sysname and nodename */
+    strcpy((char *)g->mem + kernel_phys(SYM_INIT_UTS_NS) + 2 * 65, GUEST_RELEASE);
+
+    put64(g, kernel_phys(SYM_VMCOREINFO_DATA), direct_virt(GUEST_VMCOREINFO));
+    put64(g, kernel_phys(SYM_VMCOREINFO_SIZE), n);
+
+    /* the note kdump reads it from, Elf64_Nhdr and "VMCOREINFO" padded */
+    p = g->mem + GUEST_VMCOREINFO_NOTE;
+    memcpy(p, &(uint32_t){ sizeof("VMCOREINFO") }, 4);
+    memcpy(p + 4, &(uint32_t){ n }, 4);
+    memcpy(p + 12, "VMCOREINFO", sizeof("VMCOREINFO"));
+    memcpy(p + 24, g->mem + GUEST_VMCOREINFO, n);
+}
+
+/* what the records say, varied a little in length and level */
+static int guest_record_text(char *buf, size_t size, unsigned long seq)
+{
+    static const char *subsys[] = {
+        "pci 0000:00:02.0", "virtio_net virtio1", "EXT4-fs (vda1)",
+        "systemd[1]", "audit", "nvme nvme0", "tsc", "ACPI",
+    };
+    unsigned long r = seq * 2654435761UL;
+    int n;
+
+    n = snprintf(buf, size, "%s: bench message %lu, value 0x%08lx",
+            subsys[r % 8], seq, r & 0xffffffffUL);
+    while ((r >>= 3) & 1 && n < (int)size - 24)
+        n += snprintf(buf + n, size - n, " and some more text");
+
+    return n;
+}
+
+/*
+ * A full descriptor ring: records seq 0 on, with ids starting past the
+ * first lap of the ring, and their text one block after the other in a
+ * data ring big enough to hold them all.
+ */
+static void guest_ring(struct bench_guest *g)
+{
+    unsigned long count = 1UL << g->count_bits, i, id, first_id;
+    uint64_t descs = GUEST_RING, infos, data, lpos = 0, blk;
+    unsigned int size_bits = g->count_bits + 7;
+    struct printk_ringbuffer rb = { 0 };
+    struct prb_desc desc = { 0 };
+    struct printk_info info = { 0 };
+    char text[256];
+    int len;
+
+    infos = descs + count * sizeof(struct prb_desc);
+    data = (infos + count * sizeof(struct printk_info) + PAGE - 1) & ~(PAGE - 1);
+
+    first_id = 3 * count + 5;
+    g->records = count;
+    g->text_bytes = 0;
+    g->text_hash = BENCH_HASH_INIT;
+
+    for (i = 0; i < count; i++) {
+        id = (first_id + i) & DESC_ID_MASK;
+        len = guest_record_text(text, sizeof(text), i);
+        blk = (sizeof(unsigned long) + len + sizeof(unsigned long) - 1) &
+            ~(sizeof(unsigned long) - 1);
+
+        put64(g, data + lpos, id);
+        memcpy(g->mem + data + lpos + sizeof(unsigned long), text, len);
+
+        desc.state_var.counter = DESC_SV_FINALIZED(id);
+        desc.text_blk_lpos.begin = lpos;
+        desc.text_blk_lpos.next = lpos + blk;
+        memcpy(g->mem + descs + (id % count) * sizeof(desc), &desc, sizeof(desc));
+
+        memset(&info, 0, sizeof(info));
+        info.seq = i;
+        info.ts_nsec = 1000000UL + i * 173000UL;
+        info.text_len = len;
+        info.level = (i % 97) ? 6 : 3;
+        info.caller_id = i % 4;
+        memcpy(g->mem + infos + (id % count) * sizeof(info), &info, sizeof(info));
+
+        lpos += blk;
+        g->text_bytes += len;
+        g->text_hash = bench_hash(text, len, g->text_hash);
+    }
+
+    while ((1UL << size_bits) < lpos)
+        size_bits++;
+
+    rb.desc_ring.count_bits = g->count_bits;
+    rb.desc_ring.descs = (struct prb_desc *)direct_virt(descs);
+    rb.desc_ring.infos = (struct printk_info *)direct_virt(infos);
+    rb.desc_ring.head_id.counter = (first_id + count - 1) & DESC_ID_MASK;
+    rb.desc_ring.tail_id.counter = first_id;
+    rb.text_data_ring.size_bits = size_bits;
+    rb.text_data_ring.data = (char *)direct_virt(data);
+    rb.text_data_ring.head_lpos.counter = lpos;
+    rb.text_data_ring.tail_lpos.counter = 0;
+
+    memcpy(g->mem + kernel_phys(SYM_PRINTK_RB_STATIC), &rb, sizeof(rb));
+    put64(g, kernel_phys(SYM_PRB), kernel_virt(SYM_PRINTK_RB_STATIC));
+    put64(g, kernel_phys(SYM_PAGE_OFFSET_BASE), GUEST_PAGE_OFFSET);
+    put64(g, kernel_phys(SYM_VMALLOC_BASE), GUEST_VMALLOC_BASE);
+}
+
+static size_t guest_ring_bytes(int count_bits)
+{
+    unsigned long count = 1UL << count_bits;
+
+    return count * (sizeof(struct prb_desc) + sizeof(struct printk_info)) +
+        (count << 8) + PAGE;
+}
+
+static int guest_map(struct bench_guest *g)
+{
+    FILE *f;
+    int i;
+
+    if (!(f = fopen(g->map, "w")))
+        return -1;
+
+    fprintf(f, "%016lx T _text\n", SYM_TEXT);
+    for (i = 0; i < MAP_FILLER / 2; i++)
+        fprintf(f, "%016lx T bench_text_%06d\n", SYM_TEXT + 0x1000 + i * 0x40UL, i);
+    fprintf(f, "%016lx T asm_exc_divide_error\n", SYM_DIVIDE_ERROR);
+    for (; i < MAP_FILLER; i++)
+        fprintf(f, "%016lx T bench_text_%06d\n", SYM_DIVIDE_ERROR + 0x40 + i * 0x40UL, i);
+    fprintf(f, "%016lx D idt_table\n", SYM_IDT_TABLE);
+    fprintf(f, "%016lx D vmcoreinfo_data\n", SYM_VMCOREINFO_DATA);
+    fprintf(f, "%016lx D vmcoreinfo_size\n", SYM_VMCOREINFO_SIZE);
+    fprintf(f, "%016lx D page_offset_base\n", SYM_PAGE_OFFSET_BASE);
+    fprintf(f, "%016lx D vmalloc_base\n", SYM_VMALLOC_BASE);
+    fprintf(f, "%016lx D prb\n", SYM_PRB);
+    fprintf(f, "%016lx d printk_rb_static\n", SYM_PRINTK_RB_STATIC);
+    fprintf(f, "%016lx B _end\n", 0xffffffff83000000UL);
+
+    return fclose(f);
+}
+
+int bench_guest_create(struct bench_guest *g, const char *dir, int count_bits)
+{
+    int fd;
+
+    memset(g, 0, sizeof(*g));
+    g->count_bits = count_bits;
+    g->cr3 = GUEST_CR3;
+    g->cr4 = GUEST_CR4;
+    g->idtr = GUEST_IDTR;
+
+    snprintf(g->image, sizeof(g->image), "%s/guest-%d.mem", dir, count_bits);
+    snprintf(g->dump, sizeof(g->dump), "%s/guest-%d.core", dir, count_bits);
+    snprintf(g->map, sizeof(g->map), "%s/System.map-%d", dir, count_bits);
+
+    g->size = (GUEST_RING + guest_ring_bytes(count_bits) + (2UL << 20) - 1) &
+        ~((2UL << 20) - 1);
+
+    if ((fd = open(g->image, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+        return -1;
+
+    if (ftruncate(fd, g->size) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    g->mem = mmap(NULL, g->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (g->mem == MAP_FAILED) {
+        g->mem = NULL;
+        return -1;
+    }
+
+    guest_page_tables(g);
+    guest_idt(g);
+    guest_vmcoreinfo(g);
+    guest_ring(g);
+
+    return guest_map(g);
+}
+
+/* QEMUCPUState, the "QEMU" note dump-guest-memory writes per vCPU */
+struct bench_cpu_segment {
+    uint32_t selector;
+    uint32_t limit;
+    uint32_t flags;
+    uint32_t pad;
+    uint64_t base;
+};
+
+struct bench_cpu_state {
+    uint32_t version;
+    uint32_t size;
+    uint64_t regs[18];
+    struct bench_cpu_segment cs, ds, es, fs, gs, ss;
+    struct bench_cpu_segment ldt, tr, gdt, idt;
+    uint64_t cr[5];
+    uint64_t kernel_gs_base;
+};
+
+/*
+ * The image as dump-guest-memory writes it: an ELF core with the CPU
+ * state note and one PT_LOAD for all of RAM.  Only the parts of the
+ * image that hold data are copied, the rest stays a hole.
+ */
+int bench_guest_write_dump(struct bench_guest *g)
+{
+    struct {
+        Elf64_Ehdr eh;
+        Elf64_Phdr ph[2];
+        Elf64_Nhdr nh;
+        char name[8];
+        struct bench_cpu_state cpu;     /* 4 byte aligned, as in a real note */
+    } __attribute__((packed)) hdr;
+    off_t pos = 0, end;
+    int fd, in, ret = -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.eh.e_ident, ELFMAG, SELFMAG);
+    hdr.eh.e_ident[EI_CLASS] = ELFCLASS64;
+    hdr.eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    hdr.eh.e_ident[EI_VERSION] = EV_CURRENT;
+    hdr.eh.e_type = ET_CORE;
+    hdr.eh.e_machine = EM_X86_64;
+    hdr.eh.e_version = EV_CURRENT;
+    hdr.eh.e_phoff = offsetof(typeof(hdr), ph);
+    hdr.eh.e_ehsize = sizeof(Elf64_Ehdr);
+    hdr.eh.e_phentsize = sizeof(Elf64_Phdr);
+    hdr.eh.e_phnum = 2;
+
+    hdr.ph[0].p_type = PT_NOTE;
+    hdr.ph[0].p_offset = offsetof(typeof(hdr), nh);
+    hdr.ph[0].p_filesz = sizeof(hdr) - offsetof(typeof(hdr), nh);
+
+    hdr.ph[1].p_type = PT_LOAD;
+    hdr.ph[1].p_offset = PAGE;
+    hdr.ph[1].p_paddr = 0;
+    hdr.ph[1].p_filesz = hdr.ph[1].p_memsz = g->size;
+
+    hdr.nh.n_namesz = sizeof("QEMU");
+    hdr.nh.n_descsz = sizeof(hdr.cpu);
+    memcpy(hdr.name, "QEMU", sizeof("QEMU"));
+    hdr.cpu.size = sizeof(hdr.cpu);
+    hdr.cpu.idt.base = g->idtr;
+    hdr.cpu.idt.limit = 0xfff;
+    hdr.cpu.cr[3] = g->cr3;
+    hdr.cpu.cr[4] = g->cr4;
+
+    if ((fd = open(g->dump, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+        return -1;
+    if ((in = open(g->image, O_RDONLY)) == -1)
+        goto out;
+
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            ftruncate(fd, PAGE + g->size) == -1)
+        goto out;
+
+    while ((pos = lseek(in, pos, SEEK_DATA)) >= 0) {
+        if ((end = lseek(in, pos, SEEK_HOLE)) < 0)
+            goto out;
+        if (pwrite(fd, g->mem + pos, end - pos, PAGE + pos) != end - pos)
+            goto out;
+        pos = end;
+    }
+    ret = 0;
+
+out:
+    if (in >= 0)
+        close(in);
+    close(fd);
+    return ret;
+}
+
+void bench_guest_destroy(struct bench_guest *g)
+{
+    if (g->mem)
+        munmap(g->mem, g->size);
+    unlink(g->image);
+    unlink(g->dump);
+    unlink(g->map);
+    memset(g, 0, sizeof(*g));
+}
@@ -0,0 +1,97 @@
+/* libvirt_shim.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+/*
+ * The libvirt calls libvirt_client.c makes, built as libvirt.so.0 and
+ * libvirt-qemu.so.0.  The benchmark loads them before the client looks
+ * for libvirt, so the dlopen() by soname finds these, and they hand
+ * everything to the mock in the benchmark itself.  There is one guest,
+ * BENCH_DOMAIN.
+ */
+static int conn, domain;
+
+/* the head of virError, all the client looks at */
+static __thread struct {
+    int code;
+    int domain;
+    const char *message;
+} last_error;
+
+void *virConnectOpen(const char *name)
+{
+    (void)name;
+    return &conn;
+}
+
+int virConnectClose(void *c)
+{
+    (void)c;
+    return 0;
+}
+
+int virConnectListAllDomains(void *c, void ***domains, unsigned int flags)
+{
+    (void)c;
+    (void)flags;
+
+    *domains = calloc(2, sizeof(**domains));
+    (*domains)[0] = &domain;
+    return 1;
+}
+
+void *virDomainLookupByName(void *c, const char *name)
+{
+    (void)c;
+    return strcmp(name, BENCH_DOMAIN) ? NULL : &domain;
+}
+
+const char *virDomainGetName(void *d)
+{
+    (void)d;
+    return BENCH_DOMAIN;
+}
+
+int virDomainFree(void *d)
+{
+    (void)d;
+    return 0;
+}
+
+int virDomainQemuMonitorCommand(void *d, const char *cmd, char **result,
+        unsigned int flags)
+{
+    (void)d;
+    (void)flags;
+    return bench_libvirt_hmp(cmd, result);
+}
+
+int virDomainMemoryPeek(void *d, unsigned long long start, size_t size,
+        void *buffer, unsigned int flags)
+{
+    (void)d;
+    (void)flags;
+    last_error.code = bench_libvirt_peek(start, size, buffer);
+    return last_error.code ? -1 : 0;
+}
+
+void *virGetLastError(void)
+{
+    return last_error.code ? &last_error : NULL;
+}
@@ -0,0 +1,534 @@
+/* mock.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bench.h"
+
+/*
+ * What QEMU's monitor says to the commands kvm-dmesg sends, over QMP
+ * on a unix socket and through the libvirt shim.  Every command costs
+ * mock.latency_us on top of the time it takes to format its output,
+ * the way a real monitor round trip does.
+ */
+struct bench_mock mock;
+
+struct mock_server {
+    int fd;
+    char path[108];
+    pthread_t thread;
+};
+
+/* a growing string */
+struct mock_buf {
+    char *s;
+    size_t len;
+    size_t size;
+};
+
+static void mbuf_reserve(struct mock_buf *b, size_t n)
+{
+    if (b->len + n + 1 <= b->size)
+        return;
+
+    while (b->len + n + 1 > b->size)
+        b->size = b->size ? b->size * 2 : 4096;
+    b->s = realloc(b->s, b->size);
+}
+
+static void mbuf_add(struct mock_buf *b, const char *s, size_t n)
+{
+    mbuf_reserve(b, n);
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = '\0';
+}
+
+static void mbuf_printf(struct mock_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    mbuf_reserve(b, 256);
+    va_start(ap, fmt);
+    n = vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+
+    if ((size_t)n >= b->size - b->len) {
+        mbuf_reserve(b, n);
+        va_start(ap, fmt);
+        vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+}
+
+void mock_reset(void)
+{
+    __atomic_store_n(&mock.calls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&mock.bytes, 0, __ATOMIC_RELAXED);
+}
+
+static void mock_round_trip(void)
+{
+    struct timespec ts;
+
+    __atomic_add_fetch(&mock.calls, 1, __ATOMIC_RELAXED);
+
+    if (!mock.latency_us)
+        return;
+
+    ts.tv_sec = mock.latency_us / 1000000;
+    ts.tv_nsec = (mock.latency_us % 1000000) * 1000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+static int mock_in_guest(uint64_t addr, size_t len)
+{
+    return addr <= mock.guest->size && len <= mock.guest->size - addr;
+}
+
+/*
+ * "xp /<count>x<unit> <addr>" as QEMU prints it, eight bytes or four
+ * words to a line.
+ */
+static int mock_xp(struct mock_buf *out, const char *args, const char *eol)
+{
+    const unsigned char *p;
+    unsigned long count, i;
+    uint64_t addr;
+    char unit;
+    int per_line, width;
+
+    if (sscanf(args, "/%lux%c %" SCNx64, &count, &unit, &addr) != 3)
+        return -1;
+
+    width = unit == 'b' ? 1 : unit == 'h' ? 2 : unit == 'w' ? 4 : 8;
+    per_line = width == 1 ? 8 : 16 / width;
+    if (!mock_in_guest(addr, count * width))
+        return -1;
+
+    p = (const unsigned char *)mock.guest->mem + addr;
+    for (i = 0; i < count; i++, p += width) {
+        uint64_t v = 0;
+
+        if (i % per_line == 0) {
+            if (i)
+                mbuf_add(out, eol, strlen(eol));
+            mbuf_printf(out, "%016" PRIx64 ":", addr + i * width);
+        }
+        memcpy(&v, p, width);
+        mbuf_printf(out, " 0x%0*" PRIx64, width * 2, v);
+    }
+    mbuf_add(out, eol, strlen(eol));
+
+    __atomic_add_fetch(&mock.bytes, count * width, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* the output of an HMP command, lines ending in eol */
+static int mock_hmp(struct mock_buf *out, const char *cmd, const char *eol)
+{
+    struct bench_guest *g = mock.guest;
+    uint64_t gpa;
+
+    if (!strncmp(cmd, "xp ", 3))
+        return mock_xp(out, cmd + 3, eol);
+
+    if (!strcmp(cmd, "info registers")) {
+        mbuf_printf(out, "RAX=0000000000000000 RBX=0000000000000000 "
+                "RCX=0000000000000001 RDX=0000000000000000%s", eol);
+        mbuf_printf(out, "RIP=ffffffff81e3a2cb RFL=00000246 [---Z-P-] CPL=0 II=0 "
+                "A20=1 SMM=0 HLT=1%s", eol);
+        mbuf_printf(out, "GDT=     fffffe0000001000 0000007f%s", eol);
+        mbuf_printf(out, "IDT=     %016" PRIx64 " 00000fff%s", g->idtr, eol);
+        mbuf_printf(out, "CR0=80050033 CR2=00007f0e8a1f4000 CR3=%016" PRIx64
+                " CR4=%08" PRIx64 "%s", g->cr3, g->cr4, eol);
+        return 0;
+    }
+
+    if (!strcmp(cmd, "info mtree -f")) {
+        if (!mock.process)
+            return 0;
+        mbuf_printf(out, "FlatView #0%s AS \"memory\", root: system%s"
+                " Root memory region: system%s"
+                "  0000000000000000-%016zx (prio 0, ram): pc.ram kvm%s",
+                eol, eol, eol, g->size - 1, eol);
+        return 0;
+    }
+
+    if (sscanf(cmd, "gpa2hva %" SCNx64, &gpa) == 1) {
+        if (!mock.process || gpa >= g->size)
+            return -1;
+        mbuf_printf(out, "Host virtual address for 0x%" PRIx64 " (pc.ram) is %p%s",
+                gpa, g->mem + gpa, eol);
+        return 0;
+    }
+
+    return -1;
+}
+
+/* the string value of "key": "value" in a command, NULL if there is none */
+static char *mock_string_arg(const char *cmd, const char *key, char *buf, size_t size)
+{
+    const char *p = strstr(cmd, key), *end;
+
+    if (!p || !(p = strchr(p + strlen(key), '"')) || !(end = strchr(p + 1, '"')) ||
+            (size_t)(end - p - 1) >= size)
+        return NULL;
+
+    memcpy(buf, p + 1, end - p - 1);
+    buf[end - p - 1] = '\0';
+    return buf;
+}
+
+static int mock_number_arg(const char *cmd, const char *key, uint64_t *v)
+{
+    const char *p = strstr(cmd, key);
+
+    return p && sscanf(p + strlen(key), " %" SCNu64, v) == 1 ? 0 : -1;
+}
+
+/* pmemsave into the fd of an fdset, or a file by name */
+static int mock_pmemsave(const char *cmd, int fdset_fd)
+{
+    char filename[256];
+    uint64_t addr, size;
+    ssize_t n;
+    int fd;
+
+    if (!mock.pmemsave || mock_number_arg(cmd, "\"val\":", &addr) ||
+            mock_number_arg(cmd, "\"size\":", &size) ||
+            !mock_string_arg(cmd, "\"filename\":", filename, sizeof(filename)) ||
+            !mock_in_guest(addr, size))
+        return -1;
+
+    if (!strncmp(filename, "/dev/fdset/", strlen("/dev/fdset/"))) {
+        fd = fdset_fd;
+    } else if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        return -1;
+    }
+
+    n = write(fd, mock.guest->mem + addr, size);
+    if (fd != fdset_fd)
+        close(fd);
+
+    __atomic_add_fetch(&mock.bytes, size, __ATOMIC_RELAXED);
+    return n == (ssize_t)size ? 0 : -1;
+}
+
+static void mock_json_string(struct mock_buf *b, const char *s, size_t len)
+{
+    size_t i;
+
+    mbuf_reserve(b, 2 * len + 2);
+    b->s[b->len++] = '"';
+    for (i = 0; i < len; i++) {
+        switch (s[i]) {
+            case '\r': b->s[b->len++] = '\\'; b->s[b->len++] = 'r'; break;
+            case '\n': b->s[b->len++] = '\\'; b->s[b->len++] = 'n'; break;
+            case '"': b->s[b->len++] = '\\'; b->s[b->len++] = '"'; break;
+            case '\\': b->s[b->len++] = '\\'; b->s[b->len++] = '\\'; break;
+            default: b->s[b->len++] = s[i]; break;
+        }
+    }
+    b->s[b->len++] = '"';
+    b->s[b->len] = '\0';
+}
+
+struct mock_conn {
+    int fd;
+    int fdset_fd;                   /* the one add-fd passed, -1 for none */
+    int fdset_id;
+};
+
+static void mock_error(struct mock_buf *reply, const char *class, const char *desc)
+{
+    mbuf_printf(reply, "{\"error\": {\"class\": \"%s\", \"desc\": \"%s\"}", class, desc);
+}
+
+/* the reply to one command, with its id if it had one */
+static void mock_qmp_command(struct mock_conn *c, const char *cmd, struct mock_buf *reply)
+{
+    struct mock_buf out = { 0 };
+    char line[256];
+    const char *id;
+
+    mock_round_trip();
+
+    if (strstr(cmd, "\"qmp_capabilities\"") || strstr(cmd, "\"remove-fd\"")) {
+        mbuf_printf(reply, "{\"return\": {}");
+    } else if (strstr(cmd, "\"add-fd\"")) {
+        if (mock.pmemsave && c->fdset_fd >= 0)
+            mbuf_printf(reply, "{\"return\": {\"fdset-id\": %d, \"fd\": %d}",
+                    ++c->fdset_id, c->fdset_fd);
+        else
+            mock_error(reply, "GenericError", "No file descriptor supplied via SCM_RIGHTS");
+    } else if (strstr(cmd, "\"pmemsave\"")) {
+        if (!mock_pmemsave(cmd, c->fdset_fd))
+            mbuf_printf(reply, "{\"return\": {}");
+        else
+            mock_error(reply, "GenericError", "pmemsave failed");
+    } else if (strstr(cmd, "\"human-monitor-command\"") &&
+            mock_string_arg(cmd, "\"command-line\":", line, sizeof(line))) {
+        if (!mock_hmp(&out, line, "\r\n")) {
+            mbuf_printf(reply, "{\"return\": ");
+            mock_json_string(reply, out.s ? out.s : "", out.len);
+        } else {
+            mock_error(reply, "GenericError", "command failed");
+        }
+    } else {
+        mock_error(reply, "CommandNotFound", "The command has not been found");
+    }
+
+    if ((id = strstr(cmd, "\"id\":")))
+        mbuf_printf(reply, ", \"id\": %u", (unsigned int)strtoul(id + 5, NULL, 10));
+    mbuf_add(reply, "}\r\n", 3);
+
+    free(out.s);
+}
+
+static int mock_write(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* read what comes in, with any fd passed along, into b */
+static int mock_recv(struct mock_conn *c, struct mock_buf *b)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+    int fd;
+
+    mbuf_reserve(b, 65536);
+    iov.iov_base = b->s + b->len;
+    iov.iov_len = b->size - b->len - 1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        n = recvmsg(c->fd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+        if (c->fdset_fd >= 0)
+            close(c->fdset_fd);
+        c->fdset_fd = fd;
+    }
+
+    b->len += n;
+    b->s[b->len] = '\0';
+    return 0;
+}
+
+/*
+ * One client: commands are JSON objects one after the other, answered
+ * in order.  Like QEMU, the next command is only looked at once the
+ * reply to the one before is out.
+ */
+static void *mock_qmp_conn(void *arg)
+{
+    static const char greeting[] = "{\"QMP\": {\"version\": {\"qemu\": {\"micro\": 0, "
+        "\"minor\": 2, \"major\": 8}, \"package\": \"\"}, \"capabilities\": [\"oob\"]}}\r\n";
+    struct mock_conn *c = arg;
+    struct mock_buf in = { 0 }, reply = { 0 };
+    size_t pos = 0, start = 0;
+    int depth = 0, in_str = 0, esc = 0;
+    char saved;
+
+    if (mock_write(c->fd, greeting, strlen(greeting)))
+        goto out;
+
+    while (!mock_recv(c, &in)) {
+        for (; pos < in.len; pos++) {
+            char ch = in.s[pos];
+
+            if (in_str) {
+                if (esc)
+                    esc = 0;
+                else if (ch == '\\')
+                    esc = 1;
+                else if (ch == '"')
+                    in_str = 0;
+                continue;
+            }
+
+            if (ch == '"') {
+                in_str = 1;
+            } else if (ch == '{') {
+                if (!depth++)
+                    start = pos;
+            } else if (ch == '}' && depth && !--depth) {
+                saved = in.s[pos + 1];
+                in.s[pos + 1] = '\0';
+                reply.len = 0;
+                mock_qmp_command(c, in.s + start, &reply);
+                in.s[pos + 1] = saved;
+                if (mock_write(c->fd, reply.s, reply.len))
+                    goto out;
+            }
+        }
+
+        /* keep only what belongs to a command still coming in */
+        if (!depth) {
+            in.len = pos = 0;
+        } else if (start) {
+            memmove(in.s, in.s + start, in.len - start);
+            in.len -= start;
+            pos -= start;
+            start = 0;
+        }
+    }
+
+out:
+    if (c->fdset_fd >= 0)
+        close(c->fdset_fd);
+    close(c->fd);
+    free(in.s);
+    free(reply.s);
+    free(c);
+    return NULL;
+}
+
+static void *mock_qmp_accept(void *arg)
+{
+    struct mock_server *s = arg;
+    struct mock_conn *c;
+    pthread_t thread;
+    int fd;
+
+    while ((fd = accept(s->fd, NULL, NULL)) >= 0) {
+        c = calloc(1, sizeof(*c));
+        c->fd = fd;
+        c->fdset_fd = -1;
+        if (pthread_create(&thread, NULL, mock_qmp_conn, c)) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+struct mock_server *mock_qmp_start(const char *path)
+{
+    struct mock_server *s = calloc(1, sizeof(*s));
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+
+    if ((s->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+            bind(s->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(s->fd, 16) == -1 ||
+            pthread_create(&s->thread, NULL, mock_qmp_accept, s)) {
+        if (s->fd >= 0)
+            close(s->fd);
+        free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+void mock_qmp_stop(struct mock_server *s)
+{
+    if (!s)
+        return;
+
+    /* wakes up accept() */
+    shutdown(s->fd, SHUT_RDWR);
+    pthread_join(s->thread, NULL);
+    close(s->fd);
+    unlink(s->path);
+    free(s);
+}
+
+/*
+ * libvirtd: a peek hands out raw bytes, at most LIBVIRT_PEEK_MAX of them
+ * like its remote protocol, and HMP commands come back as plain text.
+ */
+#define LIBVIRT_PEEK_MAX    (64 * 1024)
+
+int bench_libvirt_peek(unsigned long long start, size_t size, void *buffer)
+{
+    mock_round_trip();
+
+    if (!mock.peek)
+        return BENCH_VIR_ERR_NO_SUPPORT;
+    if (size > LIBVIRT_PEEK_MAX || !mock_in_guest(start, size))
+        return BENCH_VIR_ERR_INVALID_ARG;
+
+    memcpy(buffer, mock.guest->mem + start, size);
+    __atomic_add_fetch(&mock.bytes, size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int bench_libvirt_hmp(const char *cmd, char **result)
+{
+    struct mock_buf out = { 0 };
+
+    mock_round_trip();
+
+    if (mock_hmp(&out, cmd, "\n")) {
+        free(out.s);
+        return -1;
+    }
+
+    *result = out.s ? out.s : strdup("");
+    return 0;
+}
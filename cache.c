@@ -0,0 +1,151 @@
+/* cache.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "defs.h"
+#include "log.h"
+#include "xutil.h"
+#include "cache.h"
+
+/*
+ * What we learn about a kernel build or a guest boot is kept between runs
+ * in small files under $KVM_DMESG_CACHE_DIR, $XDG_CACHE_HOME/kvm-dmesg or
+ * ~/.cache/kvm-dmesg.  A cache file is only ever an optimization: one
+ * that is missing, stale or damaged just means doing the work again.
+ */
+
+/* FNV-1a */
+uint64_t cache_hash(const void *buf, size_t len, uint64_t hash)
+{
+    const unsigned char *p = buf;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static int cache_mkdir(char *dir)
+{
+    char *p;
+
+    for (p = dir + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(dir, 0700) && errno != EEXIST) {
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+
+    if (mkdir(dir, 0700) && errno != EEXIST)
+        return -1;
+
+    return 0;
+}
+
+/* path of the cache file name, -1 when there is no cache to use */
+int cache_path(char *buf, size_t len, const char *name)
+{
+    char dir[4096];
+    const char *env;
+
+    if (pc->no_cache)
+        return -1;
+
+    if ((env = getenv("KVM_DMESG_CACHE_DIR")) && *env)
+        snprintf(dir, sizeof(dir), "%s", env);
+    else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+        snprintf(dir, sizeof(dir), "%s/kvm-dmesg", env);
+    else if ((env = getenv("HOME")) && *env)
+        snprintf(dir, sizeof(dir), "%s/.cache/kvm-dmesg", env);
+    else
+        return -1;
+
+    if (cache_mkdir(dir)) {
+        if (CRASHDEBUG(1))
+            pr_debug("cache: cannot create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    if ((size_t)snprintf(buf, len, "%s/%s", dir, name) >= len)
+        return -1;
+
+    return 0;
+}
+
+/* read a cache file of exactly len bytes */
+int cache_load(const char *path, void *buf, size_t len)
+{
+    struct stat sb;
+    int fd, ret = -1;
+
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        if (!fstat(fd, &sb) && (size_t)sb.st_size == len &&
+                xread(fd, buf, len) == len)
+            ret = 0;
+        close(fd);
+    }
+
+    stats_add(ret ? &gc->stats.cache_misses : &gc->stats.cache_hits, 1);
+    return ret;
+}
+
+/*
+ * Replace a cache file as a whole, so a reader never sees a half written
+ * one, even with several threads or runs storing it at once.
+ */
+int cache_store(const char *path, const void *buf, size_t len)
+{
+    char tmp[4096 + 64];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lx", path, (int)getpid(),
+            (unsigned long)pthread_self());
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        goto err;
+
+    if (xwrite(fd, buf, len) != len) {
+        close(fd);
+        unlink(tmp);
+        goto err;
+    }
+    close(fd);
+
+    if (rename(tmp, path)) {
+        unlink(tmp);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    if (CRASHDEBUG(1))
+        pr_debug("cache: cannot write %s: %s", path, strerror(errno));
+    return -1;
+}
@@ -0,0 +1,29 @@
+/* cache.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_HASH_INIT     (0xcbf29ce484222325ULL)
+
+uint64_t cache_hash(const void *buf, size_t len, uint64_t hash);
+int cache_path(char *buf, size_t len, const char *name);
+int cache_load(const char *path, void *buf, size_t len);
+int cache_store(const char *path, const void *buf, size_t len);
+
+#endif
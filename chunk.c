@@ -0,0 +1,70 @@
+/* chunk.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <string.h>
+
+#include "defs.h"
+#include "log.h"
+#include "chunk.h"
+
+/*
+ * A monitor read costs a round trip plus time linear in its size, so
+ * bigger chunks pay off until the round trip no longer matters, or the
+ * reply gets too big to build quickly.  Samples of CHUNK_TUNE_SAMPLES
+ * chunks are timed at each size; the size doubles as long as that buys
+ * CHUNK_TUNE_GAIN more throughput and falls back one step when it does
+ * not, where it stays.
+ */
+#define CHUNK_TUNE_SAMPLES  (8)
+#define CHUNK_TUNE_GAIN     (1.10)
+
+void chunk_tune_init(struct chunk_tune *t, size_t min, size_t max)
+{
+    memset(t, 0, sizeof(*t));
+    t->size = min;
+    t->max = max;
+}
+
+/* one chunk of bytes took nsec, only full chunks tell something */
+void chunk_tune_done(struct chunk_tune *t, size_t bytes, uint64_t nsec)
+{
+    double rate;
+
+    if (t->settled || bytes != t->size)
+        return;
+
+    t->bytes += bytes;
+    t->nsec += nsec;
+    if (++t->samples < CHUNK_TUNE_SAMPLES)
+        return;
+
+    rate = t->nsec ? (double)t->bytes / t->nsec : 0;
+    t->bytes = t->nsec = t->samples = 0;
+
+    if (rate > t->best * CHUNK_TUNE_GAIN) {
+        t->best = rate;
+        if (t->size * 2 > t->max) {
+            t->settled = TRUE;
+        } else {
+            t->size *= 2;
+        }
+    } else {
+        t->size /= 2;
+        t->settled = TRUE;
+    }
+
+    if (t->settled && CRASHDEBUG(1))
+        pr_debug("chunk size %zu, %.1f MB/s", t->size, t->best * 1000);
+}
@@ -0,0 +1,39 @@
+/* chunk.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __CHUNK_H__
+#define __CHUNK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Chunk size of a backend that reads through monitor commands, grown
+ * while a bigger chunk still buys real throughput, see chunk_tune_done().
+ */
+struct chunk_tune {
+    size_t size;        /* current */
+    size_t max;
+    size_t bytes;       /* of the samples at this size */
+    uint64_t nsec;
+    int samples;
+    double best;        /* bytes per ns of the last size kept */
+    int settled;
+};
+
+void chunk_tune_init(struct chunk_tune *t, size_t min, size_t max);
+void chunk_tune_done(struct chunk_tune *t, size_t bytes, uint64_t nsec);
+
+#endif
@@ -22,34 +22,73 @@
 typedef enum {
     GUEST_NAME,
     GUEST_MEMORY,
+    GUEST_DUMP,
     QMP_SOCKET,
+    QEMU_PROCESS,
 } guest_access_t;
 
-typedef struct {
+/* one range of a batched read */
+struct mem_req {
+    uint64_t addr;      /* physical by the time it reaches the backend */
+    size_t len;
+    void *dst;
+};
+
+typedef struct guest_client {
     guest_access_t ty;
-    int (*get_registers)(uint64_t*, uint64_t*, uint64_t*);
-    int (*readmem)(uint64_t, void*, size_t);
+    void *priv;                 /* state of the backend */
+    int (*get_registers)(struct guest_client*, uint64_t*, uint64_t*, uint64_t*);
+    int (*readmem)(struct guest_client*, uint64_t, void*, size_t);
+    void *(*mapmem)(struct guest_client*, uint64_t, size_t);    /* optional, zero-copy access */
+    int (*readmem_batch)(struct guest_client*, struct mem_req*, int);    /* optional */
 } guest_client_t;
 
-int get_cr3_idtr(uint64_t *cr3, uint64_t *idtr);
+int get_cr3_idtr(uint64_t *cr3, uint64_t *idtr, uint64_t *cr4);
 int readmem(uint64_t addr, int memtype, void *buffer, long size);
+void *peekmem(uint64_t addr, int memtype, long size);
+int readmem_batch(struct mem_req *reqs, int nr, int memtype);
 
+int guest_access_type(const char *ac, guest_access_t *ty);
 int guest_client_new(char *ac, guest_access_t ty);
 int guest_client_release();
 
-int qmp_client_init(char *sock_path);
-int qmp_client_uninit();
-int qmp_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
-int qmp_readmem(uint64_t addr, void *buffer, size_t size);
+/* a monitor connection of its own, also used by the QEMU process backend */
+struct qmp_conn;
+struct qmp_conn *qmp_open(char *sock_path);
+void qmp_close(struct qmp_conn *q);
+int qmp_registers(struct qmp_conn *q, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
+int qmp_read_batch(struct qmp_conn *q, struct mem_req *reqs, int nr);
+int qmp_hmp(struct qmp_conn *q, const char *cmdline, char *out, size_t size);
+int qmp_peer_pid(struct qmp_conn *q);
+
+int qmp_client_init(guest_client_t *c, char *sock_path);
+int qmp_client_uninit(guest_client_t *c);
+int qmp_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
+int qmp_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size);
+int qmp_readmem_batch(guest_client_t *c, struct mem_req *reqs, int nr);
+
+int process_client_init(guest_client_t *c, char *sock_path);
+int process_client_uninit(guest_client_t *c);
+int process_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
+int process_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size);
+
+int libvirt_client_init(guest_client_t *c, char *guest_name);
+int libvirt_client_uninit(guest_client_t *c);
+int libvirt_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
+int libvirt_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size);
+int libvirt_list_domains(char ***names);
 
-int libvirt_client_init(char *guest_name);
-int libvirt_client_uninit();
-int libvirt_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
-int libvirt_readmem(uint64_t addr, void *buffer, size_t size);
+int dump_probe(const char *path);
+int dump_client_init(guest_client_t *c, char *path);
+int dump_client_uninit(guest_client_t *c);
+int dump_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
+int dump_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size);
+void *dump_mapmem(guest_client_t *c, uint64_t addr, size_t size);
 
-int file_client_init(char *sock_path);
-int file_client_uninit();
-int file_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
-int file_readmem(uint64_t addr, void *buffer, size_t size);
+int file_client_init(guest_client_t *c, char *path);
+int file_client_uninit(guest_client_t *c);
+int file_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
+int file_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size);
+void *file_mapmem(guest_client_t *c, uint64_t addr, size_t size);
 
 #endif
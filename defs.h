@@ -21,6 +21,9 @@
 #include <string.h>
 
 #include "client.h"
+#include "arena.h"
+#include "kvmdmesg.h"
+#include "stats.h"
 
 #undef TRUE
 #undef FALSE
@@ -42,6 +45,12 @@ static inline int string_exists(char *s) { return (s ? TRUE : FALSE); }
 
 typedef uint64_t physaddr_t;
 
+/* a run of guest RAM */
+struct phys_range {
+    physaddr_t start;
+    physaddr_t end;
+};
+
 typedef unsigned long int ulong;
 typedef unsigned long long int ulonglong;
 
@@ -49,6 +58,21 @@ typedef unsigned long long int ulonglong;
 
 struct program_context {
     ulong debug;                    /* level of debug */
+    ulong lowmem;                   /* RAM below 4G in a memory-backend file */
+    ulong tail;                     /* only print the last records, 0 for all */
+    uint64_t since;                 /* only print records from this ts_nsec on */
+    uint64_t until;                 /* and up to this one, 0 for no end */
+    unsigned int levels;            /* bits of the levels to print, 0 for all */
+    unsigned int facilities;        /* the same for facilities */
+    const char *grep;               /* only print records containing it */
+    size_t grep_len;
+    int no_cache;                   /* do not use the cache, see cache.c */
+    int threads;                    /* to decode a ring with, 0 for one per CPU */
+    int symbolize;                  /* turn text addresses into sym+off */
+    int stats;                      /* STATS_TEXT or STATS_JSON at the end, see stats.c */
+    int output;                     /* OUTPUT_TEXT and so on, see output.h */
+    const char *spool;              /* directory of the spools, see spool.c */
+    ulong scan_max;                 /* RAM read looking for vmcoreinfo, 0 for the default */
 };
 
 #define RELOC_SET            (0x2000000)
@@ -58,13 +82,26 @@ struct kernel_table {
     ulong relocate;
 };
 
+/*
+ * One translation of the software TLB, see x86_64.c.  Kernel virtual
+ * pages never have page number 0, so vpn 0 marks an empty entry.
+ */
+struct tlb_entry {
+	ulong vpn;
+	physaddr_t paddr;
+};
+
+#define TLB_ENTRIES        (1024)
+
 struct machdep_table {
 	char *pgd;
+	char *p4d;
 	char *pud;
 	char *pmd;
 	char *ptbl;
 
 	ulong last_pgd_read;
+	ulong last_p4d_read;
 	ulong last_pud_read;
 	ulong last_pmd_read;
 	ulong last_ptbl_read;
@@ -73,11 +110,14 @@ struct machdep_table {
 	unsigned int pagesize;
 	unsigned long pageoffset;
 	ulonglong pagemask;
+
+	struct tlb_entry tlb[TLB_ENTRIES];
 };
 
-extern struct machdep_table *machdep;
+extern __thread struct machdep_table *machdep;
 
 #define IS_LAST_PGD_READ(pgd)     ((ulong)(pgd) == machdep->last_pgd_read)
+#define IS_LAST_P4D_READ(p4d)     ((ulong)(p4d) == machdep->last_p4d_read)
 #define IS_LAST_PMD_READ(pmd)     ((ulong)(pmd) == machdep->last_pmd_read)
 #define IS_LAST_PTBL_READ(ptbl)   ((ulong)(ptbl) == machdep->last_ptbl_read)
 #define IS_LAST_PUD_READ(pud)     ((ulong)(pud) == machdep->last_pud_read)
@@ -89,6 +129,12 @@ extern struct machdep_table *machdep;
             machdep->last_pgd_read = (ulong)(PGD);                            \
     }
 
+#define FILL_P4D(P4D, SIZE)                       \
+    if (!IS_LAST_P4D_READ(P4D)) {                                             \
+            readmem((ulonglong)((ulong)(P4D)), PHYSADDR, machdep->p4d, SIZE); \
+            machdep->last_p4d_read = (ulong)(P4D);                            \
+    }
+
 #define FILL_PUD(PUD, SIZE)                       \
     if (!IS_LAST_PUD_READ(PUD)) {                                             \
             readmem((ulonglong)((ulong)(PUD)), PHYSADDR, machdep->pud, SIZE); \
@@ -122,6 +168,7 @@ struct offset_table {
     // struct prb_data_ring
     long prb_data_ring_size_bits;
     long prb_data_ring_data;
+    long prb_data_ring_tail_lpos;
 };
 
 struct size_table {
@@ -139,10 +186,10 @@ struct size_table {
 #define STRUCT_SIZE(X)      datatype_info((X), NULL, STRUCT_SIZE_REQUEST)
 #define MEMBER_OFFSET(X,Y)  datatype_info((X), (Y), MEMBER_OFFSET_REQUEST)
 
-#define OFFSET(X)          (offset_table.X)
-#define SIZE(X)            (size_table.X)
-#define ASSIGN_SIZE(X)     (size_table.X)
-#define ASSIGN_OFFSET(X)   (offset_table.X)
+#define OFFSET(X)          (gc->offset_table.X)
+#define SIZE(X)            (gc->size_table.X)
+#define ASSIGN_SIZE(X)     (gc->size_table.X)
+#define ASSIGN_OFFSET(X)   (gc->offset_table.X)
 
 #define STRUCT_SIZE_INIT(X, Y) (ASSIGN_SIZE(X) = STRUCT_SIZE(Y))
 #define MEMBER_OFFSET_INIT(X, Y, Z) (ASSIGN_OFFSET(X) = MEMBER_OFFSET(Y, Z))
@@ -151,6 +198,7 @@ struct size_table {
 #define UINT(ADDR)      *((uint *)((char *)(ADDR)))
 #define USHORT(ADDR)    *((ushort *)((char *)(ADDR)))
 #define ULONGLONG(ADDR) *((ulonglong *)((char *)(ADDR)))
+#define UCHAR(ADDR)     *((unsigned char *)((char *)(ADDR)))
 
 struct vm_table {
     ulong kernel_pgd[NR_CPUS];
@@ -167,10 +215,19 @@ struct syment {
 #define SYMNAME_HASH_INDEX(name) \
      ((name[0] ^ (name[strlen(name)-1] * name[strlen(name)/2])) % SYMNAME_HASH)
 
+struct vmcoreinfo;
+
 struct symbol_table_data {
     struct syment *symname_hash[SYMNAME_HASH];
     ulong divide_error_vmlinux;
     ulong idt_table_vmlinux;
+
+    /* the index of this System.map in the cache, see symbols.c */
+    uint64_t map_key;
+    struct vmcoreinfo *vmcoreinfo;  /* from the cache, shared by the guests */
+
+    struct arena arena;             /* the symbols and their names */
+    struct ksym_index *ksyms;       /* all text symbols, for --symbolize */
 };
 
 #define KVADDR             (0x1)
@@ -185,10 +242,12 @@ struct symbol_table_data {
 
 struct machine_specific {
     ulong page_offset;
+    ulong vmalloc_start;
     ulong phys_base;
     ulong pgdir_shift;
     ulong ptrs_per_pgd;
     ulong physical_mask_shift;
+    int pgtable_l5;                 /* CR4.LA57: 5-level paging */
 };
 
 #define PAGE_OFFSET     (machdep->machspec->page_offset)
@@ -196,6 +255,15 @@ struct machine_specific {
 #define __START_KERNEL_map    0xffffffff80000000UL
 
 #define PAGE_OFFSET_2_6_27         0xffff880000000000
+#define PAGE_OFFSET_5LEVEL         0xff11000000000000
+
+/* __START_KERNEL_map is followed by the modules area, which is vmalloc'd */
+#define KERNEL_IMAGE_SIZE          (1UL << 30)
+
+#define X86_CR4_LA57         (1UL << 12)
+
+#define _PAGE_PRESENT        (0x001UL)
+#define _PAGE_PSE            (0x080UL)
 
 /*
  * the default page table level for x86_64:
@@ -209,6 +277,17 @@ struct machine_specific {
 #define PTRS_PER_PMD    512
 #define PTRS_PER_PTE    512
 
+/*
+ * 5 level page tables: the pgd moves up to bit 48 and the p4d takes
+ * its old place.
+ */
+#define PGDIR_SHIFT_5LEVEL    48
+#define P4D_SHIFT       39
+#define PTRS_PER_P4D    512
+
+#define PUD_SIZE        (1UL << PUD_SHIFT)
+#define PMD_SIZE        (1UL << PMD_SHIFT)
+
 
 #define __PGDIR_SHIFT  (machdep->machspec->pgdir_shift)
 #define __PTRS_PER_PGD  (machdep->machspec->ptrs_per_pgd)
@@ -216,11 +295,13 @@ struct machine_specific {
 #define pgd_index(address)  (((address) >> __PGDIR_SHIFT) & (__PTRS_PER_PGD-1))
 
 
+#define p4d_index(address)  (((address) >> P4D_SHIFT) & (PTRS_PER_P4D - 1))
 #define pud_index(address)  (((address) >> PUD_SHIFT) & (PTRS_PER_PUD - 1))
 #define pmd_index(address)  (((address) >> PMD_SHIFT) & (PTRS_PER_PMD-1))
 #define pte_index(address)  (((address) >> PAGE_SHIFT) & (PTRS_PER_PTE - 1))
 
 #define __PHYSICAL_MASK_SHIFT_2_6     46
+#define __PHYSICAL_MASK_SHIFT_5LEVEL  52
 
 #define __PHYSICAL_MASK_SHIFT  (machdep->machspec->physical_mask_shift)
 #define __PHYSICAL_MASK        ((1UL << __PHYSICAL_MASK_SHIFT) - 1)
@@ -229,26 +310,99 @@ struct machine_specific {
 #define PAGE_SIZE              (1UL << PAGE_SHIFT)
 #define PHYSICAL_PAGE_MASK    (~(PAGE_SIZE-1) & __PHYSICAL_MASK )
 
+struct prb_map;
+struct ksym_index;
+struct spool;
+
+/*
+ * Everything we know about one guest.  A thread works on one guest at
+ * a time: guest_context_bind() points gc and the shorthands below at
+ * the context of that guest.  A single guest run just uses the
+ * default context.
+ */
+struct guest_context {
+    const char *name;               /* guest as given on the command line */
+    FILE *fp;
+    guest_client_t *client;
+
+    struct program_context program_context;
+    struct kernel_table kernel_table;
+    struct vm_table vm_table;
+    struct symbol_table_data *symtab;    /* may be shared between guests */
+    struct machdep_table machdep_table;
+    struct machine_specific machine_specific;
+    struct offset_table offset_table;
+    struct size_table size_table;
+
+    struct vmcoreinfo *vmcoreinfo;  /* st->vmcoreinfo or read from the guest */
+
+    /* follow mode cursors, see printk.c */
+    struct prb_map *prb;
+    unsigned long prb_next_id;
+    int log_started;
+    uint32_t log_idx;
+    uint64_t log_seq;
+
+    /* where the records are kept as well, see spool.c */
+    struct spool *spool;
+
+    /* where the records go instead of fp, see kvmdmesg.c */
+    kvmdmesg_record_fn record_fn;
+    void *record_arg;
+
+    struct guest_stats stats;
+
+    /*
+     * Memory of the session, and the buffers the guest is read with, see
+     * arena.c: its own, or those of the fleet worker scraping it, kept
+     * from one guest to the next.
+     */
+    struct arena arena;
+    struct buf_cache *bufs;
+    struct buf_cache own_bufs;
+};
+
 /*
  *  Global data (global_data.c)
  */
-extern FILE *fp;
-extern struct program_context program_context, *pc;
-extern struct kernel_table kernel_table, *kt;
-extern struct offset_table offset_table;
-extern struct size_table size_table;
-extern struct vm_table vm_table, *vt;
-extern struct symbol_table_data symbol_table_data, *st;
+extern struct guest_context guest_context_default;
+extern struct symbol_table_data symbol_table_data;
+
+extern __thread struct guest_context *gc;
+extern __thread FILE *fp;
+extern __thread struct program_context *pc;
+extern __thread struct kernel_table *kt;
+extern __thread struct vm_table *vt;
+extern __thread struct symbol_table_data *st;
+
+struct guest_context *guest_context_new(const char *name,
+        struct symbol_table_data *symtab, const struct program_context *options);
+void guest_context_bind(struct guest_context *ctx);
+void guest_context_free(struct guest_context *ctx);
 
 
 /*
  * symbols.c
  */
 void symtab_init(const char*);
+void symtab_free(struct symbol_table_data *symtab);
+void symtab_from_vmcoreinfo(const struct vmcoreinfo *vi);
 ulong symbol_value(char *);
 int kernel_symbol_exists(char *s);
 
 
+/*
+ * x86_64.c
+ */
+void x86_64_init(void);
+void x86_64_post_reloc(void);
+void x86_64_set_pgd(ulong pgd, ulong cr4);
+int x86_64_kvtop(ulong kvaddr, physaddr_t *paddr);
+int x86_64_find_direct_map(struct phys_range *ram, int max);
+int x86_64_is_linear(ulong kvaddr);
+physaddr_t x86_64_linear_to_phys(ulong kvaddr);
+
+
 /*
  *  symbols.c
  */
@@ -0,0 +1,671 @@
+/* dump_client.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "xutil.h"
+#include "defs.h"
+#include "log.h"
+
+/*
+ * Memory dumps of a guest, as written by "virsh dump" or QEMU's
+ * dump-guest-memory: an ELF core with one PT_LOAD per RAM range, or a
+ * kdump-compressed file (the makedumpfile format) of pages that are
+ * compressed one by one.
+ *
+ * The file is mapped and nothing is read up front beyond the headers:
+ * an ELF address is found by a binary search over the PT_LOAD ranges,
+ * a kdump page through a rank table over its bitmap, and compressed
+ * pages are inflated on demand into a small page cache.  The registers
+ * come from the QEMU CPU state note QEMU writes for every vCPU.
+ */
+
+enum dump_format {
+    DUMP_NONE,
+    DUMP_ELF,
+    DUMP_KDUMP,
+};
+
+/* a PT_LOAD segment, the bytes past filesz read as zero */
+struct dump_range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    uint64_t filesz;
+};
+
+#define KDUMP_SIGNATURE         "KDUMP   "
+
+/* struct disk_dump_header of makedumpfile, for 64 bit dumps */
+struct kdump_header {
+    char signature[8];
+    int32_t header_version;
+    char utsname[6 * 65];
+    char pad[6];
+    uint64_t timestamp[2];
+    uint32_t status;
+    int32_t block_size;
+    int32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    int32_t nr_cpus;
+};
+
+/* struct kdump_sub_header, in the block after the header */
+struct kdump_sub_header {
+    uint64_t phys_base;
+    int32_t dump_level;
+    int32_t split;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint64_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint64_t size_note;
+    uint64_t offset_eraseinfo;
+    uint64_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+};
+
+struct kdump_page_desc {
+    int64_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint64_t page_flags;
+};
+
+#define DUMP_DH_COMPRESSED_ZLIB     (0x1)
+#define DUMP_DH_COMPRESSED_LZO      (0x2)
+#define DUMP_DH_COMPRESSED_SNAPPY   (0x4)
+#define DUMP_DH_COMPRESSED_ZSTD     (0x20)
+
+/* the "QEMU" note of a vCPU, QEMUCPUState in QEMU's target/i386/arch_dump.c */
+struct qemu_cpu_segment {
+    uint32_t selector;
+    uint32_t limit;
+    uint32_t flags;
+    uint32_t pad;
+    uint64_t base;
+};
+
+struct qemu_cpu_state {
+    uint32_t version;
+    uint32_t size;
+    uint64_t rax, rbx, rcx, rdx, rsi, rdi, rsp, rbp;
+    uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
+    uint64_t rip, rflags;
+    struct qemu_cpu_segment cs, ds, es, fs, gs, ss;
+    struct qemu_cpu_segment ldt, tr, gdt, idt;
+    uint64_t cr[5];
+    uint64_t kernel_gs_base;
+};
+
+#define DUMP_CACHE_PAGES    (64)
+
+struct dump_cache_slot {
+    uint64_t pfn;
+    int valid;
+    char *data;
+};
+
+struct dump_conn {
+    enum dump_format format;
+    char *map;
+    size_t map_size;
+
+    /* ELF, sorted by start */
+    struct dump_range *ranges;
+    int nr_ranges;
+
+    /* kdump */
+    size_t block_size;
+    uint64_t max_mapnr;
+    const uint8_t *bitmap;          /* the second one, pages in the dump */
+    uint64_t *rank;                 /* pages in the dump before each 64 pfns */
+    const struct kdump_page_desc *descs;
+    struct dump_cache_slot cache[DUMP_CACHE_PAGES];
+    char *zero_page;
+
+    int have_regs;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t idtr;
+};
+
+/*
+ * The decompressors are loaded the first time a page needs one, so
+ * dumps that do not use them work without the libraries installed.
+ */
+static pthread_mutex_t dump_lib_lock = PTHREAD_MUTEX_INITIALIZER;
+static int (*dump_uncompress)(uint8_t *dst, unsigned long *dst_len,
+        const uint8_t *src, unsigned long src_len);
+static size_t (*dump_zstd_decompress)(void *dst, size_t dst_cap,
+        const void *src, size_t src_size);
+static unsigned (*dump_zstd_is_error)(size_t code);
+static int (*dump_snappy_uncompress)(const char *src, size_t src_len,
+        char *dst, size_t *dst_len);
+
+static void *dump_dlsym(const char *lib, const char *sym)
+{
+    void *handle, *f;
+
+    if (!(handle = dlopen(lib, RTLD_NOW))) {
+        pr_err("Error loading %s, %s", lib, dlerror());
+        return NULL;
+    }
+
+    if (!(f = dlsym(handle, sym))) {
+        pr_err("Error loading function: %s", dlerror());
+        dlclose(handle);
+    }
+
+    return f;
+}
+
+static int dump_lib_load(uint32_t flags)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&dump_lib_lock);
+
+    if (flags & DUMP_DH_COMPRESSED_ZLIB) {
+        if (!dump_uncompress)
+            dump_uncompress = dump_dlsym("libz.so.1", "uncompress");
+        ret = dump_uncompress ? 0 : -1;
+    } else if (flags & DUMP_DH_COMPRESSED_ZSTD) {
+        if (!dump_zstd_decompress) {
+            dump_zstd_is_error = dump_dlsym("libzstd.so.1", "ZSTD_isError");
+            if (dump_zstd_is_error)
+                dump_zstd_decompress = dump_dlsym("libzstd.so.1", "ZSTD_decompress");
+        }
+        ret = dump_zstd_decompress ? 0 : -1;
+    } else if (flags & DUMP_DH_COMPRESSED_SNAPPY) {
+        if (!dump_snappy_uncompress)
+            dump_snappy_uncompress = dump_dlsym("libsnappy.so.1", "snappy_uncompress");
+        ret = dump_snappy_uncompress ? 0 : -1;
+    } else {
+        pr_err("Unsupported page compression 0x%x", flags);
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&dump_lib_lock);
+    return ret;
+}
+
+static int dump_decompress(uint32_t flags, const uint8_t *src, size_t src_len,
+        char *dst, size_t dst_len)
+{
+    unsigned long zlen = dst_len;
+    size_t n;
+
+    if (dump_lib_load(flags))
+        return -1;
+
+    if (flags & DUMP_DH_COMPRESSED_ZLIB)
+        return dump_uncompress((uint8_t *)dst, &zlen, src, src_len) == 0 &&
+            zlen == dst_len ? 0 : -1;
+
+    if (flags & DUMP_DH_COMPRESSED_ZSTD) {
+        n = dump_zstd_decompress(dst, dst_len, src, src_len);
+        return !dump_zstd_is_error(n) && n == dst_len ? 0 : -1;
+    }
+
+    n = dst_len;
+    return dump_snappy_uncompress((const char *)src, src_len, dst, &n) == 0 &&
+        n == dst_len ? 0 : -1;
+}
+
+/* true when [off, off + len) is in the file */
+static int dump_in_file(struct dump_conn *d, uint64_t off, uint64_t len)
+{
+    return off <= d->map_size && len <= d->map_size - off;
+}
+
+/* take the registers of the first vCPU from the notes */
+static void dump_parse_notes(struct dump_conn *d, const char *notes, size_t size)
+{
+    const struct qemu_cpu_state *cpu;
+    const Elf64_Nhdr *n;
+    const char *name, *desc;
+    size_t off = 0, namesz, descsz;
+
+    while (off + sizeof(*n) <= size) {
+        n = (const Elf64_Nhdr *)(notes + off);
+        namesz = roundup(n->n_namesz, 4);
+        descsz = roundup(n->n_descsz, 4);
+        if (namesz > size - off - sizeof(*n) ||
+                descsz > size - off - sizeof(*n) - namesz)
+            break;
+
+        name = notes + off + sizeof(*n);
+        desc = name + namesz;
+        off += sizeof(*n) + namesz + descsz;
+
+        if (n->n_namesz != sizeof("QEMU") || memcmp(name, "QEMU", sizeof("QEMU")) ||
+                n->n_descsz < sizeof(*cpu))
+            continue;
+
+        cpu = (const struct qemu_cpu_state *)desc;
+        d->cr3 = cpu->cr[3];
+        d->cr4 = cpu->cr[4];
+        d->idtr = cpu->idt.base;
+        d->have_regs = TRUE;
+
+        if (CRASHDEBUG(1))
+            pr_debug("dump: cr3 0x%" PRIx64 " cr4 0x%" PRIx64 " idt 0x%" PRIx64,
+                    d->cr3, d->cr4, d->idtr);
+        return;
+    }
+}
+
+static int dump_range_cmp(const void *a, const void *b)
+{
+    const struct dump_range *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int dump_elf_init(struct dump_conn *d)
+{
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)d->map;
+    const Elf64_Phdr *ph;
+    const Elf64_Shdr *sh;
+    uint64_t phnum;
+    uint64_t i;
+
+    if (d->map_size < sizeof(*eh) || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+            eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_type != ET_CORE ||
+            eh->e_machine != EM_X86_64) {
+        pr_err("Not an x86_64 ELF core dump");
+        return -1;
+    }
+
+    /* with too many segments for e_phnum, section 0 has the number */
+    phnum = eh->e_phnum;
+    if (phnum == PN_XNUM) {
+        if (!dump_in_file(d, eh->e_shoff, sizeof(*sh)))
+            goto bad;
+        sh = (const Elf64_Shdr *)(d->map + eh->e_shoff);
+        phnum = sh->sh_info;
+    }
+
+    if (!dump_in_file(d, eh->e_phoff, phnum * sizeof(*ph)))
+        goto bad;
+
+    d->ranges = xcalloc(phnum ? phnum : 1, sizeof(*d->ranges));
+    for (i = 0; i < phnum; i++) {
+        ph = (const Elf64_Phdr *)(d->map + eh->e_phoff) + i;
+
+        if (ph->p_type == PT_NOTE && dump_in_file(d, ph->p_offset, ph->p_filesz)) {
+            if (!d->have_regs)
+                dump_parse_notes(d, d->map + ph->p_offset, ph->p_filesz);
+            continue;
+        }
+
+        if (ph->p_type != PT_LOAD || !ph->p_memsz)
+            continue;
+        if (!dump_in_file(d, ph->p_offset, ph->p_filesz < ph->p_memsz ?
+                    ph->p_filesz : ph->p_memsz))
+            goto bad;
+
+        d->ranges[d->nr_ranges].start = ph->p_paddr;
+        d->ranges[d->nr_ranges].end = ph->p_paddr + ph->p_memsz;
+        d->ranges[d->nr_ranges].offset = ph->p_offset;
+        d->ranges[d->nr_ranges].filesz = ph->p_filesz < ph->p_memsz ?
+            ph->p_filesz : ph->p_memsz;
+        d->nr_ranges++;
+    }
+
+    qsort(d->ranges, d->nr_ranges, sizeof(*d->ranges), dump_range_cmp);
+
+    if (CRASHDEBUG(1))
+        pr_debug("dump: ELF core, %d memory ranges", d->nr_ranges);
+
+    return 0;
+
+bad:
+    pr_err("Damaged ELF core dump");
+    return -1;
+}
+
+static int dump_kdump_init(struct dump_conn *d)
+{
+    const struct kdump_header *h = (const struct kdump_header *)d->map;
+    const struct kdump_sub_header *sh;
+    uint64_t off, bitmap_size, words, i, w;
+
+    if (d->map_size < sizeof(*h) || h->block_size <= 0 ||
+            (h->block_size & (h->block_size - 1)) || h->sub_hdr_size <= 0)
+        goto bad;
+
+    d->block_size = h->block_size;
+    if (d->block_size != PAGE_SIZE) {
+        pr_err("kdump block size %zu is not the page size", d->block_size);
+        return -1;
+    }
+
+    if (!dump_in_file(d, d->block_size, sizeof(*sh)))
+        goto bad;
+    sh = (const struct kdump_sub_header *)(d->map + d->block_size);
+
+    d->max_mapnr = h->header_version >= 6 ? sh->max_mapnr_64 : h->max_mapnr;
+
+    if (dump_in_file(d, sh->offset_note, sh->size_note))
+        dump_parse_notes(d, d->map + sh->offset_note, sh->size_note);
+
+    /* the bitmap blocks hold two bitmaps, we need the second */
+    off = (1 + (uint64_t)h->sub_hdr_size) * d->block_size;
+    bitmap_size = (uint64_t)h->bitmap_blocks * d->block_size / 2;
+    if (!dump_in_file(d, off, bitmap_size * 2))
+        goto bad;
+    d->bitmap = (const uint8_t *)d->map + off + bitmap_size;
+
+    if (d->max_mapnr > bitmap_size * 8)
+        d->max_mapnr = bitmap_size * 8;
+
+    words = (d->max_mapnr + 63) / 64;
+    d->rank = xmalloc((words ? words : 1) * sizeof(*d->rank));
+    for (i = 0, off = 0; i < words; i++) {
+        d->rank[i] = off;
+        memcpy(&w, d->bitmap + i * 8, sizeof(w));
+        off += __builtin_popcountll(w);
+    }
+
+    d->descs = (const struct kdump_page_desc *)(d->map +
+            (1 + (uint64_t)h->sub_hdr_size + h->bitmap_blocks) * d->block_size);
+    if (!dump_in_file(d, (const char *)d->descs - d->map, off * sizeof(*d->descs)))
+        goto bad;
+
+    d->zero_page = xcalloc(1, d->block_size);
+    for (i = 0; i < DUMP_CACHE_PAGES; i++)
+        d->cache[i].data = xmalloc(d->block_size);
+
+    if (CRASHDEBUG(1))
+        pr_debug("dump: kdump-compressed, %" PRIu64 " of %" PRIu64 " pages",
+                off, d->max_mapnr);
+
+    return 0;
+
+bad:
+    pr_err("Damaged kdump-compressed dump");
+    return -1;
+}
+
+static enum dump_format dump_format(const char *map, size_t size)
+{
+    if (size >= SELFMAG && !memcmp(map, ELFMAG, SELFMAG))
+        return DUMP_ELF;
+
+    if (size >= sizeof(KDUMP_SIGNATURE) - 1 &&
+            !memcmp(map, KDUMP_SIGNATURE, sizeof(KDUMP_SIGNATURE) - 1))
+        return DUMP_KDUMP;
+
+    return DUMP_NONE;
+}
+
+/* whether path is a dump rather than a flat memory image */
+int dump_probe(const char *path)
+{
+    char magic[8];
+    int fd, ret;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return FALSE;
+
+    ret = xread(fd, magic, sizeof(magic)) == sizeof(magic) &&
+        dump_format(magic, sizeof(magic)) != DUMP_NONE;
+
+    close(fd);
+    return ret;
+}
+
+int dump_client_uninit(guest_client_t *c)
+{
+    struct dump_conn *d = c->priv;
+    int i;
+
+    if (!d)
+        return 0;
+
+    for (i = 0; i < DUMP_CACHE_PAGES; i++)
+        xfree(d->cache[i].data);
+    xfree(d->zero_page);
+    xfree(d->rank);
+    xfree(d->ranges);
+    if (d->map)
+        munmap(d->map, d->map_size);
+    xfree(d);
+
+    c->priv = NULL;
+    return 0;
+}
+
+int dump_client_init(guest_client_t *c, char *path)
+{
+    struct dump_conn *d;
+    struct stat st;
+    int fd, ret;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        pr_err("open error");
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+        pr_err("cannot get the size of %s", path);
+        close(fd);
+        return -1;
+    }
+
+    d = xcalloc(1, sizeof(*d));
+    c->priv = d;
+
+    d->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (d->map == MAP_FAILED) {
+        pr_err("mmap error");
+        d->map = NULL;
+        goto err;
+    }
+    d->map_size = st.st_size;
+    madvise(d->map, d->map_size, MADV_RANDOM);
+
+    d->format = dump_format(d->map, d->map_size);
+    ret = d->format == DUMP_ELF ? dump_elf_init(d) : dump_kdump_init(d);
+    if (ret)
+        goto err;
+
+    if (!d->have_regs)
+        pr_warning("%s has no QEMU CPU state, cannot find the page tables", path);
+
+    return 0;
+
+err:
+    dump_client_uninit(c);
+    return -1;
+}
+
+int dump_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
+{
+    struct dump_conn *d = c->priv;
+
+    if (!d->have_regs)
+        return -1;
+
+    *idtr = d->idtr;
+    *cr3 = d->cr3;
+    *cr4 = d->cr4;
+    return 0;
+}
+
+/* the PT_LOAD range that has addr, NULL if there is none */
+static const struct dump_range *dump_elf_range(struct dump_conn *d, uint64_t addr)
+{
+    int lo = 0, hi = d->nr_ranges - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (addr < d->ranges[mid].start)
+            hi = mid - 1;
+        else if (addr >= d->ranges[mid].end)
+            lo = mid + 1;
+        else
+            return &d->ranges[mid];
+    }
+
+    return NULL;
+}
+
+static int dump_elf_readmem(struct dump_conn *d, uint64_t addr, uint8_t *buf, size_t size)
+{
+    const struct dump_range *r;
+    uint64_t off;
+    size_t n, f;
+
+    while (size) {
+        if (!(r = dump_elf_range(d, addr)))
+            return -1;
+
+        off = addr - r->start;
+        n = r->end - addr < size ? r->end - addr : size;
+        f = off < r->filesz ? (r->filesz - off < n ? r->filesz - off : n) : 0;
+
+        memcpy(buf, d->map + r->offset + off, f);
+        memset(buf + f, 0, n - f);
+
+        addr += n;
+        buf += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* the page at pfn; pages left out of the dump read as zero */
+static const char *dump_kdump_page(struct dump_conn *d, uint64_t pfn)
+{
+    const struct kdump_page_desc *pd;
+    struct dump_cache_slot *slot;
+    uint64_t w, idx;
+    unsigned bit;
+
+    if (pfn >= d->max_mapnr)
+        return NULL;
+
+    memcpy(&w, d->bitmap + pfn / 64 * 8, sizeof(w));
+    bit = pfn % 64;
+    if (!(w & (1ULL << bit)))
+        return d->zero_page;
+
+    idx = d->rank[pfn / 64] + __builtin_popcountll(w & ((1ULL << bit) - 1));
+    pd = &d->descs[idx];
+    if (pd->offset < 0 || !dump_in_file(d, pd->offset, pd->size))
+        return NULL;
+
+    if (!(pd->flags & (DUMP_DH_COMPRESSED_ZLIB | DUMP_DH_COMPRESSED_LZO |
+                    DUMP_DH_COMPRESSED_SNAPPY | DUMP_DH_COMPRESSED_ZSTD))) {
+        if (pd->size != d->block_size)
+            return NULL;
+        return d->map + pd->offset;
+    }
+
+    slot = &d->cache[pfn % DUMP_CACHE_PAGES];
+    if (slot->valid && slot->pfn == pfn)
+        return slot->data;
+
+    slot->valid = FALSE;
+    if (dump_decompress(pd->flags, (const uint8_t *)d->map + pd->offset, pd->size,
+                slot->data, d->block_size)) {
+        pr_err("Cannot decompress page 0x%" PRIx64, pfn);
+        return NULL;
+    }
+    slot->pfn = pfn;
+    slot->valid = TRUE;
+
+    return slot->data;
+}
+
+static int dump_kdump_readmem(struct dump_conn *d, uint64_t addr, uint8_t *buf, size_t size)
+{
+    const char *page;
+    size_t off, n;
+
+    while (size) {
+        if (!(page = dump_kdump_page(d, addr / d->block_size)))
+            return -1;
+
+        off = addr % d->block_size;
+        n = d->block_size - off < size ? d->block_size - off : size;
+        memcpy(buf, page + off, n);
+
+        addr += n;
+        buf += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+int dump_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size)
+{
+    struct dump_conn *d = c->priv;
+    int ret;
+
+    if (d->format == DUMP_ELF)
+        ret = dump_elf_readmem(d, addr, buffer, size);
+    else
+        ret = dump_kdump_readmem(d, addr, buffer, size);
+
+    if (ret)
+        pr_err("0x%" PRIx64 "-0x%" PRIx64 " is not in the dump",
+                addr, addr + size);
+    else
+        stats_add(&gc->stats.bytes_received, size);
+    return ret;
+}
+
+/*
+ * Only the bytes an ELF segment has in the file can be used in place;
+ * kdump pages may be compressed and cached pages do not stay put.
+ */
+void *dump_mapmem(guest_client_t *c, uint64_t addr, size_t size)
+{
+    struct dump_conn *d = c->priv;
+    const struct dump_range *r;
+
+    if (d->format != DUMP_ELF || !(r = dump_elf_range(d, addr)))
+        return NULL;
+
+    if (addr - r->start > r->filesz || size > r->filesz - (addr - r->start))
+        return NULL;
+
+    return d->map + r->offset + (addr - r->start);
+}
@@ -0,0 +1,235 @@
+/* fleet.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "xutil.h"
+#include "defs.h"
+#include "log.h"
+#include "fleet.h"
+#include "output.h"
+
+/*
+ * Several guests are scraped at once by a pool of worker threads, each
+ * taking the next guest off the list and running it in a guest context
+ * of its own.  Guests with the same System.map share one symbol table,
+ * loaded before the workers start and only read after that.  Guests
+ * without one get an empty table of their own, filled from their
+ * vmcoreinfo.
+ *
+ * The log of a guest is either written to a file of its own, or kept in
+ * memory and printed as a whole, every line prefixed with the guest, so
+ * the logs of different guests never interleave.
+ */
+
+struct fleet_symtab {
+    const char *map;
+    struct symbol_table_data *symtab;
+};
+
+struct fleet {
+    struct fleet_guest *guests;
+    struct symbol_table_data **symtabs;     /* per guest */
+    int nr;
+    int next;                               /* next guest to take */
+    int failed;
+    const char *output_dir;
+    int (*scrape)(char *);
+    pthread_mutex_t output_lock;
+};
+
+static struct symbol_table_data *fleet_symtab(struct fleet_symtab *cache,
+        int *nr, const char *map)
+{
+    struct symbol_table_data *saved = st;
+    int i;
+
+    for (i = 0; i < *nr; i++) {
+        if (cache[i].map && STREQ(cache[i].map, map))
+            return cache[i].symtab;
+    }
+
+    cache[*nr].map = map;
+    cache[*nr].symtab = xcalloc(1, sizeof(struct symbol_table_data));
+
+    st = cache[*nr].symtab;
+    symtab_init(map);
+    st = saved;
+
+    return cache[(*nr)++].symtab;
+}
+
+/* DIR/<guest>.log, with the slashes of a path turned into '_' */
+static FILE *fleet_open_output(const char *dir, const char *name)
+{
+    char path[4096];
+    size_t n;
+    char *p;
+    FILE *f;
+
+    while (*name == '/')
+        name++;
+
+    n = snprintf(path, sizeof(path), "%s/", dir);
+    snprintf(path + n, sizeof(path) - n, "%s.log", name);
+    for (p = path + n; *p; p++) {
+        if (*p == '/')
+            *p = '_';
+    }
+
+    if (!(f = fopen(path, "w")))
+        pr_err("Cannot create %s: %s", path, strerror(errno));
+
+    return f;
+}
+
+static void fleet_print(struct fleet *fl, const char *name, char *buf, size_t len)
+{
+    FILE *out = guest_context_default.fp;   /* stdout or a sink */
+    char *line, *end = buf + len;
+    char *nl;
+
+    pthread_mutex_lock(&fl->output_lock);
+
+    if (pc->output == OUTPUT_TEXT) {
+        for (line = buf; line < end; line = nl + 1) {
+            if (!(nl = memchr(line, '\n', end - line)))
+                nl = end;
+            fprintf(out, "%s: %.*s\n", name, (int)(nl - line), line);
+        }
+    } else {
+        /* JSON and syslog records say which guest they are from themselves */
+        fwrite(buf, 1, len, out);
+    }
+    fflush(out);
+
+    pthread_mutex_unlock(&fl->output_lock);
+}
+
+static void fleet_scrape(struct fleet *fl, int i, struct buf_cache *bufs)
+{
+    struct fleet_guest *g = &fl->guests[i];
+    struct guest_context *ctx;
+    char *buf = NULL;
+    size_t len = 0;
+
+    ctx = guest_context_new(g->ac, fl->symtabs[i],
+            &guest_context_default.program_context);
+    ctx->bufs = bufs;
+
+    if (fl->output_dir)
+        ctx->fp = fleet_open_output(fl->output_dir, g->ac);
+    else
+        ctx->fp = open_memstream(&buf, &len);
+
+    if (!ctx->fp) {
+        g->status = -1;
+        goto out;
+    }
+
+    guest_context_bind(ctx);
+    log_set_prefix(g->ac);
+    out_begin();
+
+    g->status = fl->scrape(g->ac);
+
+    log_set_prefix(NULL);
+    guest_context_bind(&guest_context_default);
+
+    fclose(ctx->fp);
+    if (buf) {
+        fleet_print(fl, g->ac, buf, len);
+        free(buf);
+    }
+
+out:
+    g->stats = ctx->stats;
+    guest_context_free(ctx);
+}
+
+static void *fleet_worker(void *arg)
+{
+    struct fleet *fl = arg;
+    struct buf_cache bufs = { 0 };
+    int i;
+
+    /* the buffers of one guest are there for the next */
+    while ((i = __sync_fetch_and_add(&fl->next, 1)) < fl->nr) {
+        fleet_scrape(fl, i, &bufs);
+        if (fl->guests[i].status)
+            __sync_fetch_and_add(&fl->failed, 1);
+    }
+
+    buf_cache_release(&bufs);
+    return NULL;
+}
+
+/* scrape all guests, jobs at a time, returns how many of them failed */
+int fleet_run(struct fleet_guest *guests, int nr, int jobs,
+        const char *output_dir, int (*scrape)(char *))
+{
+    struct fleet_symtab *cache;
+    pthread_t *threads;
+    struct fleet fl;
+    int i, nr_cache = 0, nr_threads = 0;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.guests = guests;
+    fl.nr = nr;
+    fl.output_dir = output_dir;
+    fl.scrape = scrape;
+    pthread_mutex_init(&fl.output_lock, NULL);
+
+    cache = xcalloc(nr, sizeof(*cache));
+    fl.symtabs = xcalloc(nr, sizeof(*fl.symtabs));
+    for (i = 0; i < nr; i++) {
+        if (!guests[i].map) {
+            cache[nr_cache].symtab = xcalloc(1, sizeof(struct symbol_table_data));
+            fl.symtabs[i] = cache[nr_cache++].symtab;
+            continue;
+        }
+        fl.symtabs[i] = fleet_symtab(cache, &nr_cache, guests[i].map);
+    }
+
+    if (jobs > nr)
+        jobs = nr;
+
+    threads = xcalloc(jobs, sizeof(*threads));
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, fleet_worker, &fl))
+            break;
+        nr_threads++;
+    }
+
+    /* no thread at all, do it ourselves */
+    if (!nr_threads)
+        fleet_worker(&fl);
+
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    xfree(threads);
+
+    for (i = 0; i < nr_cache; i++)
+        symtab_free(cache[i].symtab);
+    xfree(cache);
+    xfree(fl.symtabs);
+    pthread_mutex_destroy(&fl.output_lock);
+
+    return fl.failed;
+}
@@ -0,0 +1,33 @@
+/* fleet.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __FLEET_H__
+#define __FLEET_H__
+
+#include "stats.h"
+
+#define FLEET_JOBS  (8)
+
+struct fleet_guest {
+    char *ac;                   /* domain, socket or memory file */
+    const char *map;            /* its System.map */
+    int status;
+    struct guest_stats stats;   /* of its scrape */
+};
+
+int fleet_run(struct fleet_guest *guests, int nr, int jobs,
+        const char *output_dir, int (*scrape)(char *));
+
+#endif
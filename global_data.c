@@ -13,24 +13,75 @@
  * GNU General Public License for more details.
  */
 
+#include <stdlib.h>
+
+#include "xutil.h"
 #include "defs.h"
+#include "printk.h"
+#include "vmcoreinfo.h"
 
-FILE *fp;
+struct symbol_table_data symbol_table_data = { 0 };
 
-struct program_context program_context = { 0 };
-struct program_context *pc = &program_context;
+struct guest_context guest_context_default = {
+    .symtab = &symbol_table_data,
+    .bufs = &guest_context_default.own_bufs,
+};
 
-struct kernel_table kernel_table = { 0 };
-struct kernel_table *kt = &kernel_table;
+/*
+ * The shorthands start out on the default context in every thread;
+ * threads working on other guests rebind them.
+ */
+__thread struct guest_context *gc = &guest_context_default;
+__thread FILE *fp;
+__thread struct program_context *pc = &guest_context_default.program_context;
+__thread struct kernel_table *kt = &guest_context_default.kernel_table;
+__thread struct vm_table *vt = &guest_context_default.vm_table;
+__thread struct symbol_table_data *st = &symbol_table_data;
+__thread struct machdep_table *machdep = &guest_context_default.machdep_table;
 
-struct vm_table vm_table = { 0 };
-struct vm_table *vt = &vm_table;
+/* a context for another guest, with its own copy of options */
+struct guest_context *guest_context_new(const char *name,
+        struct symbol_table_data *symtab, const struct program_context *options)
+{
+    struct guest_context *ctx = xcalloc(1, sizeof(*ctx));
 
-struct symbol_table_data symbol_table_data = { 0 };
-struct symbol_table_data *st = &symbol_table_data;
+    ctx->name = name;
+    ctx->fp = guest_context_default.fp;
+    ctx->program_context = *options;
+    ctx->symtab = symtab;
+    ctx->bufs = &ctx->own_bufs;
+
+    return ctx;
+}
+
+void guest_context_bind(struct guest_context *ctx)
+{
+    gc = ctx;
+    fp = ctx->fp;
+    pc = &ctx->program_context;
+    kt = &ctx->kernel_table;
+    vt = &ctx->vm_table;
+    st = ctx->symtab;
+    machdep = &ctx->machdep_table;
+}
+
+/* the guest client is released by the caller, the symbols are not ours */
+void guest_context_free(struct guest_context *ctx)
+{
+    struct guest_context *prev = gc;
 
-struct machdep_table machdep_table = { 0 };
-struct machdep_table *machdep = &machdep_table;
+    guest_context_bind(ctx);
+    dump_lockless_record_log_release();
+    guest_context_bind(prev == ctx ? &guest_context_default : prev);
 
-struct offset_table offset_table = { 0 };
-struct size_table size_table = { 0 };
+    xfree(ctx->machdep_table.pgd);
+    xfree(ctx->machdep_table.p4d);
+    xfree(ctx->machdep_table.pud);
+    xfree(ctx->machdep_table.pmd);
+    xfree(ctx->machdep_table.ptbl);
+    if (ctx->vmcoreinfo != ctx->symtab->vmcoreinfo)
+        vmcoreinfo_free(ctx->vmcoreinfo);
+    arena_release(&ctx->arena);
+    buf_cache_release(&ctx->own_bufs);
+    xfree(ctx);
+}
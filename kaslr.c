@@ -0,0 +1,345 @@
+/* kaslr.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdint.h>
+
+#include "log.h"
+#include "xutil.h"
+#include "defs.h"
+#include "client.h"
+#include "cache.h"
+#include "vmcoreinfo.h"
+#include "kaslr.h"
+
+static ulong get_vec0_addr(ulong idtr)
+{
+    struct gate_struct64 {
+        uint16_t offset_low;
+        uint16_t segment;
+        uint32_t ist : 3, zero0 : 5, type : 5, dpl : 2, p : 1;
+        uint16_t offset_middle;
+        uint32_t offset_high;
+        uint32_t zero1;
+    } __attribute__((packed)) gate;
+
+    if (readmem(idtr, PHYSADDR, &gate, sizeof(gate)))
+        return 0;
+
+    return ((ulong)gate.offset_high << 32)
+        + ((ulong)gate.offset_middle << 16)
+        + gate.offset_low;
+}
+
+#define PTI_USER_PGTABLE_BIT    PAGE_SHIFT
+#define PTI_USER_PGTABLE_MASK   (1 << PTI_USER_PGTABLE_BIT)
+#define CR3_PCID_MASK           0xFFFull
+static int calc_kaslr_offset(ulong *kaslr_offset, ulong *phys_base)
+{
+    uint64_t cr3 = 0, cr4 = 0, idtr = 0, pgd = 0, idtr_paddr;
+    ulong divide_error_vmcore;
+
+    get_cr3_idtr(&cr3, &idtr, &cr4);
+
+    pgd = cr3 & ~(CR3_PCID_MASK|PTI_USER_PGTABLE_MASK);
+
+    x86_64_set_pgd(pgd, cr4);
+    if (x86_64_kvtop(idtr, &idtr_paddr)) {
+        pr_err("Cannot translate the IDT address %" PRIx64, idtr);
+        return -1;
+    }
+
+    divide_error_vmcore = get_vec0_addr(idtr_paddr);
+    *kaslr_offset = divide_error_vmcore - st->divide_error_vmlinux;
+    *phys_base = idtr_paddr -
+        (st->idt_table_vmlinux + *kaslr_offset - __START_KERNEL_map);
+
+    if (CRASHDEBUG(1)) {
+        pr_debug("kaslr_offset: idtr=%lx", idtr);
+        pr_debug("kaslr_offset: pgd=%lx", pgd);
+        pr_debug("kaslr_offset: idtr(phys)=%lx", idtr_paddr);
+        pr_debug("kaslr_offset: divide_error(vmcore): %lx", divide_error_vmcore);
+    }
+
+    if (CRASHDEBUG(1)) {
+        pr_debug("kaslr_offset: kaslr_offset=%lx", *kaslr_offset);
+        pr_debug("kaslr_offset: phys_base   =%lx", *phys_base);
+    }
+
+    return 0;
+}
+
+static void set_kaslr_offset(ulong kaslr_offset, ulong phys_base)
+{
+    if (kaslr_offset) {
+        kt->relocate = kaslr_offset * -1;
+        kt->flags |= RELOC_SET;
+    } else {
+        kt->relocate = 0;
+        kt->flags &= ~RELOC_SET;
+    }
+
+    machdep->machspec->phys_base = phys_base;
+}
+
+static int derive_kaslr_offset(void)
+{
+    ulong kaslr_offset = 0;
+    ulong phys_base = 0;
+    int ret;
+
+    ret = calc_kaslr_offset(&kaslr_offset, &phys_base);
+    set_kaslr_offset(kaslr_offset, phys_base);
+
+    return ret;
+}
+
+/*
+ * What derive_kaslr_offset() and x86_64_post_reloc() found out about a
+ * guest, kept in the cache under the guest and its System.map.  It is
+ * only trusted once the divide error gate in idt_table, where these
+ * values put it, points at the divide error handler; a guest that
+ * rebooted with another layout fails that and gets probed again.
+ */
+#define KASLR_CACHE_MAGIC  "KDKASLR1"
+
+struct kaslr_cache {
+    char magic[8];
+    uint64_t key;
+    uint64_t kaslr_offset;
+    uint64_t phys_base;
+    uint64_t pgd;
+    uint64_t cr4;
+    uint64_t page_offset;
+    uint64_t vmalloc_start;
+};
+
+static uint64_t kaslr_cache_key(const char *guest_ac, char *path, size_t len)
+{
+    uint64_t key;
+    char name[64];
+
+    key = cache_hash(guest_ac, strlen(guest_ac), CACHE_HASH_INIT);
+    key = cache_hash(&st->map_key, sizeof(st->map_key), key);
+
+    snprintf(name, sizeof(name), "kaslr-%016llx", (unsigned long long)key);
+    if (cache_path(path, len, name))
+        return 0;
+
+    return key;
+}
+
+static int kaslr_cache_load(const char *guest_ac)
+{
+    struct machine_specific *ms = machdep->machspec;
+    struct kaslr_cache kc;
+    char path[4096];
+    uint64_t key;
+    physaddr_t idt;
+
+    if (!(key = kaslr_cache_key(guest_ac, path, sizeof(path))) ||
+            cache_load(path, &kc, sizeof(kc)) ||
+            memcmp(kc.magic, KASLR_CACHE_MAGIC, sizeof(kc.magic)) ||
+            kc.key != key)
+        return -1;
+
+    set_kaslr_offset(kc.kaslr_offset, kc.phys_base);
+
+    idt = x86_64_linear_to_phys(st->idt_table_vmlinux + kc.kaslr_offset);
+    if (get_vec0_addr(idt) != st->divide_error_vmlinux + kc.kaslr_offset) {
+        if (CRASHDEBUG(1))
+            pr_debug("kaslr_offset: cached values are stale");
+        set_kaslr_offset(0, 0);
+        return -1;
+    }
+
+    x86_64_set_pgd(kc.pgd, kc.cr4);
+    ms->page_offset = kc.page_offset;
+    ms->vmalloc_start = kc.vmalloc_start;
+
+    if (CRASHDEBUG(1))
+        pr_debug("kaslr_offset: kaslr_offset=%lx phys_base=%lx from %s",
+                (ulong)kc.kaslr_offset, (ulong)kc.phys_base, path);
+
+    return 0;
+}
+
+static void kaslr_cache_store(const char *guest_ac)
+{
+    struct machine_specific *ms = machdep->machspec;
+    struct kaslr_cache kc = { 0 };
+    char path[4096];
+    ulong init_top_pgt;
+
+    if (!(kc.key = kaslr_cache_key(guest_ac, path, sizeof(path))))
+        return;
+
+    memcpy(kc.magic, KASLR_CACHE_MAGIC, sizeof(kc.magic));
+    kc.kaslr_offset = (kt->flags & RELOC_SET) ? -kt->relocate : 0;
+    kc.phys_base = ms->phys_base;
+    kc.cr4 = ms->pgtable_l5 ? X86_CR4_LA57 : 0;
+    kc.page_offset = ms->page_offset;
+    kc.vmalloc_start = ms->vmalloc_start;
+
+    /*
+     * CR3 is the page table of whatever ran last, which may be gone by
+     * the next run.  The kernel's own one lives as long as the boot.
+     */
+    kc.pgd = vt->kernel_pgd[0];
+    if (kernel_symbol_exists("init_top_pgt")) {
+        init_top_pgt = symbol_value("init_top_pgt") + kc.kaslr_offset;
+        kc.pgd = x86_64_linear_to_phys(init_top_pgt);
+    }
+
+    cache_store(path, &kc, sizeof(kc));
+}
+
+/*
+ * struct new_utsname is six strings of UTS_LEN, release is the third.
+ * Kernels before 5.11 do not give OFFSET(uts_namespace.name); theirs is
+ * after the kref.
+ */
+#define UTS_LEN                 (65)
+#define UTS_RELEASE             (2 * UTS_LEN)
+#define UTS_NAME_AFTER_KREF     (4)
+
+/* the init_uts_ns that vi points at holds its OSRELEASE */
+static int vmcoreinfo_release_matches(const struct vmcoreinfo *vi)
+{
+    const char *osrelease = vmcoreinfo_string(vi, "OSRELEASE");
+    char release[UTS_LEN];
+    long uts, name;
+    physaddr_t paddr;
+
+    if (!osrelease || vmcoreinfo_number(vi, "SYMBOL(init_uts_ns)", &uts))
+        return FALSE;
+    if (vmcoreinfo_number(vi, "OFFSET(uts_namespace.name)", &name))
+        name = UTS_NAME_AFTER_KREF;
+
+    if (x86_64_kvtop((ulong)uts + name + UTS_RELEASE, &paddr) ||
+            readmem(paddr, PHYSADDR, release, sizeof(release)))
+        return FALSE;
+
+    release[UTS_LEN - 1] = '\0';
+    return streq(release, osrelease);
+}
+
+/*
+ * A vmcoreinfo is that of the running kernel if the divide error handler
+ * the IDT points at is in its text, the page tables map it where its
+ * KERNELOFFSET and phys_base say, and its init_uts_ns has its release.
+ * Copies left in RAM by an earlier boot were mostly loaded elsewhere,
+ * virtually or physically; the release tells those of another kernel
+ * apart that were not, without KASLR or by chance.
+ */
+static int vmcoreinfo_valid(const struct vmcoreinfo *vi, void *arg)
+{
+    ulong handler = *(ulong *)arg;
+    long offset = 0, phys_base = 0, stext;
+    physaddr_t paddr;
+
+    if (vmcoreinfo_number(vi, "KERNELOFFSET", &offset) ||
+            vmcoreinfo_number(vi, "NUMBER(phys_base)", &phys_base))
+        return FALSE;
+
+    if (vmcoreinfo_number(vi, "SYMBOL(_stext)", &stext))
+        stext = __START_KERNEL_map + offset;
+    if (handler < (ulong)stext || handler - (ulong)stext >= KERNEL_IMAGE_SIZE)
+        return FALSE;
+
+    return !x86_64_kvtop(handler, &paddr) &&
+        paddr == handler - __START_KERNEL_map + phys_base &&
+        vmcoreinfo_release_matches(vi);
+}
+
+#define KASLR_RAM_RUNS  (64)
+
+/*
+ * Without a System.map there is no idt_table to find KASLR from.  The
+ * vmcoreinfo of the kernel has it all instead: KERNELOFFSET, phys_base
+ * and the symbols we need.  It is looked for in the RAM behind the
+ * direct map of the guest.
+ */
+static int kaslr_from_vmcoreinfo(const char *guest_ac)
+{
+    uint64_t cr3 = 0, cr4 = 0, idtr = 0;
+    struct phys_range ram[KASLR_RAM_RUNS];
+    struct vmcoreinfo *vi;
+    physaddr_t idtr_paddr;
+    long offset = 0, phys_base = 0;
+    ulong handler;
+    int nr;
+
+    get_cr3_idtr(&cr3, &idtr, &cr4);
+    x86_64_set_pgd(cr3 & ~(CR3_PCID_MASK|PTI_USER_PGTABLE_MASK), cr4);
+
+    if ((nr = x86_64_find_direct_map(ram, KASLR_RAM_RUNS)) <= 0) {
+        pr_err("Cannot find the direct map of the guest");
+        return -1;
+    }
+
+    if (x86_64_kvtop(idtr, &idtr_paddr) || !(handler = get_vec0_addr(idtr_paddr))) {
+        pr_err("Cannot read the IDT at %" PRIx64, idtr);
+        return -1;
+    }
+
+    if (!(vi = vmcoreinfo_find(guest_ac, ram, nr, vmcoreinfo_valid, &handler))) {
+        pr_err("Cannot find the vmcoreinfo of the guest kernel, which needs 4.15 or later "
+                "without a System.map");
+        return -1;
+    }
+
+    vmcoreinfo_number(vi, "KERNELOFFSET", &offset);
+    vmcoreinfo_number(vi, "NUMBER(phys_base)", &phys_base);
+    set_kaslr_offset(offset, phys_base);
+    symtab_from_vmcoreinfo(vi);
+    x86_64_post_reloc();
+
+    gc->vmcoreinfo = vi;
+
+    if (CRASHDEBUG(1)) {
+        pr_debug("kaslr_offset: kaslr_offset=%lx", offset);
+        pr_debug("kaslr_offset: phys_base   =%lx", phys_base);
+    }
+
+    return 0;
+}
+
+/*
+ * Find where the kernel of the guest client is: straight from the cache
+ * when the guest did not reboot since, otherwise from its registers.
+ */
+int kaslr_init(const char *guest_ac)
+{
+    uint64_t start = xclock_ns();
+    int probed = TRUE;
+
+    x86_64_init();
+
+    if (!st->idt_table_vmlinux) {
+        probed = !kaslr_from_vmcoreinfo(guest_ac);
+    } else if (kaslr_cache_load(guest_ac)) {
+        probed = !derive_kaslr_offset();
+        x86_64_post_reloc();
+        if (probed)
+            kaslr_cache_store(guest_ac);
+    }
+
+    stats_stop(STATS_KASLR, start);
+    return probed ? 0 : -1;
+}
+
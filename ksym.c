@@ -0,0 +1,194 @@
+/* ksym.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xutil.h"
+#include "ksym.h"
+
+/*
+ * A System.map has some hundred thousand text symbols, and a ring of a
+ * crashing guest can be full of addresses, so a lookup has to be cheap.
+ * The search runs over the start addresses in Eytzinger order, the
+ * implicit tree of a binary search laid out level by level: the first
+ * steps of every search touch the same few cache lines, and the next
+ * ones can be prefetched.
+ */
+
+struct ksym_entry {
+    uint64_t addr;
+    uint32_t name;
+};
+
+static int ksym_entry_cmp(const void *a, const void *b)
+{
+    const struct ksym_entry *x = a, *y = b;
+
+    if (x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+
+    /* of aliases, the first in the map wins */
+    return x->name < y->name ? -1 : x->name > y->name;
+}
+
+static int ksym_hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* fill eytz[k...] from the sorted addresses, in order from *i */
+static void ksym_eytzinger(struct ksym_index *ki, uint32_t *i, uint32_t k)
+{
+    if (k > ki->nr)
+        return;
+
+    ksym_eytzinger(ki, i, 2 * k);
+    ki->eytz[k] = ki->addrs[*i];
+    ki->rank[k] = (*i)++;
+    ksym_eytzinger(ki, i, 2 * k + 1);
+}
+
+struct ksym_index *ksym_index_build(const char *map, size_t size)
+{
+    const char *p, *q, *name, *eol, *end = map + size;
+    struct ksym_entry *ents = NULL;
+    struct ksym_index *ki;
+    size_t nr = 0, alloc = 0, blob_len = 0, blob_alloc = 0, len;
+    uint64_t addr, etext = 0;
+    char type;
+    char *blob = NULL;
+    uint32_t i, n;
+    int v;
+
+    for (p = map; p < end; p = eol + 1) {
+        if (!(eol = memchr(p, '\n', end - p)))
+            eol = end;
+
+        for (q = p, addr = 0; q < eol && (v = ksym_hexval(*q)) >= 0; q++)
+            addr = (addr << 4) | v;
+        if (q == p || q + 3 > eol || q[0] != ' ' || q[2] != ' ')
+            continue;
+
+        type = q[1];
+        name = q + 3;
+        for (len = 0; name + len < eol && name[len] != ' ' &&
+                name[len] != '\t' && name[len] != '\r'; len++)
+            ;
+        if (!len)
+            continue;
+
+        if (len == 6 && !memcmp(name, "_etext", 6))
+            etext = addr;
+        if (type != 't' && type != 'T')
+            continue;
+
+        if (nr == alloc) {
+            alloc = alloc ? alloc * 2 : 4096;
+            ents = xrealloc(ents, alloc * sizeof(*ents));
+        }
+        if (blob_len + len + 1 > blob_alloc) {
+            blob_alloc = blob_alloc ? blob_alloc * 2 : 64 * 1024;
+            while (blob_len + len + 1 > blob_alloc)
+                blob_alloc *= 2;
+            blob = xrealloc(blob, blob_alloc);
+        }
+
+        ents[nr].addr = addr;
+        ents[nr].name = blob_len;
+        nr++;
+        memcpy(blob + blob_len, name, len);
+        blob_len += len;
+        blob[blob_len++] = '\0';
+    }
+
+    if (!nr) {
+        xfree(ents);
+        xfree(blob);
+        return NULL;
+    }
+
+    qsort(ents, nr, sizeof(*ents), ksym_entry_cmp);
+
+    ki = xcalloc(1, sizeof(*ki));
+    ki->addrs = xmalloc(nr * sizeof(*ki->addrs));
+    ki->names = xmalloc(nr * sizeof(*ki->names));
+
+    for (i = 0, n = 0; i < nr; i++) {
+        if (n && ki->addrs[n - 1] == ents[i].addr)
+            continue;
+        ki->addrs[n] = ents[i].addr;
+        ki->names[n] = ents[i].name;
+        n++;
+    }
+    xfree(ents);
+
+    ki->nr = n;
+    ki->blob = blob;
+    ki->eytz = xmalloc((n + 1) * sizeof(*ki->eytz));
+    ki->rank = xmalloc((n + 1) * sizeof(*ki->rank));
+    i = 0;
+    ksym_eytzinger(ki, &i, 1);
+
+    /* past the last function, an address is no longer in the kernel text */
+    ki->text_end = etext > ki->addrs[n - 1] ? etext : ki->addrs[n - 1] + 4096;
+
+    return ki;
+}
+
+void ksym_index_free(struct ksym_index *ki)
+{
+    if (!ki)
+        return;
+
+    xfree(ki->eytz);
+    xfree(ki->rank);
+    xfree(ki->addrs);
+    xfree(ki->names);
+    xfree(ki->blob);
+    xfree(ki);
+}
+
+/*
+ * The name of the function addr is in, its offset in there and its
+ * size, which is up to the next symbol.  NULL outside the kernel text.
+ */
+const char *ksym_lookup(const struct ksym_index *ki, uint64_t addr,
+        uint64_t *off, uint64_t *size)
+{
+    uint32_t k = 1, i;
+
+    if (!ki || addr < ki->addrs[0] || addr >= ki->text_end)
+        return NULL;
+
+    /* k ends up at the first start beyond addr */
+    while (k <= ki->nr) {
+        __builtin_prefetch(ki->eytz + 16 * k);
+        k = 2 * k + (ki->eytz[k] <= addr);
+    }
+    k >>= __builtin_ffs(~k);
+
+    i = k ? ki->rank[k] - 1 : ki->nr - 1;
+
+    *off = addr - ki->addrs[i];
+    *size = (i + 1 < ki->nr ? ki->addrs[i + 1] : ki->text_end) - ki->addrs[i];
+    return ki->blob + ki->names[i];
+}
@@ -0,0 +1,43 @@
+/* ksym.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __KSYM_H__
+#define __KSYM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The text symbols of a System.map, to turn addresses back into names.
+ * The start addresses are kept in Eytzinger order for the search, the
+ * rest in address order: rank[] leads from one to the other.
+ */
+struct ksym_index {
+    uint32_t nr;
+    uint64_t *eytz;                 /* eytz[1..nr], eytz[0] unused */
+    uint32_t *rank;                 /* address order of eytz[k] */
+    uint64_t *addrs;                /* address order */
+    uint32_t *names;                /* offsets of the names in blob */
+    char *blob;
+    uint64_t text_end;              /* _etext, or near the last symbol */
+};
+
+struct ksym_index *ksym_index_build(const char *map, size_t size);
+void ksym_index_free(struct ksym_index *ki);
+
+const char *ksym_lookup(const struct ksym_index *ki, uint64_t addr,
+        uint64_t *off, uint64_t *size);
+
+#endif
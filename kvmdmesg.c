@@ -0,0 +1,167 @@
+/* kvmdmesg.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xutil.h"
+#include "defs.h"
+#include "log.h"
+#include "printk.h"
+#include "kaslr.h"
+#include "kvmdmesg.h"
+
+/*
+ * A session is a guest context of its own, with its own symbol table
+ * and guest client, kept from one refresh to the next the way follow
+ * mode keeps them between its passes.  Every call binds the context
+ * for its duration and then goes back to whatever the thread had bound.
+ */
+struct kvmdmesg {
+    struct guest_context *ctx;
+    char *guest;
+    int lockless;               /* printk_ringbuffer, not log_buf */
+
+    kvmdmesg_record_fn fn;
+    void *arg;
+    int nr;                     /* records handed out by this refresh */
+};
+
+static void kvmdmesg_record(const struct kvmdmesg_record *r, void *arg)
+{
+    struct kvmdmesg *s = arg;
+
+    s->fn(r, s->arg);
+    s->nr++;
+}
+
+/*
+ * The settings of a session come from its options alone, never from
+ * those the program set up for itself or for other sessions.
+ */
+static void kvmdmesg_program_context(struct program_context *p,
+        const struct kvmdmesg_options *o)
+{
+    memset(p, 0, sizeof(*p));
+    if (!o)
+        return;
+
+    p->no_cache = o->no_cache;
+    p->scan_max = o->scan_max;
+    p->since = o->since;
+    p->until = o->until;
+    p->levels = o->levels;
+    p->facilities = o->facilities;
+    if (o->grep) {
+        p->grep = o->grep;
+        p->grep_len = strlen(o->grep);
+    }
+}
+
+struct kvmdmesg *kvmdmesg_open(const char *guest, const char *system_map)
+{
+    return kvmdmesg_open_options(guest, system_map, NULL);
+}
+
+struct kvmdmesg *kvmdmesg_open_options(const char *guest, const char *system_map,
+        const struct kvmdmesg_options *options)
+{
+    struct guest_context *prev = gc;
+    struct symbol_table_data *symtab;
+    struct program_context program_context;
+    struct kvmdmesg *s;
+    guest_access_t ty;
+
+    s = xcalloc(1, sizeof(*s));
+    s->guest = xstrdup(guest);
+
+    kvmdmesg_program_context(&program_context, options);
+    symtab = xcalloc(1, sizeof(*symtab));
+    s->ctx = guest_context_new(s->guest, symtab, &program_context);
+    s->ctx->record_fn = kvmdmesg_record;
+    s->ctx->record_arg = s;
+
+    guest_context_bind(s->ctx);
+
+    symtab_init(system_map);
+    if (system_map && !st->idt_table_vmlinux) {
+        pr_err("No idt_table in %s", system_map);
+        goto err;
+    }
+
+    if (guest_access_type(s->guest, &ty) || guest_client_new(s->guest, ty))
+        goto err;
+
+    if (kaslr_init(s->guest) && !system_map)
+        goto err;
+
+    if (kernel_symbol_exists("prb")) {
+        s->lockless = TRUE;
+    } else if (!kernel_symbol_exists("log_first_idx") ||
+            !kernel_symbol_exists("log_next_idx")) {
+        pr_err("The guest kernel log has no records");
+        goto err;
+    }
+
+    guest_context_bind(prev);
+    return s;
+
+err:
+    guest_context_bind(prev);
+    kvmdmesg_close(s);
+    return NULL;
+}
+
+int kvmdmesg_refresh(struct kvmdmesg *s, kvmdmesg_record_fn fn, void *arg)
+{
+    struct guest_context *prev = gc;
+    int ret;
+
+    s->fn = fn;
+    s->arg = arg;
+    s->nr = 0;
+
+    guest_context_bind(s->ctx);
+
+    if (s->lockless)
+        ret = dump_lockless_record_log(TRUE);
+    else
+        ret = dump_variable_length_record_log(TRUE);
+
+    guest_context_bind(prev);
+
+    return ret ? -1 : s->nr;
+}
+
+void kvmdmesg_close(struct kvmdmesg *s)
+{
+    struct guest_context *prev = gc;
+    struct symbol_table_data *symtab;
+
+    if (!s)
+        return;
+
+    symtab = s->ctx->symtab;
+
+    guest_context_bind(s->ctx);
+    guest_client_release();
+    guest_context_bind(prev);
+
+    guest_context_free(s->ctx);
+    symtab_free(symtab);
+    xfree(s->guest);
+    xfree(s);
+}
@@ -0,0 +1,122 @@
+/* kvmdmesg.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __KVMDMESG_H__
+#define __KVMDMESG_H__
+
+/*
+ * libkvmdmesg: reading the kernel log of a guest from a program that
+ * keeps running, without a kvm-dmesg process per read.
+ *
+ *     s = kvmdmesg_open("guest", "System.map");
+ *     while (...) {
+ *         kvmdmesg_refresh(s, print_record, NULL);
+ *         sleep(1);
+ *     }
+ *     kvmdmesg_close(s);
+ *
+ * The first refresh delivers the whole log, later ones only the records
+ * added since, which is all they read from the guest.  A session is
+ * used by one thread at a time; different sessions are independent.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct kvmdmesg;
+
+struct kvmdmesg_record {
+    uint64_t seq;
+    uint64_t ts_nsec;           /* since the guest booted */
+    int level;                  /* 0 (emergency) to 7 (debug) */
+    int facility;               /* 0 for the kernel */
+    const char *text;           /* not NUL terminated, NULL if there is none */
+    size_t len;
+    uint32_t caller_id;         /* task, or 0x80000000 + CPU; 0 if not known */
+};
+
+/* text points into the session and is only valid during the call */
+typedef void (*kvmdmesg_record_fn)(const struct kvmdmesg_record *r, void *arg);
+
+/*
+ * guest is a libvirt domain, QMP socket, memory file or dump file, as
+ * on the kvm-dmesg command line.  Without a system_map, the kernel of
+ * the guest is found through the vmcoreinfo in its RAM, which needs
+ * Linux 4.15 or later.  NULL if it can not be read.
+ */
+struct kvmdmesg *kvmdmesg_open(const char *guest, const char *system_map);
+
+/*
+ * What a session can be asked for, as the options of the same names on
+ * the kvm-dmesg command line.  Zero is the default of each; a session
+ * opened by kvmdmesg_open() has all of them.
+ */
+struct kvmdmesg_options {
+    int no_cache;               /* neither use nor fill the cache */
+    unsigned long scan_max;     /* bytes read looking for vmcoreinfo, 0 for 1G */
+    uint64_t since;             /* only records from this ts_nsec on */
+    uint64_t until;             /* and up to this one, 0 for no end */
+    unsigned int levels;        /* bit 1 << level of each level wanted, 0 for all */
+    unsigned int facilities;    /* the same for facilities */
+    const char *grep;           /* only records containing it */
+};
+
+/*
+ * kvmdmesg_open() with options.  They are copied, but what grep points
+ * to is not and has to stay around until kvmdmesg_close().
+ */
+struct kvmdmesg *kvmdmesg_open_options(const char *guest, const char *system_map,
+        const struct kvmdmesg_options *options);
+
+/* hand the new records to fn, returns how many or -1 */
+int kvmdmesg_refresh(struct kvmdmesg *s, kvmdmesg_record_fn fn, void *arg);
+
+void kvmdmesg_close(struct kvmdmesg *s);
+
+/*
+ * What kvm-dmesg --output=binary writes: KVMDMESG_BIN_MAGIC, then the
+ * records one after the other, each a struct kvmdmesg_bin_record, its
+ * text_len bytes of text and zeroes up to size.  All of it is in the
+ * byte order of the host, and every record starts 8 byte aligned, so a
+ * file of them can be mapped and walked in place:
+ *
+ *     for (p = map + 8; p < map + len; p += r->size) {
+ *         r = (const struct kvmdmesg_bin_record *)p;
+ *         text = (const char *)(r + 1);
+ *         ...
+ *     }
+ */
+#define KVMDMESG_BIN_MAGIC      "KVMDMSG1"
+
+struct kvmdmesg_bin_record {
+    uint32_t size;              /* of the record, a multiple of 8 */
+    uint16_t text_len;
+    uint8_t level;
+    uint8_t facility;
+    uint32_t caller_id;
+    uint32_t boot;              /* in a spool, the boot it is from; 0 otherwise */
+    uint64_t seq;
+    uint64_t ts_nsec;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
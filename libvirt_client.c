@@ -27,32 +27,83 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "xutil.h"
 #include "defs.h"
 #include "log.h"
+#include "chunk.h"
+
+typedef enum {
+    VIR_MEMORY_VIRTUAL  = 1 << 0,   /* addresses are virtual addresses */
+    VIR_MEMORY_PHYSICAL = 1 << 1,   /* addresses are physical addresses */
+} virDomainMemoryFlags;
 
 typedef enum {
     VIR_DOMAIN_QEMU_MONITOR_COMMAND_DEFAULT = 0,
     VIR_DOMAIN_QEMU_MONITOR_COMMAND_HMP     = (1 << 0), /* cmd is in HMP */
 } virDomainQemuMonitorCommandFlags;
 
+#define VIR_CONNECT_LIST_DOMAINS_ACTIVE     (1 << 0)
+
+/* the head of virError, the codes that say a call is not there at all */
+typedef struct {
+    int code;
+    int domain;
+    const char *message;
+} virError, *virErrorPtr;
+
+#define VIR_ERR_NO_SUPPORT              (3)
+#define VIR_ERR_OPERATION_UNSUPPORTED   (84)
+
 typedef void* virDomainPtr;
 typedef void* virConnectPtr;
 
 virConnectPtr (*virConnectOpen)(const char *name);
 int (*virConnectClose)(virConnectPtr conn);
+int (*virConnectListAllDomains)(virConnectPtr conn, virDomainPtr **domains, unsigned int flags);
 virDomainPtr (*virDomainLookupByName)(virConnectPtr conn, const char *name);
+const char *(*virDomainGetName)(virDomainPtr domain);
 int (*virDomainFree)(virDomainPtr domain);
 int (*virDomainQemuMonitorCommand)(virDomainPtr domain, const char *cmd, char **result, unsigned int flags);
+int (*virDomainMemoryPeek)(virDomainPtr domain, unsigned long long start, size_t size, void *buffer, unsigned int flags);
+virErrorPtr (*virGetLastError)(void);
 
+/*
+ * The library and the connection to libvirtd are shared by all guests
+ * and only dropped with the last of them.  libvirt connections can be
+ * used from several threads at once.
+ */
+static pthread_mutex_t libvirt_lock = PTHREAD_MUTEX_INITIALIZER;
+static int libvirt_users = 0;
 void *libvirt_handle = NULL;
 void *libvirt_qemu_handle = NULL;
-virDomainPtr domain = NULL;
 virConnectPtr domain_conn = NULL;
 
-guest_client_t *guest_client = NULL;
-FILE *mem_file = NULL;
+/* the current guest lives in its context */
+#define guest_client  (gc->client)
+
+/* per guest, peek_size is 0 once virDomainMemoryPeek() is known not to work */
+struct libvirt_conn {
+    virDomainPtr domain;
+    size_t peek_size;
+    size_t peek_good;   /* largest size a peek has worked with */
+    int peek_ok;        /* peeks in a row since the last failure */
+    struct chunk_tune hmp_tune;
+};
+
+#define LIBVIRT_PEEK_MAX        (1024 * 1024)
+#define LIBVIRT_PEEK_MIN        (4096)
+#define LIBVIRT_PEEK_REGROW     (16)
+#define LIBVIRT_HMP_CHUNK_MIN   (4096)
+#define LIBVIRT_HMP_CHUNK_MAX   (64 * 1024)
+
+struct file_conn {
+    char *mem_map;
+    size_t mem_map_size;
+    ulong lowmem;
+};
 
 #define CHECK_FUNC(f) if (!f) { pr_err("Error loading function: %s\n", dlerror()); return -1; }
 
@@ -79,74 +130,143 @@ static int libvirt_dlsym()
 {
     virConnectOpen = dlsym(libvirt_handle, "virConnectOpen");
     virConnectClose = dlsym(libvirt_handle, "virConnectClose");
+    virConnectListAllDomains = dlsym(libvirt_handle, "virConnectListAllDomains");
     virDomainLookupByName = dlsym(libvirt_handle, "virDomainLookupByName");
+    virDomainGetName = dlsym(libvirt_handle, "virDomainGetName");
     virDomainFree = dlsym(libvirt_handle, "virDomainFree");
     virDomainQemuMonitorCommand = dlsym(libvirt_qemu_handle, "virDomainQemuMonitorCommand");
+    virDomainMemoryPeek = dlsym(libvirt_handle, "virDomainMemoryPeek");
+    virGetLastError = dlsym(libvirt_handle, "virGetLastError");
 
     CHECK_FUNC(virConnectOpen);
     CHECK_FUNC(virConnectClose);
+    CHECK_FUNC(virConnectListAllDomains);
     CHECK_FUNC(virDomainLookupByName);
+    CHECK_FUNC(virDomainGetName);
     CHECK_FUNC(virDomainFree);
     CHECK_FUNC(virDomainQemuMonitorCommand);
 
     return 0;
 }
 
-int libvirt_client_init(char *guest_name)
+static void libvirt_put()
 {
-    if (libvirt_dlopen()) {
-        return -1;
+    pthread_mutex_lock(&libvirt_lock);
+
+    if (--libvirt_users > 0) {
+        pthread_mutex_unlock(&libvirt_lock);
+        return;
     }
 
-    if (libvirt_dlsym()) {
-        return -1;
+    if (domain_conn) {
+        virConnectClose(domain_conn);
+        domain_conn = NULL;
+    }
+
+    if (libvirt_handle) {
+        dlclose(libvirt_handle);
+        libvirt_handle = NULL;
     }
 
+    if (libvirt_qemu_handle) {
+        dlclose(libvirt_qemu_handle);
+        libvirt_qemu_handle = NULL;
+    }
+
+    pthread_mutex_unlock(&libvirt_lock);
+}
+
+static int libvirt_get()
+{
+    pthread_mutex_lock(&libvirt_lock);
+    libvirt_users++;
+
+    if (!libvirt_handle && (libvirt_dlopen() || libvirt_dlsym())) {
+        goto err_exit;
+    }
 
     if (!domain_conn)
         domain_conn = virConnectOpen("qemu:///system");
 
     if (!domain_conn) {
         pr_err("Failed to open connection to qemu:///system");
-        return -1;
+        goto err_exit;
     }
 
-    if (!domain)
-        domain = virDomainLookupByName(domain_conn, guest_name);
+    pthread_mutex_unlock(&libvirt_lock);
+    return 0;
+
+err_exit:
+    pthread_mutex_unlock(&libvirt_lock);
+    libvirt_put();
+    return -1;
+}
+
+int libvirt_client_init(guest_client_t *c, char *guest_name)
+{
+    struct libvirt_conn *lc;
+    virDomainPtr domain;
 
+    if (libvirt_get()) {
+        return -1;
+    }
+
+    domain = virDomainLookupByName(domain_conn, guest_name);
     if (!domain) {
         pr_err("Failed to find the domain: %s", guest_name);
-        virConnectClose(domain_conn);
-        domain_conn = NULL;
+        libvirt_put();
         return -1;
     }
 
+    lc = xcalloc(1, sizeof(*lc));
+    lc->domain = domain;
+    lc->peek_size = virDomainMemoryPeek ? LIBVIRT_PEEK_MAX : 0;
+    chunk_tune_init(&lc->hmp_tune, LIBVIRT_HMP_CHUNK_MIN, LIBVIRT_HMP_CHUNK_MAX);
+
+    c->priv = lc;
     return 0;
 }
 
-int libvirt_client_uninit()
+int libvirt_client_uninit(guest_client_t *c)
 {
-    if (domain) {
-        virDomainFree(domain);
-        domain = NULL;
+    struct libvirt_conn *lc = c->priv;
+
+    if (lc) {
+        virDomainFree(lc->domain);
+        xfree(lc);
+        c->priv = NULL;
+        libvirt_put();
     }
 
-    if (domain_conn) {
-        virConnectClose(domain_conn);
-        domain_conn = NULL;
+    return 0;
+}
+
+/* names of all running domains, NULL terminated, free with xfree() */
+int libvirt_list_domains(char ***names)
+{
+    virDomainPtr *domains;
+    int i, n;
+
+    if (libvirt_get()) {
+        return -1;
     }
 
-    if (libvirt_handle) {
-        dlclose(libvirt_handle);
-        libvirt_handle = NULL;
+    n = virConnectListAllDomains(domain_conn, &domains, VIR_CONNECT_LIST_DOMAINS_ACTIVE);
+    if (n < 0) {
+        pr_err("Failed to list the domains");
+        libvirt_put();
+        return -1;
     }
 
-    if (libvirt_qemu_handle) {
-        dlclose(libvirt_qemu_handle);
-        libvirt_qemu_handle = NULL;
+    *names = xcalloc(n + 1, sizeof(char *));
+    for (i = 0; i < n; i++) {
+        (*names)[i] = strdup(virDomainGetName(domains[i]));
+        virDomainFree(domains[i]);
     }
+    free(domains);
 
-    return 0;
+    libvirt_put();
+    return n;
 }
 
 static unsigned long get_line_value(const char *line, const char *key)
@@ -160,19 +280,25 @@ static unsigned long get_line_value(const char *line, const char *key)
     return 0;
 }
 
-int libvirt_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
+int libvirt_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
 {
     virDomainQemuMonitorCommandFlags flag = VIR_DOMAIN_QEMU_MONITOR_COMMAND_HMP;
     char *hmp_response;
     char hmp_command[64] = {0};
+    char *saveptr = NULL;
 
     snprintf(hmp_command, sizeof(hmp_command), "info registers");
-    if (virDomainQemuMonitorCommand(domain, hmp_command, &hmp_response, flag) < 0) {
+    stats_add(&gc->stats.round_trips, 1);
+    if (virDomainQemuMonitorCommand(((struct libvirt_conn *)c->priv)->domain,
+                hmp_command, &hmp_response, flag) < 0) {
         pr_err("Failed to send QMP command: %s", hmp_command);
         return -1;
     }
+    stats_add(&gc->stats.bytes_received, strlen(hmp_response));
 
-    char *line = strtok(hmp_response, "\n");
+    *cr4 = 0;
+
+    char *line = strtok_r(hmp_response, "\n", &saveptr);
     while (line != NULL) {
         if (strstr(line, "IDT")) {
             *idtr = get_line_value(line, "IDT");
@@ -182,164 +308,465 @@ int libvirt_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
             *cr3 = get_line_value(line, "CR3");
         }
 
-        line = strtok(NULL, "\n");  // Next line
+        if (strstr(line, "CR4")) {
+            *cr4 = get_line_value(line, "CR4");
+        }
+
+        line = strtok_r(NULL, "\n", &saveptr);  // Next line
     }
-    *cr4 = 0;
 
     free(hmp_response);
     return 0;
 }
 
-static void* libvirt_dump_phy_memory(uint64_t start_addr, ssize_t size)
+/*
+ * xp prints "<addr>: 0x%08x 0x%08x 0x%08x 0x%08x" lines; the words are
+ * stored straight into buf, the last one cut to what is left of size.
+ */
+static int libvirt_hmp_readmem(virDomainPtr domain, uint64_t addr, uint8_t *buf, size_t size)
 {
-    void *buffer = NULL;
-    char *hmp_response;
     virDomainQemuMonitorCommandFlags flag = VIR_DOMAIN_QEMU_MONITOR_COMMAND_HMP;
+    char *hmp_response;
     char hmp_command[64] = {0};
-
-    size = roundup(size, 4);
-    buffer = malloc(1024 + size * 2);
+    char *p, *end;
+    uint32_t word;
+    size_t done = 0, n;
 
     // https://qemu-project.gitlab.io/qemu/system/monitor.html
-    snprintf(hmp_command, sizeof(hmp_command), "xp /%" PRIu64 "xw 0x%zx", size / 4, start_addr);
+    snprintf(hmp_command, sizeof(hmp_command), "xp /%zuxw 0x%" PRIx64,
+            roundup(size, 4) / 4, addr);
+    stats_add(&gc->stats.round_trips, 1);
     if (virDomainQemuMonitorCommand(domain, hmp_command, &hmp_response, flag) < 0) {
         pr_err("Failed to send QMP command: %s", hmp_command);
-        return NULL;
+        return -1;
     }
+    stats_add(&gc->stats.bytes_received, strlen(hmp_response));
 
-    uint32_t values[4];
-    uint32_t *data = (uint32_t *)buffer;
-    int i = 0;
-    char *line = strtok(hmp_response, "\n");
-    while (line != NULL) {
-        int num = sscanf(line, "%*s 0x%x 0x%x 0x%x 0x%x",
-                &values[0], &values[1], &values[2], &values[3]);
-        for (int j = 0; j < num && j < (int)(sizeof(values) / sizeof(values[0])); j++) {
-            data[i++] = values[j];
+    for (p = hmp_response; *p && done < size; p++) {
+        /* skip the address at the start of every line */
+        if (*p == ':') {
+            p++;
+            continue;
         }
-        line = strtok(NULL, "\n");  // Next line
+
+        if (p[0] != '0' || p[1] != 'x' || (p > hmp_response && p[-1] != ' '))
+            continue;
+
+        word = strtoul(p, &end, 16);
+        n = size - done < 4 ? size - done : 4;
+        memcpy(buf + done, &word, n);
+        done += n;
+        p = end - 1;
     }
 
     free(hmp_response);
-
-    return buffer;
+    return done == size ? 0 : -1;
 }
 
-int libvirt_readmem_part(uint64_t addr, uint8_t *buffer, size_t size)
+static int libvirt_hmp_readmem_all(struct libvirt_conn *lc, uint64_t addr, uint8_t *buf, size_t size)
 {
-    uint8_t *buf = libvirt_dump_phy_memory(addr, size);
-    if (!buf) {
-        return -1;
+    uint64_t start;
+    size_t n;
+
+    for (; size; addr += n, buf += n, size -= n) {
+        n = size < lc->hmp_tune.size ? size : lc->hmp_tune.size;
+        start = xclock_ns();
+        if (libvirt_hmp_readmem(lc->domain, addr, buf, n))
+            return -1;
+        chunk_tune_done(&lc->hmp_tune, n, xclock_ns() - start);
     }
-    memcpy(buffer, buf, size);
-    free(buf);
+
     return 0;
 }
 
-int libvirt_readmem(uint64_t addr, void *buffer, size_t size)
+/* libvirt says the domain cannot peek at all, rather than not this time */
+static int libvirt_peek_unsupported(void)
+{
+    virErrorPtr err;
+
+    if (!virGetLastError || !(err = virGetLastError()))
+        return FALSE;
+
+    return err->code == VIR_ERR_NO_SUPPORT || err->code == VIR_ERR_OPERATION_UNSUPPORTED;
+}
+
+/*
+ * virDomainMemoryPeek() hands back raw bytes, which beats formatting and
+ * parsing xp output by far.  libvirtd caps the size of one peek; it
+ * differs between versions, so a failing peek is retried smaller.  Once
+ * LIBVIRT_PEEK_REGROW peeks in a row have worked the size doubles again,
+ * up to the largest one that ever worked, so that a passing error does
+ * not slow down the rest of the run.  A chunk even the smallest peek
+ * fails on is read through HMP, and only a domain libvirt says cannot
+ * peek is read through HMP from then on.
+ */
+int libvirt_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size)
 {
-    int step = 4096;
+    struct libvirt_conn *lc = c->priv;
     uint8_t *buf = (uint8_t *)buffer;
-    size_t left = size % step;
+    size_t n;
+
+    while (size && lc->peek_size) {
+        n = size < lc->peek_size ? size : lc->peek_size;
+        stats_add(&gc->stats.round_trips, 1);
+        if (!virDomainMemoryPeek(lc->domain, addr, n, buf, VIR_MEMORY_PHYSICAL)) {
+            stats_add(&gc->stats.bytes_received, n);
+            if (n == lc->peek_size && n > lc->peek_good)
+                lc->peek_good = n;
+            if (++lc->peek_ok >= LIBVIRT_PEEK_REGROW && lc->peek_size < lc->peek_good) {
+                lc->peek_size *= 2;
+                lc->peek_ok = 0;
+            }
+            addr += n;
+            buf += n;
+            size -= n;
+            continue;
+        }
 
-    for (size_t i = 0; i < size / step; i++) {
-        if (libvirt_readmem_part(addr, buf, step) != 0) {
-            return -1;
+        lc->peek_ok = 0;
+        if (libvirt_peek_unsupported()) {
+            if (CRASHDEBUG(1))
+                pr_debug("libvirt: memory peek not supported, reading through HMP");
+            lc->peek_size = 0;
+            break;
         }
-        addr += step;
-        buf += step;
-    }
 
-    if (left > 0) {
-        if (libvirt_readmem_part(addr, buf, left) != 0) {
-            return -1;
+        if (lc->peek_size > LIBVIRT_PEEK_MIN) {
+            lc->peek_size /= 2;
+            continue;
         }
+
+        /* not a size problem, see whether the monitor can read it */
+        if (libvirt_hmp_readmem_all(lc, addr, buf, n))
+            return -1;
+
+        addr += n;
+        buf += n;
+        size -= n;
     }
 
-    return 0;
+    return libvirt_hmp_readmem_all(lc, addr, buf, size);
 }
 
-int file_client_init(char *path)
+/*
+ * The file is mapped read-only, so reads are plain memcpy and callers
+ * can decode guest structures in place through file_mapmem().
+ *
+ * A flat image maps guest physical address N to file offset N.  The
+ * memory-backend file of a guest with more RAM than fits below the PCI
+ * hole holds lowmem bytes of low RAM followed by the RAM that QEMU
+ * relocated above 4 GiB.
+ */
+#define RAM_ABOVE_4G  (1ULL << 32)
+
+int file_client_init(guest_client_t *c, char *path)
 {
-    if (mem_file)
-        return 0;
+    struct file_conn *f;
+    struct stat st;
+    int fd;
 
-    mem_file = fopen(path, "rb");
-    if (!mem_file) {
-        pr_err("fopen error");
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        pr_err("open error");
         return -1;
     }
+
+    if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+        pr_err("cannot get the size of %s", path);
+        close(fd);
+        return -1;
+    }
+
+    f = xcalloc(1, sizeof(*f));
+    f->mem_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (f->mem_map == MAP_FAILED) {
+        pr_err("mmap error");
+        xfree(f);
+        return -1;
+    }
+    f->mem_map_size = st.st_size;
+
+    f->lowmem = pc->lowmem < f->mem_map_size ? pc->lowmem : 0;
+
+    madvise(f->mem_map, f->mem_map_size, MADV_RANDOM);
+
+    c->priv = f;
     return 0;
 }
 
-int file_client_uninit( )
+int file_client_uninit(guest_client_t *c)
 {
-    if (mem_file) {
-        fclose(mem_file);
+    struct file_conn *f = c->priv;
+
+    if (f) {
+        munmap(f->mem_map, f->mem_map_size);
+        xfree(f);
     }
-    mem_file = NULL;
+    c->priv = NULL;
     return 0;
 }
 
-int file_readmem(uint64_t addr, void *buffer, size_t size)
+/* file offset of guest physical address addr, -1 if it is not in the file */
+static int64_t file_offset(struct file_conn *f, uint64_t addr, size_t size)
 {
-    if (fseek(mem_file, addr, SEEK_SET) != 0) {
-        pr_err("fseek error");
-        return -1;
+    uint64_t off = addr;
+
+    if (f->lowmem) {
+        if (addr >= RAM_ABOVE_4G)
+            off = addr - RAM_ABOVE_4G + f->lowmem;
+        else if (addr + size > f->lowmem)
+            return -1;
     }
 
-    size_t bytesRead = fread(buffer, 1, size, mem_file);
+    if (off >= f->mem_map_size || size > f->mem_map_size - off)
+        return -1;
 
-    if (bytesRead != size) {
-        if (feof(mem_file)) {
-            printf("eof to read: %zu\n", bytesRead);
-            return bytesRead;
-        } else {
-            pr_err("read bytes error");
-            return -1;
-        }
+    return off;
+}
+
+void *file_mapmem(guest_client_t *c, uint64_t addr, size_t size)
+{
+    struct file_conn *f = c->priv;
+    int64_t off = file_offset(f, addr, size);
+
+    if (off < 0)
+        return NULL;
+
+    return f->mem_map + off;
+}
+
+int file_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size)
+{
+    void *p = file_mapmem(c, addr, size);
+
+    if (!p) {
+        pr_err("0x%" PRIx64 "-0x%" PRIx64 " is beyond the memory file",
+                addr, addr + size);
+        return -1;
     }
 
+    memcpy(buffer, p, size);
+    stats_add(&gc->stats.bytes_received, size);
     return 0;
 }
 
-int file_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
+int file_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
 {
+    (void)c;
     *cr3 = 0x0000000019872000;
     *idtr = 0xffffffffff528000;
     *cr4 = 0;
     return 0;
 }
 
-int get_cr3_idtr(uint64_t *cr3, uint64_t *idtr)
+int get_cr3_idtr(uint64_t *cr3, uint64_t *idtr, uint64_t *cr4)
 {
-    uint64_t cr4;
-    guest_client->get_registers(idtr, cr3, &cr4);
+    guest_client->get_registers(guest_client, idtr, cr3, cr4);
     return 0;
 }
 
-int readmem(uint64_t addr, int memtype, void *buffer, long size)
+static physaddr_t readmem_paddr(uint64_t addr, int memtype)
 {
     physaddr_t paddr = 0;
 
     switch (memtype) {
         case KVADDR:
-            if (addr >= __START_KERNEL_map) {
-                paddr = ((addr) - (ulong)__START_KERNEL_map + machdep->machspec->phys_base);
-            } else {
-                paddr = ((addr) - PAGE_OFFSET);
-            }
+            paddr = x86_64_linear_to_phys(addr);
             break;
         case PHYSADDR:
             paddr = addr;
             break;
     }
 
-    return guest_client->readmem(paddr, buffer, size);
+    return paddr;
+}
+
+struct mem_runs {
+    struct mem_req *reqs;
+    int nr;
+    int alloc;
+};
+
+static void readmem_add_run(struct mem_runs *runs, physaddr_t paddr, void *dst, size_t len)
+{
+    struct mem_req *r;
+
+    if (runs->nr) {
+        r = &runs->reqs[runs->nr - 1];
+        if (r->addr + r->len == paddr && (char *)r->dst + r->len == dst) {
+            r->len += len;
+            return;
+        }
+    }
+
+    if (runs->nr == runs->alloc) {
+        runs->alloc = runs->alloc ? runs->alloc * 2 : 16;
+        runs->reqs = xrealloc(runs->reqs, runs->alloc * sizeof(*runs->reqs));
+    }
+
+    r = &runs->reqs[runs->nr++];
+    r->addr = paddr;
+    r->dst = dst;
+    r->len = len;
+}
+
+/*
+ * Turn a read into ranges of guest physical memory.  The linear
+ * mappings give one range; anything else, like a vmalloc'd log_buf, is
+ * translated a page at a time and physically adjacent pages are merged
+ * back into one read.
+ */
+static int readmem_split(struct mem_runs *runs, uint64_t addr, int memtype,
+        void *dst, size_t len)
+{
+    physaddr_t paddr;
+    size_t n;
+
+    if (memtype != KVADDR || x86_64_is_linear(addr)) {
+        readmem_add_run(runs, readmem_paddr(addr, memtype), dst, len);
+        return 0;
+    }
+
+    while (len) {
+        n = PAGESIZE() - PAGEOFFSET(addr);
+        if (n > len)
+            n = len;
+
+        if (x86_64_kvtop(addr, &paddr)) {
+            pr_err("Cannot translate kernel address 0x%" PRIx64, addr);
+            return -1;
+        }
+
+        readmem_add_run(runs, paddr, dst, n);
+        addr += n;
+        dst = (char *)dst + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* a call into the backend for len bytes of guest memory, see stats.c */
+static void readmem_count(size_t len)
+{
+    stats_add(&gc->stats.calls, 1);
+    stats_add(&gc->stats.bytes_requested, len);
+}
+
+static int readmem_runs(struct mem_runs *runs)
+{
+    size_t len = 0;
+    int i;
+
+    if (runs->nr > 1 && guest_client->readmem_batch) {
+        for (i = 0; i < runs->nr; i++)
+            len += runs->reqs[i].len;
+        readmem_count(len);
+        return guest_client->readmem_batch(guest_client, runs->reqs, runs->nr);
+    }
+
+    for (i = 0; i < runs->nr; i++) {
+        readmem_count(runs->reqs[i].len);
+        if (guest_client->readmem(guest_client, runs->reqs[i].addr,
+                    runs->reqs[i].dst, runs->reqs[i].len))
+            return -1;
+    }
+
+    return 0;
+}
+
+int readmem(uint64_t addr, int memtype, void *buffer, long size)
+{
+    struct mem_runs runs = { 0 };
+    int ret;
+
+    if (memtype != KVADDR || x86_64_is_linear(addr)) {
+        readmem_count(size);
+        return guest_client->readmem(guest_client, readmem_paddr(addr, memtype), buffer, size);
+    }
+
+    ret = readmem_split(&runs, addr, memtype, buffer, size);
+    if (!ret)
+        ret = readmem_runs(&runs);
+
+    xfree(runs.reqs);
+    return ret;
+}
+
+/*
+ * Pointer to the guest memory at addr when the backend has it mapped,
+ * NULL when the caller has to readmem() it into a buffer of its own.
+ */
+void *peekmem(uint64_t addr, int memtype, long size)
+{
+    struct mem_runs runs = { 0 };
+    void *p = NULL;
+
+    if (!guest_client->mapmem)
+        return NULL;
+
+    if (memtype != KVADDR || x86_64_is_linear(addr))
+        p = guest_client->mapmem(guest_client, readmem_paddr(addr, memtype), size);
+    else if (!readmem_split(&runs, addr, memtype, NULL, size) && runs.nr == 1)
+        /* only usable in place when the pages are physically contiguous */
+        p = guest_client->mapmem(guest_client, runs.reqs[0].addr, size);
+
+    /* mapped, as if it had been read */
+    if (p) {
+        readmem_count(size);
+        stats_add(&gc->stats.bytes_received, size);
+    }
+
+    xfree(runs.reqs);
+    return p;
+}
+
+/*
+ * Read several ranges at once, so a backend that can overlap them does
+ * not pay a round trip per range.
+ */
+int readmem_batch(struct mem_req *reqs, int nr, int memtype)
+{
+    struct mem_runs runs = { 0 };
+    int i, ret = 0;
+
+    for (i = 0; i < nr && !ret; i++) {
+        ret = readmem_split(&runs, reqs[i].addr, memtype, reqs[i].dst, reqs[i].len);
+    }
+
+    if (!ret)
+        ret = readmem_runs(&runs);
+
+    xfree(runs.reqs);
+    return ret;
+}
+
+/* what kind of guest ac names: a memory file, a QMP socket or a domain */
+int guest_access_type(const char *ac, guest_access_t *ty)
+{
+    struct stat path_stat;
+
+    if (stat(ac, &path_stat)) {
+        *ty = GUEST_NAME;
+        return 0;
+    }
+
+    if (S_ISREG(path_stat.st_mode)) {
+        *ty = GUEST_MEMORY;
+    } else if (S_ISSOCK(path_stat.st_mode)) {
+        *ty = QEMU_PROCESS;
+    } else {
+        pr_err("Unknown file type: %s", ac);
+        return -1;
+    }
+
+    return 0;
 }
 
 int guest_client_new(char *ac, guest_access_t ty)
 {
+    uint64_t start = xclock_ns();
+
     if (guest_client)
         return 0;
 
@@ -347,26 +774,53 @@ int guest_client_new(char *ac, guest_access_t ty)
     c->ty = ty;
     switch(c->ty) {
         case GUEST_NAME:
-            if (libvirt_client_init(ac))
-                return -1;
+            if (libvirt_client_init(c, ac))
+                goto err_exit;
             c->get_registers = libvirt_get_registers;
             c->readmem = libvirt_readmem;
             break;
         case GUEST_MEMORY:
-            if (file_client_init(ac))
-                return -1;
-            c->get_registers = file_get_registers;
-            c->readmem = file_readmem;
+            if (!dump_probe(ac)) {
+                if (file_client_init(c, ac))
+                    goto err_exit;
+                c->get_registers = file_get_registers;
+                c->readmem = file_readmem;
+                c->mapmem = file_mapmem;
+                break;
+            }
+            c->ty = GUEST_DUMP;
+            /* fall through */
+        case GUEST_DUMP:
+            if (dump_client_init(c, ac))
+                goto err_exit;
+            c->get_registers = dump_get_registers;
+            c->readmem = dump_readmem;
+            c->mapmem = dump_mapmem;
             break;
+        case QEMU_PROCESS:
+            if (process_client_init(c, ac) == 0) {
+                c->get_registers = process_get_registers;
+                c->readmem = process_readmem;
+                break;
+            }
+            pr_info("Cannot read QEMU memory directly, using QMP");
+            c->ty = QMP_SOCKET;
+            /* fall through */
         case QMP_SOCKET:
-            if (qmp_client_init(ac))
-                return -1;
+            if (qmp_client_init(c, ac))
+                goto err_exit;
             c->get_registers = qmp_get_registers;
             c->readmem = qmp_readmem;
+            c->readmem_batch = qmp_readmem_batch;
             break;
     }
     guest_client = c;
+    stats_stop(STATS_CONNECT, start);
     return 0;
+
+err_exit:
+    xfree(c);
+    return -1;
 }
 
 int guest_client_release()
@@ -377,13 +831,19 @@ int guest_client_release()
     guest_client_t *c = guest_client;
     switch(c->ty) {
         case GUEST_NAME:
-            libvirt_client_uninit();
+            libvirt_client_uninit(c);
             break;
         case GUEST_MEMORY:
-            file_client_uninit();
+            file_client_uninit(c);
+            break;
+        case GUEST_DUMP:
+            dump_client_uninit(c);
             break;
         case QMP_SOCKET:
-            qmp_client_uninit();
+            qmp_client_uninit(c);
+            break;
+        case QEMU_PROCESS:
+            process_client_uninit(c);
             break;
     }
     xfree(c);
@@ -21,17 +21,28 @@
 
 int loglevel = LOGLEVEL_WARNING;
 
+/* which guest the messages of this thread are about */
+static __thread const char *log_prefix = NULL;
+
 void log_init(int level)
 {
     if (level > 0 && level < LOGLEVEL_MAX)
         loglevel = level;
 }
 
+void log_set_prefix(const char *prefix)
+{
+    log_prefix = prefix;
+}
+
 static void report(const char *prefix, const char *err, va_list params)
 {
     char msg[1024];
     vsnprintf(msg, sizeof(msg), err, params);
-    fprintf(stderr, "%s%s\n", prefix, msg);
+    if (log_prefix)
+        fprintf(stderr, "%s%s: %s\n", prefix, log_prefix, msg);
+    else
+        fprintf(stderr, "%s%s\n", prefix, msg);
 }
 
 static void debug_builtin(const char *debug, va_list params)
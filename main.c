@@ -22,6 +22,8 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 #include <fnmatch.h>
 #include <dirent.h>
 #include <sys/types.h>
@@ -33,340 +35,629 @@
 #include "client.h"
 #include "version.h"
 #include "printk.h"
+#include "fleet.h"
+#include "xutil.h"
+#include "output.h"
+#include "sink.h"
+#include "spool.h"
+#include "kaslr.h"
 
-struct machine_specific x86_64_machine_specific = { 0 };
-
-static ulong * x86_64_kpgd_offset(ulong kvaddr)
-{
-    ulong *pgd;
-    pgd = ((ulong *)machdep->pgd) + pgd_index(kvaddr);
-    return pgd;
-}
-
-ulong x86_64_pud_offset(ulong pgd_pte, ulong vaddr)
+static int is_text_file(const char *path)
 {
-    ulong *pud;
-    ulong pud_paddr;
-    ulong pud_pte;
+    unsigned char byte;
+    size_t bytes_read = 0;
+    FILE *file = fopen(path, "rb");
 
-    pud_paddr = pgd_pte & PHYSICAL_PAGE_MASK;
+    if (file == NULL) {
+        pr_err("Failed to open file: %s", path);
+        return -1;
+    }
 
-    FILL_PUD(pud_paddr, PAGESIZE());
-    pud = ((ulong *)pud_paddr) + pud_index(vaddr);
-    pud_pte = ULONG(machdep->pud + PAGEOFFSET(pud));
+    while (bytes_read < 1024  && fread(&byte, 1, 1, file) == 1) {
+        if (!isprint(byte) && !isspace(byte) && byte != '\0') {
+            fclose(file);
+            return 0;
+        }
+        bytes_read++;
+    }
 
-    return pud_pte;
+    fclose(file);
+    return 1;
 }
 
-ulong x86_64_pmd_offset(ulong pud_pte, ulong vaddr)
+static void usage(const char *prog)
 {
-    ulong *pmd;
-    ulong pmd_paddr;
-    ulong pmd_pte;
-
-    pmd_paddr = pud_pte & PHYSICAL_PAGE_MASK;
-
-    FILL_PMD(pmd_paddr, PAGESIZE());
-
-    pmd = ((ulong *)pmd_paddr) + pmd_index(vaddr);
-    pmd_pte = ULONG(machdep->pmd + PAGEOFFSET(pmd));
-    return pmd_pte;
+    fprintf(fp, "Usage: %s [options] <domain_name/socket_path/memory_file> [<system.map>]\n"
+            "       %s [options] -m <system.map> [--all] [guest[=system.map]...]\n"
+            "\n"
+            "Options:\n"
+            "  -l, --lowmem=SIZE   RAM below 4G in a memory-backend file, as a size\n"
+            "                      (e.g. 2G) or the QEMU machine type: pc, q35\n"
+            "  -f, --follow        keep running and print new messages as they come\n"
+            "  -i, --interval=SEC  how often to poll the guest in follow mode\n"
+            "                      (default 1, fractions allowed)\n"
+            "  -t, --tail=N        start with the last N records only\n"
+            "  -s, --since=SEC     start with the records logged SEC seconds after\n"
+            "                      the guest booted\n"
+            "      --until=SEC     only the records logged up to SEC seconds after\n"
+            "                      the guest booted\n"
+            "      --level=LIST    only these levels, e.g. err,warn; err+ for err and\n"
+            "                      above, +err for err and below\n"
+            "      --facility=LIST only these facilities, e.g. kern,user\n"
+            "      --grep=TEXT     only the records containing TEXT\n"
+            "      --symbolize     print kernel text addresses in the log as\n"
+            "                      function+offset, with all of System.map\n"
+            "      --output=FORMAT text (default), jsonl for a JSON object per\n"
+            "                      record, binary for the records of kvmdmesg.h,\n"
+            "                      or syslog for octet counted RFC 5424 messages\n"
+            "      --sink=HOST:PORT  send the output to a TCP collector instead of\n"
+            "                      stdout, reconnecting when the connection drops\n"
+            "      --spool=DIR     keep the records of each guest in DIR, over its\n"
+            "                      reboots, and only print those not kept yet\n"
+            "      --from-spool    print what the spool of the guest has, with the\n"
+            "                      filters above, instead of reading the guest\n"
+            "  -m, --map=FILE      scrape several guests, with FILE as the System.map\n"
+            "                      of those not given one of their own; without it\n"
+            "                      they are read through the vmcoreinfo in their RAM\n"
+            "      --scan-max=SIZE how much guest RAM to read through the monitor\n"
+            "                      looking for the vmcoreinfo (default 1G)\n"
+            "  -a, --all           add all running libvirt domains\n"
+            "  -j, --jobs=N        guests scraped at the same time (default %d)\n"
+            "  -o, --output-dir=DIR  write each guest to DIR/<guest>.log instead of\n"
+            "                      stdout lines prefixed with the guest\n"
+            "  -T, --threads=N     threads to decode a big ring with (default one\n"
+            "                      per CPU, or 1 per guest when scraping several)\n"
+            "      --no-cache      neither use nor update the cache of what earlier\n"
+            "                      runs learned about a kernel\n"
+            "      --stats[=json]  print where the time went and what was read from\n"
+            "                      each guest to stderr at the end, as text or JSON\n"
+            "  -h, --help          show this help\n", prog, prog, FLEET_JOBS);
 }
 
-ulong x86_64_pte_offset(ulong pmd_pte, ulong vaddr)
+/* a size like 2G, 512M or 4096 */
+static int parse_size(const char *arg, ulong *size)
 {
-    ulong *ptep;
-    ulong pte_paddr;
-    ulong pte;
-
-    pte_paddr = pmd_pte & PHYSICAL_PAGE_MASK;
+    char *end;
+    ulong v;
+
+    v = strtoul(arg, &end, 0);
+    switch (*end) {
+        case 'g': case 'G': v <<= 10; /* fall through */
+        case 'm': case 'M': v <<= 10; /* fall through */
+        case 'k': case 'K': v <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
 
-    FILL_PTBL(pte_paddr, PAGESIZE());
-    ptep = ((ulong *)pte_paddr) + pte_index(vaddr);
-    pte = ULONG(machdep->ptbl + PAGEOFFSET(ptep));
+    if (*end != '\0')
+        return -1;
 
-    return pte;
+    *size = v;
+    return 0;
 }
 
-int x86_64_kvtop(ulong kvaddr, physaddr_t *paddr)
+/*
+ * Low RAM of a QEMU x86 guest, see pc_init1() and pc_q35_init(): guests
+ * that do not fit below the PCI hole get clipped to a gigabyte boundary.
+ */
+static int parse_lowmem(const char *arg, ulong ram_size, ulong *lowmem)
 {
-    ulong *pgd;
-    ulong pud_pte;
-    ulong pmd_pte;
-    ulong pte;
+    if (STREQ(arg, "pc")) {
+        *lowmem = ram_size >= 0xe0000000UL ? 0xc0000000UL : 0;
+        return 0;
+    }
 
-    pgd = x86_64_kpgd_offset(kvaddr);
-    pud_pte = x86_64_pud_offset(*pgd, kvaddr);
-    pmd_pte = x86_64_pmd_offset(pud_pte, kvaddr);
-    pte = x86_64_pte_offset(pmd_pte, kvaddr);
-    *paddr = (PAGEBASE(pte) & PHYSICAL_PAGE_MASK) + PAGEOFFSET(kvaddr);
+    if (STREQ(arg, "q35")) {
+        *lowmem = ram_size >= 0xb0000000UL ? 0x80000000UL : 0;
+        return 0;
+    }
 
-    return 0;
+    return parse_size(arg, lowmem);
 }
 
-ulong get_vec0_addr(ulong idtr)
+/* as dmesg names them, by number */
+static const char *level_names[] = {
+    "emerg", "alert", "crit", "err", "warn", "notice", "info", "debug", NULL
+};
+
+static const char *facility_names[] = {
+    "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+    "uucp", "cron", "authpriv", "ftp", "", "", "", "",
+    "local0", "local1", "local2", "local3",
+    "local4", "local5", "local6", "local7", NULL
+};
+
+/*
+ * A comma separated list of names, or numbers, into a mask of their
+ * bits.  With ranges set, "err+" also takes the names before it and
+ * "+err" those after it.
+ */
+static int parse_names(const char *arg, const char **names, int ranges,
+        unsigned int *mask)
 {
-    struct gate_struct64 {
-        uint16_t offset_low;
-        uint16_t segment;
-        uint32_t ist : 3, zero0 : 5, type : 5, dpl : 2, p : 1;
-        uint16_t offset_middle;
-        uint32_t offset_high;
-        uint32_t zero1;
-    } __attribute__((packed)) gate;
-
-    readmem(idtr, PHYSADDR, &gate, sizeof(gate));
-
-    return ((ulong)gate.offset_high << 32)
-        + ((ulong)gate.offset_middle << 16)
-        + gate.offset_low;
-}
+    char buf[64];
+    const char *p, *comma, *name;
+    size_t len;
+    int i, nr, below, above;
+    char *end;
+
+    for (nr = 0; names[nr]; nr++)
+        ;
+
+    *mask = 0;
+    for (p = arg; *p; p = comma + (*comma == ',')) {
+        comma = strchr(p, ',');
+        if (!comma)
+            comma = p + strlen(p);
+
+        len = comma - p;
+        if (!len || len >= sizeof(buf))
+            return -1;
+        memcpy(buf, p, len);
+        buf[len] = '\0';
+
+        above = ranges && buf[len - 1] == '+';
+        below = ranges && buf[0] == '+';
+        if (above)
+            buf[--len] = '\0';
+        name = buf + below;
+
+        i = strtol(name, &end, 10);
+        if (end == name || *end != '\0') {
+            for (i = 0; i < nr && (!*names[i] || !STREQ(names[i], name)); i++)
+                ;
+        }
+        if (i < 0 || i >= nr || (above && below))
+            return -1;
 
-void write_data_to_file(const char *filename, void *data, size_t size) {
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        pr_err("Failed to open file");
-        return;
+        if (above)
+            *mask |= (2U << i) - 1;
+        else if (below)
+            *mask |= ~((1U << i) - 1) & ((1U << nr) - 1);
+        else
+            *mask |= 1U << i;
     }
 
-    size_t written = fwrite(data, 1, size, file);
-    if (written != size) {
-        pr_err("Failed to write data to file");
-    }
+    return *mask ? 0 : -1;
+}
 
-    fclose(file);
+static volatile sig_atomic_t follow_stop = FALSE;
+
+static void follow_signal(int sig)
+{
+    (void)sig;
+    follow_stop = TRUE;
 }
 
-#define PTI_USER_PGTABLE_BIT    PAGE_SHIFT
-#define PTI_USER_PGTABLE_MASK   (1 << PTI_USER_PGTABLE_BIT)
-#define CR3_PCID_MASK           0xFFFull
-int calc_kaslr_offset(ulong *kaslr_offset, ulong *phys_base)
+/*
+ * Sleep until the next pass of follow mode, FALSE once we were asked to
+ * stop, so the client still gets released on the way out.
+ */
+static int follow_wait(double interval)
 {
-    uint64_t cr3 = 0, idtr = 0, pgd = 0, idtr_paddr;
-    ulong divide_error_vmcore;
+    static int installed = FALSE;
+    struct sigaction sa;
+    struct timespec ts;
+
+    if (!installed) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = follow_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        installed = TRUE;
+    }
 
-    get_cr3_idtr(&cr3, &idtr);
+    ts.tv_sec = (time_t)interval;
+    ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
 
-    pgd = cr3 & ~(CR3_PCID_MASK|PTI_USER_PGTABLE_MASK);
+    if (!follow_stop)
+        nanosleep(&ts, NULL);
 
-    vt->kernel_pgd[0] = pgd;
-    machdep->last_pgd_read = vt->kernel_pgd[0];
-    machdep->machspec->physical_mask_shift = __PHYSICAL_MASK_SHIFT_2_6;
-    machdep->machspec->pgdir_shift = PGDIR_SHIFT;
-    machdep->machspec->ptrs_per_pgd = PTRS_PER_PGD;
+    return !follow_stop;
+}
 
-    readmem(pgd, PHYSADDR, machdep->pgd, PAGESIZE());
-    x86_64_kvtop(idtr, &idtr_paddr);
+static char *lowmem_arg = NULL;
+static int follow = FALSE;
+static double interval = 1.0;
 
-    divide_error_vmcore = get_vec0_addr(idtr_paddr);
-    *kaslr_offset = divide_error_vmcore - st->divide_error_vmlinux;
-    *phys_base = idtr_paddr -
-        (st->idt_table_vmlinux + *kaslr_offset - __START_KERNEL_map);
+/* the memory file of a guest with more RAM than fits below 4G */
+static int guest_lowmem(char *guest_ac)
+{
+    struct stat path_stat;
 
-    if (CRASHDEBUG(1)) {
-        pr_debug("kaslr_offset: idtr=%lx", idtr);
-        pr_debug("kaslr_offset: pgd=%lx", pgd);
-        pr_debug("kaslr_offset: idtr(phys)=%lx", idtr_paddr);
-        pr_debug("kaslr_offset: divide_error(vmcore): %lx", divide_error_vmcore);
-    }
+    if (!lowmem_arg || stat(guest_ac, &path_stat))
+        return 0;
 
-    if (CRASHDEBUG(1)) {
-        pr_debug("kaslr_offset: kaslr_offset=%lx", *kaslr_offset);
-        pr_debug("kaslr_offset: phys_base   =%lx", *phys_base);
+    if (parse_lowmem(lowmem_arg, path_stat.st_size, &pc->lowmem)) {
+        pr_err("Invalid lowmem size: %s", lowmem_arg);
+        return -1;
     }
 
     return 0;
 }
 
-void x86_64_init()
+/*
+ * Print the log of one guest to fp.  The context of the guest is bound
+ * and its symbols are loaded.
+ */
+static int scrape_guest(char *guest_ac)
 {
-    machdep->machspec = &x86_64_machine_specific;
+    guest_access_t ac_type;
+    int ret;
 
-    machdep->pagesize = 4096;
-    machdep->pageoffset = machdep->pagesize - 1;
-    machdep->pagemask = ~((ulonglong)machdep->pageoffset);
+    if (guest_access_type(guest_ac, &ac_type))
+        return -1;
 
-    machdep->pgd = malloc(PAGESIZE());
-    machdep->pud = malloc(PAGESIZE());
-    machdep->pmd = malloc(PAGESIZE());
-    machdep->ptbl = malloc(PAGESIZE());
+    if (ac_type == GUEST_MEMORY && guest_lowmem(guest_ac))
+        return -1;
 
-    machdep->machspec->page_offset = PAGE_OFFSET_2_6_27;
-}
+    if (guest_client_new(guest_ac, ac_type))
+        return -1;
 
-void x86_64_post_reloc()
-{
-    if (kernel_symbol_exists("page_offset_base")) {
-        get_symbol_data("page_offset_base", sizeof(ulong),
-            &machdep->machspec->page_offset);
+    /* without a System.map, the symbols come with KASLR */
+    if (kaslr_init(guest_ac) && !st->idt_table_vmlinux) {
+        guest_client_release();
+        return -1;
     }
-}
 
-void derive_kaslr_offset()
-{
-    ulong kaslr_offset = 0;
-    ulong phys_base = 0;
-
-    calc_kaslr_offset(&kaslr_offset, &phys_base);
-
-    if (kaslr_offset) {
-        kt->relocate = kaslr_offset * -1;
-        kt->flags |= RELOC_SET;
+    if ((kernel_symbol_exists("prb") || kernel_symbol_exists("log_first_idx")) &&
+            pc->spool && !(gc->spool = spool_open(pc->spool, guest_ac, TRUE))) {
+        guest_client_release();
+        return -1;
     }
 
-    machdep->machspec->phys_base = phys_base;
-}
-
-int ascii(int c)
-{
-    return ((c >= 0) && ( c <= 0x7f));
-}
+    if (kernel_symbol_exists("prb")) {
+        do {
+            ret = dump_lockless_record_log(follow);
+            spool_commit(gc->spool);
+        } while (!ret && follow && follow_wait(interval));
+        goto exit;
+    }
 
-static char* log_from_idx(uint32_t idx, char *logbuf)
-{
-    char *logptr;
-    uint16_t msglen;
+    if (kernel_symbol_exists("log_first_idx") &&
+            kernel_symbol_exists("log_next_idx")) {
+        do {
+            ret = dump_variable_length_record_log(follow);
+            spool_commit(gc->spool);
+        } while (!ret && follow && follow_wait(interval));
+        goto exit;
+    }
 
-    logptr = logbuf + idx;
+    if (follow)
+        pr_warning("The guest kernel log has no records, can not follow it");
+    if (pc->spool)
+        pr_warning("The guest kernel log has no records, it is not spooled");
 
-    msglen = USHORT(logptr + offsetof(struct log, len));
-    if (!msglen)
-        logptr = logbuf;
+    ret = dump_plain_log_buf();
 
-    return logptr;
+exit:
+    spool_close(gc->spool);
+    gc->spool = NULL;
+    guest_client_release();
+    return ret ? -1 : 0;
 }
 
-static uint32_t log_next(uint32_t idx, char *logbuf)
+/* "guest=System.map" names the map of that guest */
+static void fleet_add(struct fleet_guest *g, char *arg, const char *map)
 {
-    char *logptr;
-    uint16_t msglen;
+    struct stat path_stat;
+    char *eq = strrchr(arg, '=');
 
-    logptr = logbuf + idx;
+    g->ac = arg;
+    g->map = map;
 
-    msglen = USHORT(logptr + offsetof(struct log, len));
-    if (!msglen) {
-        msglen = USHORT(logbuf + offsetof(struct log, len));
-        return msglen;
+    if (eq && eq != arg && !stat(eq + 1, &path_stat) && S_ISREG(path_stat.st_mode)) {
+        *eq = '\0';
+        g->map = eq + 1;
     }
-
-    return idx + msglen;
 }
 
-static void dump_log_entry(char *logptr)
+static int fleet_main(int argc, char *argv[], const char *map, int all,
+        int jobs, const char *output_dir)
 {
-    char *msg, *p;
-    uint16_t i, text_len;
-    uint64_t ts_nsec;
-    ulonglong nanos;
-    ulong rem;
-    char buf[64];
+    struct fleet_guest *guests;
+    struct guest_stats total;
+    char **domains = NULL;
+    int nr_domains = 0;
+    int i, n = 0, failed;
 
-    text_len = USHORT(logptr + offsetof(struct log, text_len));
-
-    ts_nsec = ULONGLONG(logptr);
-    msg = logptr + sizeof(struct log);
+    if (all && (nr_domains = libvirt_list_domains(&domains)) < 0)
+        return -1;
 
-    nanos = (ulonglong)ts_nsec / (ulonglong)1000000000;
-    rem = (ulonglong)ts_nsec % (ulonglong)1000000000;
-    sprintf(buf, "[%5lld.%06ld] ", nanos, rem/1000);
-    fprintf(fp, "%s", buf);
+    guests = xcalloc(argc + nr_domains + 1, sizeof(*guests));
+    for (i = 0; i < argc; i++)
+        fleet_add(&guests[n++], argv[i], map);
+    for (i = 0; i < nr_domains; i++)
+        fleet_add(&guests[n++], domains[i], map);
 
-    for (i = 0, p = msg; i < text_len; i++, p++) {
-        if (*p == '\n')
-            fprintf(fp, "\n");
-        else if (isprint(*p) || isspace(*p))
-            fputc(*p, fp);
-        else
-            fputc('.', fp);
+    if (n == 0) {
+        pr_err("No guests to scrape");
+        xfree(guests);
+        return -1;
     }
 
-    fprintf(fp, "\n");
-}
+    failed = fleet_run(guests, n, jobs, output_dir, scrape_guest);
+    if (failed)
+        pr_warning("%d of %d guests failed", failed, n);
 
-static void dump_variable_length_record_log(void)
-{
-    uint32_t idx, log_first_idx, log_next_idx, log_buf_len;
-    ulong log_buf;
-    char *logptr, *logbuf;
-
-    get_symbol_data("log_first_idx", sizeof(uint32_t), &log_first_idx);
-    get_symbol_data("log_next_idx", sizeof(uint32_t), &log_next_idx);
-    get_symbol_data("log_buf_len", sizeof(uint32_t), &log_buf_len);
-    get_symbol_data("log_buf", sizeof(char *), &log_buf);
-
-    if (CRASHDEBUG(1)) {
-        pr_debug("log_buf: %lx", (ulong)log_buf);
-        pr_debug("log_buf_len: %d", log_buf_len);
-        pr_debug("log_first_idx: %d", log_first_idx);
-        pr_debug("log_next_idx: %d", log_next_idx);
+    /* the System.maps were loaded up front, they only show in the total */
+    if (pc->stats) {
+        total = gc->stats;
+        for (i = 0; i < n; i++) {
+            stats_report(stderr, guests[i].ac, &guests[i].stats, pc->stats);
+            stats_merge(&total, &guests[i].stats);
+        }
+        stats_report(stderr, "total", &total, pc->stats);
     }
 
-    log_buf_len &= ((1<<20) | ((1<<20) - 1));
-    logbuf = (char *)malloc(log_buf_len);
-
-    readmem(log_buf, KVADDR, logbuf, log_buf_len);
+    for (i = 0; i < nr_domains; i++)
+        xfree(domains[i]);
+    xfree(domains);
+    xfree(guests);
 
-    idx = log_first_idx;
-    while (idx != log_next_idx) {
-        logptr = log_from_idx(idx, logbuf);
-        dump_log_entry(logptr);
+    return failed ? -1 : 0;
+}
 
-        idx = log_next(idx, logbuf);
+int main(int argc, char *argv[])
+{
+    struct stat path_stat;
+    char *symmap_file = NULL;
+    char *guest_ac = NULL;
+    char *map_arg = NULL;
+    char *output_dir = NULL;
+    char *sink_addr = NULL;
+    struct sink *sink = NULL;
+    int all = FALSE;
+    int from_spool = FALSE;
+    int jobs = FLEET_JOBS;
+    double since, until;
+    char *end;
+    int c, r;
+
+    static struct option long_options[] = {
+        {"lowmem",     required_argument, 0, 'l'},
+        {"follow",     no_argument,       0, 'f'},
+        {"interval",   required_argument, 0, 'i'},
+        {"tail",       required_argument, 0, 't'},
+        {"since",      required_argument, 0, 's'},
+        {"until",      required_argument, 0, 'U'},
+        {"level",      required_argument, 0, 'L'},
+        {"facility",   required_argument, 0, 'F'},
+        {"grep",       required_argument, 0, 'g'},
+        {"symbolize",  no_argument,       0, 'S'},
+        {"output",     required_argument, 0, 'Y'},
+        {"sink",       required_argument, 0, 'K'},
+        {"spool",      required_argument, 0, 'P'},
+        {"from-spool", no_argument,       0, 'R'},
+        {"map",        required_argument, 0, 'm'},
+        {"scan-max",   required_argument, 0, 'N'},
+        {"all",        no_argument,       0, 'a'},
+        {"jobs",       required_argument, 0, 'j'},
+        {"output-dir", required_argument, 0, 'o'},
+        {"threads",    required_argument, 0, 'T'},
+        {"no-cache",   no_argument,       0, 'C'},
+        {"stats",      optional_argument, 0, 'X'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
 
-        if (idx >= log_buf_len) {
-            break;
+    pc->debug = 1;
+    fp = gc->fp = stdout;
+
+    while ((c = getopt_long(argc, argv, "l:fi:t:s:m:aj:o:T:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'l':
+                lowmem_arg = optarg;
+                break;
+            case 'f':
+                follow = TRUE;
+                break;
+            case 'i':
+                interval = strtod(optarg, &end);
+                if (*end != '\0' || interval <= 0) {
+                    pr_err("Invalid interval: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                pc->tail = strtoul(optarg, &end, 10);
+                if (*end != '\0' || pc->tail == 0) {
+                    pr_err("Invalid number of records: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 's':
+                since = strtod(optarg, &end);
+                if (*end != '\0' || since < 0) {
+                    pr_err("Invalid time: %s", optarg);
+                    return -1;
+                }
+                pc->since = (uint64_t)(since * 1e9);
+                break;
+            case 'U':
+                until = strtod(optarg, &end);
+                if (*end != '\0' || until < 0) {
+                    pr_err("Invalid time: %s", optarg);
+                    return -1;
+                }
+                pc->until = (uint64_t)(until * 1e9);
+                break;
+            case 'L':
+                if (parse_names(optarg, level_names, TRUE, &pc->levels)) {
+                    pr_err("Invalid level: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'F':
+                if (parse_names(optarg, facility_names, FALSE, &pc->facilities)) {
+                    pr_err("Invalid facility: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'g':
+                pc->grep = optarg;
+                pc->grep_len = strlen(optarg);
+                break;
+            case 'S':
+                pc->symbolize = TRUE;
+                break;
+            case 'Y':
+                if (STREQ(optarg, "text")) {
+                    pc->output = OUTPUT_TEXT;
+                } else if (STREQ(optarg, "jsonl")) {
+                    pc->output = OUTPUT_JSONL;
+                } else if (STREQ(optarg, "binary")) {
+                    pc->output = OUTPUT_BINARY;
+                } else if (STREQ(optarg, "syslog")) {
+                    pc->output = OUTPUT_SYSLOG;
+                } else {
+                    pr_err("Invalid output format: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'K':
+                sink_addr = optarg;
+                break;
+            case 'P':
+                pc->spool = optarg;
+                break;
+            case 'R':
+                from_spool = TRUE;
+                break;
+            case 'm':
+                map_arg = optarg;
+                break;
+            case 'a':
+                all = TRUE;
+                break;
+            case 'j':
+                jobs = strtol(optarg, &end, 10);
+                if (*end != '\0' || jobs <= 0) {
+                    pr_err("Invalid number of jobs: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'o':
+                output_dir = optarg;
+                break;
+            case 'T':
+                pc->threads = strtol(optarg, &end, 10);
+                if (*end != '\0' || pc->threads <= 0) {
+                    pr_err("Invalid number of threads: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'C':
+                pc->no_cache = TRUE;
+                break;
+            case 'N':
+                if (parse_size(optarg, &pc->scan_max) || !pc->scan_max) {
+                    pr_err("Invalid scan size: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'X':
+                if (!optarg || STREQ(optarg, "text")) {
+                    pc->stats = STATS_TEXT;
+                } else if (STREQ(optarg, "json")) {
+                    pc->stats = STATS_JSON;
+                } else {
+                    pr_err("Invalid stats format: %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return -1;
         }
     }
-}
-
-static int is_text_file(const char *path)
-{
-    unsigned char byte;
-    size_t bytes_read = 0;
-    FILE *file = fopen(path, "rb");
 
-    if (file == NULL) {
-        pr_err("Failed to open file: %s", path);
+    if (from_spool && !pc->spool) {
+        pr_err("--from-spool needs --spool");
         return -1;
     }
 
-    while (bytes_read < 1024  && fread(&byte, 1, 1, file) == 1) {
-        if (!isprint(byte) && !isspace(byte) && byte != '\0') {
-            fclose(file);
-            return 0;
-        }
-        bytes_read++;
+    /* what is printed is filtered, what is spooled never is */
+    if (pc->spool && !from_spool && (pc->tail || pc->since || pc->until || pc->levels ||
+                pc->facilities || pc->grep)) {
+        pr_err("The spool keeps all records, filter them with --from-spool");
+        return -1;
     }
 
-    fclose(file);
-    return 1;
-}
+    if (from_spool && (follow || map_arg || all)) {
+        pr_err("--from-spool takes a single guest");
+        return -1;
+    }
 
-int main(int argc, char *argv[])
-{
-    struct stat path_stat;
-    char *symmap_file = NULL;
-    char *guest_ac = NULL;
-    guest_access_t ac_type;
+    /* where KASLR put the kernel is not kept */
+    if (from_spool && pc->symbolize) {
+        pr_err("--symbolize needs the guest, not its spool");
+        return -1;
+    }
 
-    pc->debug = 1;
-    fp = stdout;
+    if (sink_addr && output_dir) {
+        pr_err("The output goes either to a sink or to --output-dir");
+        return -1;
+    }
 
-    fprintf(fp, "Version %s\n\n", get_version_text());
+    if (map_arg || all) {
+        if (follow) {
+            pr_err("Follow mode takes a single guest");
+            return -1;
+        }
+        /* the records would not say which guest they are from */
+        if (pc->output == OUTPUT_BINARY && !output_dir) {
+            pr_err("Binary output of several guests needs --output-dir");
+            return -1;
+        }
+        /* the guests are scraped in parallel already */
+        if (!pc->threads)
+            pc->threads = 1;
+        if (sink_addr && !(sink = sink_open(sink_addr, NULL, 0)))
+            return -1;
+        if (sink)
+            fp = gc->fp = sink_file(sink);
+        r = fleet_main(argc - optind, argv + optind, map_arg, all,
+                jobs, output_dir);
+        sink_close(sink);
+        return r;
+    }
 
-    if (argc != 3 ) {
-        fprintf(fp, "Usage: %s <domain_name/socket_path> <system.map>\n", argv[0]);
+    if (argc - optind != 1 && argc - optind != 2) {
+        usage(argv[0]);
         return -1;
     }
 
-    if (!stat(argv[1], &path_stat) && S_ISREG(path_stat.st_mode)) {
+    /* a binary stream starts over with the magic on every connection */
+    if (sink_addr) {
+        if (pc->output == OUTPUT_BINARY)
+            sink = sink_open(sink_addr, KVMDMESG_BIN_MAGIC, sizeof(KVMDMESG_BIN_MAGIC) - 1);
+        else
+            sink = sink_open(sink_addr, NULL, 0);
+        if (!sink)
+            return -1;
+        fp = gc->fp = sink_file(sink);
+    }
+
+    /* only the records go to stdout in the other formats, or to a sink */
+    if (pc->output == OUTPUT_TEXT && !sink)
+        fprintf(fp, "Version %s\n\n", get_version_text());
+    argv += optind - 1;
+
+    /* the guest alone, its kernel is found through vmcoreinfo */
+    if (argc - optind == 1)
+        guest_ac = argv[1];
+    else if (!stat(argv[1], &path_stat) && S_ISREG(path_stat.st_mode)) {
         if ( is_text_file(argv[1]) == 1) {
             symmap_file = argv[1];
             guest_ac = argv[2];
         }
     }
 
-    if (!symmap_file) {
+    if (!guest_ac) {
         if (!stat(argv[2], &path_stat) && S_ISREG(path_stat.st_mode)) {
             if ( is_text_file(argv[2]) == 1) {
                 symmap_file = argv[2];
@@ -375,81 +666,51 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (!symmap_file) {
+    if (!guest_ac) {
         pr_err("System.map file not foound");
+        sink_close(sink);
         return -1;
     }
 
-    if (stat(guest_ac, &path_stat) == 0) {
-        if (S_ISREG(path_stat.st_mode)) {
-            ac_type = GUEST_MEMORY;
-        } else if (S_ISSOCK(path_stat.st_mode)) {
-            ac_type = QMP_SOCKET;
-        } else {
-            pr_err("Unknown file type: %s", guest_ac);
-            return -1;
-        }
-    } else {
-        ac_type = GUEST_NAME;
-    }
+    if (from_spool) {
+        if (pc->output == OUTPUT_TEXT && !sink)
+            fprintf(fp, "Guest: %s\nSpool: %s\n", guest_ac, pc->spool);
+        if (!sink)
+            out_begin();
 
-    fprintf(fp, "Guest: %s\n", guest_ac);
-    fprintf(fp, "System.map: %s\n", symmap_file);
+        r = dump_spool_log(guest_ac);
 
-    if (guest_client_new(guest_ac, ac_type))
-        return -1;
-
-    symtab_init(symmap_file);
-
-    x86_64_init();
-
-    derive_kaslr_offset();
-
-    x86_64_post_reloc();
+        if (pc->stats)
+            stats_report(stderr, guest_ac, &gc->stats, pc->stats);
+        sink_close(sink);
+        return r;
+    }
 
-    if (kernel_symbol_exists("prb")) {
-        dump_lockless_record_log();
-        goto exit;
+    if (pc->symbolize && !symmap_file) {
+        pr_err("--symbolize needs the System.map of the guest");
+        sink_close(sink);
+        return -1;
     }
 
-    if (kernel_symbol_exists("log_first_idx") &&
-            kernel_symbol_exists("log_next_idx")) {
-        dump_variable_length_record_log();
-        goto exit;
+    if (pc->output == OUTPUT_TEXT && !sink) {
+        fprintf(fp, "Guest: %s\n", guest_ac);
+        if (symmap_file)
+            fprintf(fp, "System.map: %s\n", symmap_file);
     }
 
-    ulong log_buf_len = 0;
-    ulong log_buf = 0;
+    /* the HOSTNAME of the messages */
+    if (pc->output == OUTPUT_SYSLOG)
+        gc->name = guest_ac;
 
-    get_symbol_data("log_buf", sizeof(char *), &log_buf);
-    get_symbol_data("log_buf_len", sizeof(uint32_t), &log_buf_len);
+    symtab_init(symmap_file);
+    if (!sink)
+        out_begin();
 
-    log_buf_len &= ((1<<20) | ((1<<20) - 1));
-    char *logbuf_arry = malloc(log_buf_len);
+    r = scrape_guest(guest_ac);
 
-    if (CRASHDEBUG(1)) {
-        pr_debug("log_buf len: %ld (0x%lx)", log_buf_len, log_buf_len);
-        pr_debug("log_buf addr: 0x%lx", log_buf);
-    }
-    readmem(log_buf, KVADDR, logbuf_arry, log_buf_len);
-
-    int next_line = FALSE;
-    for (ulong i = 0; i < log_buf_len; i++) {
-        if (logbuf_arry[i]) {
-            if (ascii(logbuf_arry[i])) {
-                next_line = TRUE;
-                fputc(logbuf_arry[i], fp);
-            }
-        } else {
-            if (next_line)
-                fputc('\n', fp);
-            next_line = FALSE;
-        }
-    }
-    fprintf(fp, "\n");
-    write_data_to_file("dmesg.data", logbuf_arry, log_buf_len);
+    if (pc->stats)
+        stats_report(stderr, guest_ac, &gc->stats, pc->stats);
 
-exit:
-    guest_client_release();
-    return 0;
+    sink_close(sink);
+    return r;
 }
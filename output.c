@@ -0,0 +1,588 @@
+/* output.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "defs.h"
+#include "output.h"
+#include "ksym.h"
+#include "spool.h"
+
+/*
+ * Records are formatted into a buffer of the thread and go out to fp a
+ * buffer at a time, in whole records, so that a sink can tell where one
+ * ends.  The dump functions call out_flush() when they are done, so the
+ * buffer is empty whenever fp may change.  A guest context with a
+ * record_fn gets the records handed over unformatted instead.
+ *
+ * pc->output picks the format: dmesg's text, a JSON object per record,
+ * the binary records of kvmdmesg.h, or syslog messages.
+ */
+static __thread char out_buf[OUTPUT_BUF_SIZE];
+static __thread size_t out_len;
+static __thread size_t out_mark;        /* where the record being formatted starts */
+static __thread uint64_t out_records;   /* not in the stats yet */
+
+/* the record being formatted stays, unless it is all there is */
+static void out_drain(void)
+{
+    size_t n = out_mark ? out_mark : out_len;
+
+    if (n) {
+        fwrite(out_buf, 1, n, fp);
+        stats_add(&gc->stats.bytes_out, n);
+    }
+    memmove(out_buf, out_buf + n, out_len - n);
+    out_len -= n;
+    out_mark = 0;
+}
+
+void out_flush(void)
+{
+    out_mark = 0;
+    out_drain();
+    if (out_records) {
+        stats_add(&gc->stats.records, out_records);
+        out_records = 0;
+    }
+    if (fp)
+        fflush(fp);
+}
+
+/* what isprint() || isspace() let through in the C locale */
+static inline int out_safe(unsigned char c)
+{
+    return (c >= 0x20 && c < 0x7f) || (c >= '\t' && c <= '\r');
+}
+
+/* length of the run of safe bytes at the start of s */
+static size_t out_safe_run(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i print_lo = _mm_set1_epi8(0x1f);
+    const __m128i print_hi = _mm_set1_epi8(0x7f);
+    const __m128i space_lo = _mm_set1_epi8('\t' - 1);
+    const __m128i space_hi = _mm_set1_epi8('\r' + 1);
+    __m128i v, ok;
+    int mask;
+
+    /* bytes from 0x80 up are negative here and fail both ranges */
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        ok = _mm_or_si128(
+                _mm_and_si128(_mm_cmpgt_epi8(v, print_lo), _mm_cmplt_epi8(v, print_hi)),
+                _mm_and_si128(_mm_cmpgt_epi8(v, space_lo), _mm_cmplt_epi8(v, space_hi)));
+        mask = _mm_movemask_epi8(ok);
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+#endif
+
+    for (; i < len && out_safe(s[i]); i++)
+        ;
+
+    return i;
+}
+
+/*
+ * Length of the run at the start of s that goes into a JSON string as
+ * it is: printable ASCII but the quote and the backslash.
+ */
+static size_t out_json_run(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i print_lo = _mm_set1_epi8(0x1f);
+    const __m128i print_hi = _mm_set1_epi8(0x7f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    __m128i v, ok, esc;
+    int mask;
+
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        ok = _mm_and_si128(_mm_cmpgt_epi8(v, print_lo), _mm_cmplt_epi8(v, print_hi));
+        esc = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+        mask = _mm_movemask_epi8(_mm_andnot_si128(esc, ok));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+#endif
+
+    for (; i < len && s[i] >= 0x20 && s[i] < 0x7f && s[i] != '"' && s[i] != '\\'; i++)
+        ;
+
+    return i;
+}
+
+/* length of the well-formed UTF-8 sequence at the start of s, 0 if none */
+static size_t out_utf8_len(const unsigned char *s, size_t len)
+{
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t n, i;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        n = 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        n = 3;
+        if (s[0] == 0xe0)
+            lo = 0xa0;
+        else if (s[0] == 0xed)
+            hi = 0x9f;      /* no surrogates */
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        n = 4;
+        if (s[0] == 0xf0)
+            lo = 0x90;
+        else if (s[0] == 0xf4)
+            hi = 0x8f;      /* nothing above U+10FFFF */
+    } else {
+        return 0;
+    }
+
+    if (len < n || s[1] < lo || s[1] > hi)
+        return 0;
+    for (i = 2; i < n; i++) {
+        if (s[i] < 0x80 || s[i] > 0xbf)
+            return 0;
+    }
+
+    return n;
+}
+
+/*
+ * text as the inside of a JSON string.  UTF-8 goes through as it is;
+ * control characters are escaped, and every byte that is not part of
+ * well-formed UTF-8 becomes \ufffd, so whatever the guest logged is
+ * still valid JSON.
+ */
+static void out_json_text(const char *text, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *)text;
+    size_t room, n;
+    char *p;
+
+    while (len) {
+        room = OUTPUT_BUF_SIZE - out_len;
+        if (room < 6) {
+            out_drain();
+            continue;
+        }
+
+        n = out_json_run(s, len < room ? len : room);
+        memcpy(out_buf + out_len, s, n);
+        out_len += n;
+        s += n;
+        len -= n;
+
+        if (!len || n == room)
+            continue;
+        if (OUTPUT_BUF_SIZE - out_len < 6)
+            out_drain();
+
+        if (*s >= 0x80 && (n = out_utf8_len(s, len))) {
+            memcpy(out_buf + out_len, s, n);
+            out_len += n;
+            s += n;
+            len -= n;
+            continue;
+        }
+
+        p = out_buf + out_len;
+        *p++ = '\\';
+        switch (*s) {
+            case '"':  *p++ = '"'; break;
+            case '\\': *p++ = '\\'; break;
+            case '\n': *p++ = 'n'; break;
+            case '\t': *p++ = 't'; break;
+            default:
+                if (*s >= 0x80) {
+                    memcpy(p, "ufffd", 5);
+                    p += 5;
+                    break;
+                }
+                *p++ = 'u';
+                *p++ = '0';
+                *p++ = '0';
+                *p++ = hex[*s >> 4];
+                *p++ = hex[*s & 0xf];
+                break;
+        }
+        out_len = p - out_buf;
+        s++;
+        len--;
+    }
+}
+
+/* copy text, with '.' for anything that is not printable */
+static void out_text(const char *text, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)text;
+    size_t room, n;
+
+    while (len) {
+        room = OUTPUT_BUF_SIZE - out_len;
+        if (!room) {
+            out_drain();
+            continue;
+        }
+
+        n = out_safe_run(s, len < room ? len : room);
+        memcpy(out_buf + out_len, s, n);
+        out_len += n;
+        s += n;
+        len -= n;
+
+        if (len && n < room) {
+            out_buf[out_len++] = '.';
+            s++;
+            len--;
+        }
+    }
+}
+
+static inline int out_word_char(unsigned char c)
+{
+    return isalnum(c) || c == '_';
+}
+
+/*
+ * sym+off/size for the kernel text address of the guest at s, which is
+ * 16 hex digits from ffff on.  The symbols are those of the System.map,
+ * from before the kernel was moved by KASLR.
+ */
+static int out_symbol(const char *s, char *buf, size_t size)
+{
+    uint64_t addr = 0, off, len;
+    const char *name;
+    int i, v;
+
+    if (memcmp(s, "ffff", 4))
+        return -1;
+
+    for (i = 0; i < 16; i++) {
+        if (s[i] >= '0' && s[i] <= '9')
+            v = s[i] - '0';
+        else if (s[i] >= 'a' && s[i] <= 'f')
+            v = s[i] - 'a' + 10;
+        else
+            return -1;
+        addr = (addr << 4) | v;
+    }
+
+    if (kt->flags & RELOC_SET)
+        addr += kt->relocate;
+
+    if (!(name = ksym_lookup(st->ksyms, addr, &off, &len)))
+        return -1;
+
+    return snprintf(buf, size, "%s+0x%llx/0x%llx", name,
+            (unsigned long long)off, (unsigned long long)len);
+}
+
+/*
+ * text through put, but with the addresses printk printed as hex, with
+ * or without 0x in front, in the text of a function replaced by where
+ * they are, the way %pS prints them.
+ */
+static void out_text_symbolized(const char *text, size_t len,
+        void (*put)(const char *, size_t))
+{
+    const char *end = text + len, *done = text, *s = text, *start;
+    char sym[640];
+    int n;
+
+    while ((s = memchr(s, 'f', end - s))) {
+        start = s;
+        if (s - text >= 2 && s[-2] == '0' && s[-1] == 'x')
+            start = s - 2;
+
+        if (end - s < 16 || (start > text && out_word_char(start[-1])) ||
+                (end - s > 16 && out_word_char(s[16])) ||
+                (n = out_symbol(s, sym, sizeof(sym))) < 0) {
+            s++;
+            continue;
+        }
+
+        put(done, start - done);
+        put(sym, (size_t)n < sizeof(sym) ? (size_t)n : sizeof(sym) - 1);
+        done = s = s + 16;
+    }
+
+    put(done, end - done);
+}
+
+/* "[%5llu.%06lu] " without going through printf */
+static void out_timestamp(uint64_t ts_nsec)
+{
+    uint64_t secs = ts_nsec / 1000000000;
+    unsigned long usecs = (ts_nsec % 1000000000) / 1000;
+    char digits[20];
+    char *p;
+    int n = 0, i;
+
+    if (OUTPUT_BUF_SIZE - out_len < 32)
+        out_drain();
+
+    do {
+        digits[n++] = '0' + secs % 10;
+        secs /= 10;
+    } while (secs);
+
+    p = out_buf + out_len;
+    *p++ = '[';
+    for (i = n; i < 5; i++)
+        *p++ = ' ';
+    while (n)
+        *p++ = digits[--n];
+
+    *p++ = '.';
+    for (i = 5; i >= 0; i--) {
+        p[i] = '0' + usecs % 10;
+        usecs /= 10;
+    }
+    p += 6;
+
+    *p++ = ']';
+    *p++ = ' ';
+    out_len = p - out_buf;
+}
+
+static void out_char(char c)
+{
+    if (out_len == OUTPUT_BUF_SIZE)
+        out_drain();
+    out_buf[out_len++] = c;
+}
+
+static void out_bytes(const void *buf, size_t len)
+{
+    const char *s = buf;
+    size_t n;
+
+    while (len) {
+        if (out_len == OUTPUT_BUF_SIZE)
+            out_drain();
+
+        n = OUTPUT_BUF_SIZE - out_len;
+        if (n > len)
+            n = len;
+        memcpy(out_buf + out_len, s, n);
+        out_len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+static void out_u64(uint64_t v)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (OUTPUT_BUF_SIZE - out_len < sizeof(digits))
+        out_drain();
+    while (n)
+        out_buf[out_len++] = digits[--n];
+}
+
+#define out_literal(s)  out_bytes(s, sizeof(s) - 1)
+
+static void out_json(const struct kvmdmesg_record *r)
+{
+    /* the records of several guests go to the same stream */
+    if (gc->name) {
+        out_literal("{\"guest\":\"");
+        out_json_text(gc->name, strlen(gc->name));
+        out_literal("\",\"seq\":");
+    } else {
+        out_literal("{\"seq\":");
+    }
+    out_u64(r->seq);
+    out_literal(",\"ts_nsec\":");
+    out_u64(r->ts_nsec);
+    out_literal(",\"level\":");
+    out_u64(r->level);
+    out_literal(",\"facility\":");
+    out_u64(r->facility);
+    out_literal(",\"caller_id\":");
+    out_u64(r->caller_id);
+    out_literal(",\"text\":\"");
+    if (r->text && st->ksyms)
+        out_text_symbolized(r->text, r->len, out_json_text);
+    else if (r->text)
+        out_json_text(r->text, r->len);
+    out_literal("\"}\n");
+}
+
+/*
+ * RFC 5424, octet counted as RFC 6587 has it for TCP:
+ *
+ *   LEN <PRI>1 - HOSTNAME kernel - - [kvmdmesg@32473 seq="N" ...] TEXT
+ *
+ * The guest is the HOSTNAME and the time is left out, the guest has no
+ * clock the host can trust; its timestamp goes with the structured data.
+ * The message is built whole in out_buf, with room for the length in
+ * front, and is cut at OUTPUT_SYSLOG_MAX so it always fits.
+ */
+#define OUTPUT_SYSLOG_MAX   (8192)  /* what collectors have to take, RFC 5425 */
+#define OUTPUT_SYSLOG_LEN   (5)     /* "8192 " */
+
+static __thread size_t out_syslog_room;
+
+static void out_syslog_text(const char *text, size_t len)
+{
+    if (len > out_syslog_room)
+        len = out_syslog_room;
+    out_syslog_room -= len;
+    out_text(text, len);
+}
+
+/* PRINTUSASCII without the spaces, or "-" */
+static void out_syslog_hostname(const char *name)
+{
+    size_t n = 0;
+
+    for (; name && *name && n < 255; name++, n++)
+        out_char(*name > ' ' && *name < 0x7f ? *name : '_');
+    if (!n)
+        out_char('-');
+}
+
+static void out_syslog(const struct kvmdmesg_record *r)
+{
+    unsigned int facility = r->facility < 24 ? r->facility : 0;
+    size_t start, len;
+    char prefix[OUTPUT_SYSLOG_LEN + 1];
+    int n;
+
+    if (OUTPUT_BUF_SIZE - out_len < OUTPUT_SYSLOG_MAX + OUTPUT_SYSLOG_LEN)
+        out_drain();
+    start = out_len;
+    out_len += OUTPUT_SYSLOG_LEN;
+
+    out_char('<');
+    out_u64(facility * 8 + (r->level & 7));
+    out_literal(">1 - ");
+    out_syslog_hostname(gc->name);
+    out_literal(" kernel - - [kvmdmesg@32473 seq=\"");
+    out_u64(r->seq);
+    out_literal("\" ts_nsec=\"");
+    out_u64(r->ts_nsec);
+    out_literal("\" caller_id=\"");
+    out_u64(r->caller_id);
+    out_literal("\"]");
+
+    len = out_len - start - OUTPUT_SYSLOG_LEN;
+    if (r->text && r->len) {
+        out_char(' ');
+        out_syslog_room = OUTPUT_SYSLOG_MAX - len - 1;
+        if (st->ksyms)
+            out_text_symbolized(r->text, r->len, out_syslog_text);
+        else
+            out_syslog_text(r->text, r->len);
+        len = out_len - start - OUTPUT_SYSLOG_LEN;
+    }
+
+    /* the length goes right before the message */
+    n = snprintf(prefix, sizeof(prefix), "%zu ", len);
+    memmove(out_buf + start + n, out_buf + start + OUTPUT_SYSLOG_LEN, len);
+    memcpy(out_buf + start, prefix, n);
+    out_len = start + n + len;
+}
+
+/* the text as the guest has it, see struct kvmdmesg_bin_record */
+static void out_binary(const struct kvmdmesg_record *r)
+{
+    static const char zero[8];
+    struct kvmdmesg_bin_record b;
+    size_t len = r->text ? r->len : 0;
+
+    memset(&b, 0, sizeof(b));
+    b.size = roundup(sizeof(b) + len, 8);
+    b.text_len = len;
+    b.level = r->level;
+    b.facility = r->facility;
+    b.caller_id = r->caller_id;
+    b.seq = r->seq;
+    b.ts_nsec = r->ts_nsec;
+
+    out_bytes(&b, sizeof(b));
+    out_bytes(r->text, len);
+    out_bytes(zero, b.size - sizeof(b) - len);
+}
+
+/* what goes in front of the records of a stream, straight to fp */
+void out_begin(void)
+{
+    if (pc->output == OUTPUT_BINARY)
+        fwrite(KVMDMESG_BIN_MAGIC, 1, sizeof(KVMDMESG_BIN_MAGIC) - 1, fp);
+}
+
+void out_record(const struct kvmdmesg_record *r)
+{
+    /* only what a spool does not have yet */
+    if (gc->spool && !spool_append(gc->spool, r))
+        return;
+
+    out_records++;
+
+    if (gc->record_fn) {
+        gc->record_fn(r, gc->record_arg);
+        return;
+    }
+
+    out_mark = out_len;
+
+    if (pc->output == OUTPUT_SYSLOG) {
+        out_syslog(r);
+        return;
+    }
+
+    if (pc->output == OUTPUT_JSONL) {
+        out_json(r);
+        return;
+    }
+
+    if (pc->output == OUTPUT_BINARY) {
+        out_binary(r);
+        return;
+    }
+
+    /* a record without text is still a line */
+    if (!r->text) {
+        out_char('\n');
+        return;
+    }
+
+    out_timestamp(r->ts_nsec);
+    if (st->ksyms)
+        out_text_symbolized(r->text, r->len, out_text);
+    else
+        out_text(r->text, r->len);
+    out_char('\n');
+}
@@ -0,0 +1,36 @@
+/* output.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kvmdmesg.h"
+
+#define OUTPUT_BUF_SIZE     (64 * 1024)
+
+/* what pc->output says records are written as */
+#define OUTPUT_TEXT         (0)     /* like dmesg */
+#define OUTPUT_JSONL        (1)     /* a JSON object per line */
+#define OUTPUT_BINARY       (2)     /* see struct kvmdmesg_bin_record */
+#define OUTPUT_SYSLOG       (3)     /* RFC 5424 messages, octet counted */
+
+void out_begin(void);
+void out_record(const struct kvmdmesg_record *r);
+void out_flush(void);
+
+#endif
@@ -13,13 +13,22 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
+
+#include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "xutil.h"
 #include "log.h"
 #include "defs.h"
 #include "printk.h"
+#include "output.h"
+#include "vmcoreinfo.h"
+#include "spool.h"
 
 #define DESC_SV_BITS		(sizeof(unsigned long) * 8)
 #define DESC_FLAGS_SHIFT	(DESC_SV_BITS - 2)
@@ -27,6 +36,17 @@
 #define DESC_STATE(sv)		(3UL & (sv >> DESC_FLAGS_SHIFT))
 #define DESC_ID_MASK		(~DESC_FLAGS_MASK)
 #define DESC_ID(sv)	    	((sv) & DESC_ID_MASK)
+#define DESC_SV(id, state)	(((unsigned long)state << DESC_FLAGS_SHIFT) | id)
+
+/* flags:5 and level:3 share the byte after facility */
+#define INFO_LEVEL(info)	(UCHAR((info) + offsetof(struct printk_info, facility) + 1) >> 5)
+#define LOG_LEVEL(p)		(UCHAR((p) + offsetof(struct log, facility) + 1) >> 5)
+
+/* a range can cost a monitor round trip, a page of text is cheaper */
+#define PRB_TEXT_GAP		(PAGE_SIZE)
+
+/* how often a record that a writer is changing is read again */
+#define PRB_READ_RETRIES	(3)
 
 enum desc_state {
     desc_miss	    =  -1,	/* ID mismatch (pseudo state) */
@@ -36,36 +56,10 @@ enum desc_state {
     desc_reusable	= 0x3,	/* free, not yet used by any writer */
 };
 
-static char *vmcoreinfo_buf = NULL;
-
-static char *vmcoreinfo_read_string(const char *key)
-{
-    const char *buf = vmcoreinfo_buf;
-    char *value_string = NULL;
-    char *p1, *p2;
-    size_t value_length;
-    char keybuf[80] = {0};
-
-    snprintf(keybuf, sizeof(keybuf), "%s=", key);
-
-    if ((p1 = strstr(buf, keybuf))) {
-        p2 = p1 + strlen(keybuf);
-        p1 = strstr(p2, "\n");
-        value_length = p1 - p2;
-        value_string = xcalloc(value_length + 1, sizeof(char));
-        strncpy(value_string, p2, value_length);
-        value_string[value_length] = '\0';
-    }
-
-    return value_string;
-}
-
 long datatype_info(char *name, char *member, int datatype)
 {
     char buf[64] = {0};
-    char *value_string;
-    char *endptr;
-    long value  = 0;
+    long value = 0;
 
     if (datatype == STRUCT_SIZE_REQUEST){
         snprintf(buf, sizeof(buf), "SIZE(%s)", name);
@@ -73,34 +67,29 @@ long datatype_info(char *name, char *member, int datatype)
         snprintf(buf, sizeof(buf), "OFFSET(%s.%s)", name, member);
     }
 
-    if (strlen(buf)) {
-        value_string = vmcoreinfo_read_string(buf);
-        if (value_string) {
-            value = strtol(value_string, &endptr, 10);
-            xfree(value_string);
-        }
-   }
+    if (strlen(buf))
+        vmcoreinfo_number(gc->vmcoreinfo, buf, &value);
 
     return value;
 }
 
-static void vmcoreinfo_init()
+static struct vmcoreinfo *vmcoreinfo_read(void)
 {
-    char *buf, *n;
+    struct vmcoreinfo *vi;
+    char *buf;
     size_t vmcoreinfo_size;
     ulong vmcoreinfo_data;
 
     get_symbol_data("vmcoreinfo_size", sizeof(vmcoreinfo_size), &vmcoreinfo_size);
     vmcoreinfo_size &= ((1<<13) - 1);
 
-    vmcoreinfo_buf = xmalloc(vmcoreinfo_size + 1);
-    buf = vmcoreinfo_buf;
+    buf = buf_get(gc->bufs, vmcoreinfo_size);
     get_symbol_data("vmcoreinfo_data", sizeof(vmcoreinfo_data), &vmcoreinfo_data);
     if (readmem(vmcoreinfo_data, KVADDR, buf, vmcoreinfo_size)) {
         pr_err("cannot read vmcoreinfo_data");
-        goto err;
+        buf_put(gc->bufs, buf);
+        return NULL;
     }
-    buf[vmcoreinfo_size] = '\n';
 
     if (CRASHDEBUG(2)) {
         for (size_t i = 0; i < vmcoreinfo_size; i++) {
@@ -109,6 +98,33 @@ static void vmcoreinfo_init()
         fprintf(fp, "\n");
     }
 
+    vi = vmcoreinfo_parse(buf, vmcoreinfo_size);
+    buf_put(gc->bufs, buf);
+
+    return vi;
+}
+
+/*
+ * vmcoreinfo is read from the guest once per session, or not at all when
+ * the cache has it for this System.map, and the tables are filled from
+ * the parsed copy.
+ */
+static void vmcoreinfo_init()
+{
+    uint64_t start = xclock_ns();
+    char *n;
+
+    if (!gc->vmcoreinfo) {
+        if (st->vmcoreinfo) {
+            gc->vmcoreinfo = st->vmcoreinfo;
+        } else {
+            if (!(gc->vmcoreinfo = vmcoreinfo_read()))
+                return;
+            if (vmcoreinfo_lookup(gc->vmcoreinfo, "SIZE(printk_info)"))
+                vmcoreinfo_cache_store(gc->vmcoreinfo, st->map_key);
+        }
+    }
+
     n = "printk_info";
     STRUCT_SIZE_INIT(printk_info, n);
 
@@ -132,9 +148,44 @@ static void vmcoreinfo_init()
     STRUCT_SIZE_INIT(prb_data_ring, n);
     MEMBER_OFFSET_INIT(prb_data_ring_size_bits, n, "size_bits");
     MEMBER_OFFSET_INIT(prb_data_ring_data, n, "data");
+    MEMBER_OFFSET_INIT(prb_data_ring_tail_lpos, n, "tail_lpos");
+
+    stats_stop(STATS_VMCOREINFO, start);
+}
 
-err:
-    xfree(vmcoreinfo_buf);
+/*
+ * The filters of the command line, checked on what the info of a record
+ * says before its text is read, see prb_map_copy().  Only --grep needs
+ * the text itself.
+ */
+static int record_wanted(uint64_t ts_nsec, int level, int facility)
+{
+    if (ts_nsec < pc->since || (pc->until && ts_nsec > pc->until))
+        return FALSE;
+
+    if (pc->levels && !(pc->levels & (1U << level)))
+        return FALSE;
+
+    if (pc->facilities && (facility >= 32 || !(pc->facilities & (1U << facility))))
+        return FALSE;
+
+    return TRUE;
+}
+
+static int text_wanted(const char *text, size_t len)
+{
+    if (!pc->grep)
+        return TRUE;
+
+    return text && memmem(text, len, pc->grep, pc->grep_len) != NULL;
+}
+
+static int prb_info_wanted(struct prb_map *m, unsigned long id)
+{
+    char *info = m->infos + (id % m->desc_ring_count) * SIZE(printk_info);
+
+    return record_wanted(ULONGLONG(info + offsetof(struct printk_info, ts_nsec)),
+            INFO_LEVEL(info), UCHAR(info + offsetof(struct printk_info, facility)));
 }
 
 static enum desc_state get_desc_state(unsigned long id,
@@ -146,137 +197,1287 @@ static enum desc_state get_desc_state(unsigned long id,
     return DESC_STATE(state_val);
 }
 
+static unsigned long prb_load_state_var(char *desc)
+{
+    return __atomic_load_n((unsigned long *)(desc + offsetof(struct prb_desc, state_var) +
+                offsetof(atomic_long_t, counter)), __ATOMIC_ACQUIRE);
+}
+
+/* text of a record taken out of a ring used in place */
+static __thread char prb_text[USHRT_MAX + 1];
+
+/*
+ * A ring used in place is live, so like prb_read_valid() in the kernel
+ * the record is taken out and only used if its state did not change
+ * meanwhile.  Copied rings were checked when they were read, see
+ * prb_map_validate(), and pass the first time.
+ */
 static void dump_record(struct prb_map *m, unsigned long id)
 {
-    unsigned short text_len;
+    struct kvmdmesg_record r = { 0 };
+    unsigned short text_len = 0;
     unsigned long state_var;
-    char *desc, *info, *text, *p;
+    char *desc, *info, *text = NULL;
     enum desc_state state;
     unsigned long begin;
     unsigned long next;
-    uint64_t ts_nsec;
-    unsigned long long nanos;
-    unsigned long rem;
-    char buf[1024];
-    int i;
+    uint64_t ts_nsec = 0;
+    int try;
 
-    desc = m->descs + ((id % m->desc_ring_count) * sizeof(struct prb_desc));
+    desc = m->descs + (id % m->desc_ring_count) * SIZE(prb_desc);
+    info = m->infos + (id % m->desc_ring_count) * SIZE(printk_info);
 
-    state_var = ULONG(desc + offsetof(struct prb_desc, state_var) +
-            offsetof(atomic_long_t, counter));
-    state = get_desc_state(id, state_var);
+    for (try = 0; try < PRB_READ_RETRIES; try++) {
+        state_var = prb_load_state_var(desc);
+        state = get_desc_state(id, state_var);
+
+        if (state != desc_committed && state != desc_finalized)
+            return;
+
+        r.seq = ULONGLONG(info + offsetof(struct printk_info, seq));
+        r.facility = UCHAR(info + offsetof(struct printk_info, facility));
+        r.level = INFO_LEVEL(info);
+        r.caller_id = UINT(info + offsetof(struct printk_info, caller_id));
+        ts_nsec = ULONGLONG(info + offsetof(struct printk_info, ts_nsec));
+        text_len = USHORT(info + offsetof(struct printk_info, text_len));
+
+        begin = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
+                offsetof(struct prb_data_blk_lpos, begin)) % m->text_data_ring_size;
+        next = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
+                offsetof(struct prb_data_blk_lpos, next)) % m->text_data_ring_size;
+
+        text = NULL;
+        if (begin != next) {
+            if (begin > next)
+                begin = 0;
+
+            begin += sizeof(unsigned long);
+
+            if (next - begin < text_len)
+                text_len = next - begin;
 
-    if (state != desc_committed && state != desc_finalized)
+            text = m->text_data + begin;
+            if (!(m->copied & PRB_COPIED_TEXT_DATA)) {
+                memcpy(prb_text, text, text_len);
+                text = prb_text;
+            }
+        }
+
+        if (prb_load_state_var(desc) == state_var)
+            break;
+    }
+
+    /* a writer kept reusing it, it is gone by now */
+    if (try == PRB_READ_RETRIES)
         return;
 
-    info = m->infos + ((id % m->desc_ring_count) * sizeof(struct printk_info));
+    if (!record_wanted(ts_nsec, r.level, r.facility) || !text_wanted(text, text_len))
+        return;
+
+    r.ts_nsec = ts_nsec;
+    r.text = text;
+    r.len = text ? text_len : 0;
+    out_record(&r);
+}
+
+/*
+ * Use the guest memory in place when the backend maps it, otherwise
+ * read it into a buffer of our own and flag it in m->copied.
+ */
+static char *prb_fetch(struct prb_map *m, ulong kaddr, long size,
+        unsigned long flag)
+{
+    char *p;
+
+    if ((p = peekmem(kaddr, KVADDR, size)))
+        return p;
+
+    p = buf_get(gc->bufs, size);
+
+    if (readmem(kaddr, KVADDR, p, size)) {
+        buf_put(gc->bufs, p);
+        return NULL;
+    }
 
-    text_len = USHORT(info + offsetof(struct printk_info, text_len));
+    m->copied |= flag;
+    return p;
+}
+
+/*
+ * Like prb_fetch(), but what is not mapped is only allocated.  The
+ * caller reads the parts of it that it needs.
+ */
+static char *prb_attach(struct prb_map *m, ulong kaddr, long size,
+        unsigned long flag)
+{
+    char *p;
+
+    if ((p = peekmem(kaddr, KVADDR, size)))
+        return p;
+
+    m->copied |= flag;
+    return buf_get(gc->bufs, size);
+}
+
+static void prb_release(struct prb_map *m, char *p, unsigned long flag)
+{
+    if (m->copied & flag)
+        buf_put(gc->bufs, p);
+}
+
+/*
+ * Queue [off, off + len) of a ring buffer of ring_size bytes, split in
+ * two where it wraps.  Nothing is queued for a buffer used in place.
+ */
+static void prb_queue_range(struct mem_req *reqs, int *nr, char *buf,
+        ulong kaddr, ulong ring_size, ulong off, ulong len)
+{
+    ulong n;
+
+    if (len > ring_size)
+        len = ring_size;
+
+    off %= ring_size;
+    while (len) {
+        n = ring_size - off < len ? ring_size - off : len;
+
+        reqs[*nr].addr = kaddr + off;
+        reqs[*nr].len = n;
+        reqs[*nr].dst = buf + off;
+        (*nr)++;
+
+        off = 0;
+        len -= n;
+    }
+}
+
+static void prb_map_release(struct prb_map *m)
+{
+    buf_put(gc->bufs, m->descs_check);
+    buf_put(gc->bufs, m->prb_check);
+    prb_release(m, m->text_data, PRB_COPIED_TEXT_DATA);
+    prb_release(m, m->infos, PRB_COPIED_INFOS);
+    prb_release(m, m->descs, PRB_COPIED_DESCS);
+    prb_release(m, m->prb, PRB_COPIED_PRB);
+    memset(m, 0, sizeof(*m));
+}
+
+/*
+ * Read the ring buffer structure and set up the descriptor, info and text
+ * buffers.  Nothing of the buffers themselves is read here, that is left
+ * to prb_map_fetch() for the records actually wanted.
+ */
+static int prb_map_init(struct prb_map *m)
+{
+    memset(m, 0, sizeof(*m));
+
+    get_symbol_data("prb", sizeof(char *), &m->prb_kaddr);
+
+    if (!(m->prb = prb_fetch(m, m->prb_kaddr, SIZE(printk_ringbuffer), PRB_COPIED_PRB))) {
+        pr_err("Cannot read printk_ringbuffer contents");
+        return -1;
+    }
+
+    m->desc_ring = m->prb + OFFSET(prb_desc_ring);
+    m->desc_ring_count = 1 << UINT(m->desc_ring + OFFSET(prb_desc_ring_count_bits));
+
+    m->text_data_ring = m->prb + OFFSET(prb_text_data_ring);
+    m->text_data_ring_size = 1 << UINT(m->text_data_ring + OFFSET(prb_data_ring_size_bits));
+
+    m->descs_kaddr = ULONG(m->desc_ring + OFFSET(prb_desc_ring_descs));
+    m->descs = prb_attach(m, m->descs_kaddr,
+            SIZE(prb_desc) * m->desc_ring_count, PRB_COPIED_DESCS);
+
+    m->infos_kaddr = ULONG(m->desc_ring + OFFSET(prb_desc_ring_infos));
+    m->infos = prb_attach(m, m->infos_kaddr,
+            SIZE(printk_info) * m->desc_ring_count, PRB_COPIED_INFOS);
+
+    m->text_data_kaddr = ULONG(m->text_data_ring + OFFSET(prb_data_ring_data));
+    m->text_data = prb_attach(m, m->text_data_kaddr,
+            m->text_data_ring_size, PRB_COPIED_TEXT_DATA);
+
+    /*
+     * Descriptors used in place change under us, so there would be no
+     * "before" to check the copied infos and text against, see
+     * prb_map_validate().  They are copied as well then.
+     */
+    if (!(m->copied & PRB_COPIED_DESCS) &&
+            (m->copied & (PRB_COPIED_INFOS | PRB_COPIED_TEXT_DATA))) {
+        m->descs = buf_get(gc->bufs, SIZE(prb_desc) * m->desc_ring_count);
+        m->copied |= PRB_COPIED_DESCS;
+    }
+
+    return 0;
+}
+
+static unsigned long prb_head_id(struct prb_map *m)
+{
+    return ULONG(m->desc_ring + OFFSET(prb_desc_ring_head_id) +
+            offsetof(atomic_long_t, counter));
+}
+
+static unsigned long prb_tail_id(struct prb_map *m)
+{
+    return ULONG(m->desc_ring + OFFSET(prb_desc_ring_tail_id) +
+            offsetof(atomic_long_t, counter));
+}
+
+static unsigned long prb_desc_state_var(struct prb_map *m, unsigned long id)
+{
+    char *desc = m->descs + (id % m->desc_ring_count) * SIZE(prb_desc);
+
+    return ULONG(desc + offsetof(struct prb_desc, state_var) +
+            offsetof(atomic_long_t, counter));
+}
+
+/* is id a before id b, in the wrapping id space of the descriptors */
+static int prb_id_before(unsigned long a, unsigned long b)
+{
+    return ((a - b) & DESC_ID_MASK) > (DESC_ID_MASK >> 1);
+}
+
+/* number of records from..head, at most a ring full */
+static unsigned long prb_fetch_count(struct prb_map *m, unsigned long from)
+{
+    unsigned long head_id = prb_head_id(m), n;
+
+    if (prb_id_before(head_id, from))
+        return 0;
+
+    n = ((head_id - from) & DESC_ID_MASK) + 1;
+    return n > m->desc_ring_count ? m->desc_ring_count : n;
+}
+
+/*
+ * Read n records from from on: first their descriptors and infos, then
+ * the text of those that pass the filters, see record_wanted().  The
+ * text blocks of consecutive records follow each other in the data ring
+ * and are read as one run; gaps of up to PRB_TEXT_GAP, left by records
+ * filtered out, are read along rather than cost a range of their own.
+ * Buffers used in place are always current.
+ */
+static int prb_map_copy(struct prb_map *m, unsigned long from, unsigned long n)
+{
+    struct mem_req reqs[4], *text_reqs;
+    unsigned long id, i;
+    unsigned long begin, next, run_begin = 0, run_next = 0, state_var;
+    char *desc;
+    int nr = 0, have_run = FALSE, ret = 0;
+
+    if (m->copied & PRB_COPIED_DESCS)
+        prb_queue_range(reqs, &nr, m->descs, m->descs_kaddr,
+                SIZE(prb_desc) * m->desc_ring_count,
+                (from % m->desc_ring_count) * SIZE(prb_desc), n * SIZE(prb_desc));
+
+    if (m->copied & PRB_COPIED_INFOS)
+        prb_queue_range(reqs, &nr, m->infos, m->infos_kaddr,
+                SIZE(printk_info) * m->desc_ring_count,
+                (from % m->desc_ring_count) * SIZE(printk_info), n * SIZE(printk_info));
+
+    if (nr && readmem_batch(reqs, nr, KVADDR)) {
+        pr_err("Cannot read prb_desc_ring contents");
+        return -1;
+    }
+
+    if (!(m->copied & PRB_COPIED_TEXT_DATA))
+        return 0;
+
+    text_reqs = buf_get(gc->bufs, (2 * n + 2) * sizeof(*text_reqs));
+    nr = 0;
+
+    for (id = from, i = 0; i < n; i++, id = (id + 1) & DESC_ID_MASK) {
+        state_var = prb_desc_state_var(m, id);
+        if (DESC_ID(state_var) != id)
+            continue;
+
+        desc = m->descs + (id % m->desc_ring_count) * SIZE(prb_desc);
+        begin = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
+                offsetof(struct prb_data_blk_lpos, begin));
+        next = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
+                offsetof(struct prb_data_blk_lpos, next));
+
+        if ((begin & 1UL) || !prb_info_wanted(m, id))
+            continue;    /* data-less, or not shown */
+
+        if (have_run && (long)(begin - run_next) >= 0 &&
+                begin - run_next <= PRB_TEXT_GAP) {
+            run_next = next;
+            continue;
+        }
+
+        if (have_run)
+            prb_queue_range(text_reqs, &nr, m->text_data, m->text_data_kaddr,
+                    m->text_data_ring_size, run_begin, run_next - run_begin);
+
+        run_begin = begin;
+        run_next = next;
+        have_run = TRUE;
+    }
+
+    if (have_run)
+        prb_queue_range(text_reqs, &nr, m->text_data, m->text_data_kaddr,
+                m->text_data_ring_size, run_begin, run_next - run_begin);
+
+    if (nr && readmem_batch(text_reqs, nr, KVADDR)) {
+        pr_err("Cannot read prb_text_data_ring contents");
+        ret = -1;
+    }
+
+    buf_put(gc->bufs, text_reqs);
+    return ret;
+}
+
+/* the text of desc is overwritten, the tail of the data ring moved past it */
+static int prb_text_overrun(struct prb_map *m, char *desc)
+{
+    unsigned long begin, tail_lpos;
+
+    if (!OFFSET(prb_data_ring_tail_lpos))
+        return FALSE;
 
     begin = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
-            offsetof(struct prb_data_blk_lpos, begin)) % m->text_data_ring_size;
-    next = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
-            offsetof(struct prb_data_blk_lpos, next)) % m->text_data_ring_size;
+            offsetof(struct prb_data_blk_lpos, begin));
+    if (begin & 1UL)
+        return FALSE;
+
+    tail_lpos = ULONG(m->prb_check + OFFSET(prb_text_data_ring) +
+            OFFSET(prb_data_ring_tail_lpos) + offsetof(atomic_long_t, counter));
+
+    return (long)(tail_lpos - begin) > 0;
+}
+
+/*
+ * Still the same record with the same text block.  The state bits are
+ * left out: a record going from committed to finalized meanwhile is
+ * how the kernel works, not a torn read.
+ */
+static int prb_desc_same(char *a, char *b)
+{
+    ulong sv = offsetof(struct prb_desc, state_var) + offsetof(atomic_long_t, counter);
+    ulong lpos = offsetof(struct prb_desc, text_blk_lpos);
+
+    return DESC_ID(ULONG(a + sv)) == DESC_ID(ULONG(b + sv)) &&
+        !memcmp(a + lpos, b + lpos, sizeof(struct prb_data_blk_lpos));
+}
+
+/*
+ * The guest keeps logging while its ring is copied, so a record can be
+ * reused or have its text overwritten halfway through.  As with
+ * prb_read_valid() in the kernel, a record only counts if its
+ * descriptor still has the same id and text block after its info and
+ * text were copied as it had before.  The descriptors are read once
+ * more to check that, and the records that changed are copied again,
+ * up to PRB_READ_RETRIES times.  Those that still do not hold still
+ * are dropped.
+ */
+static int prb_map_validate(struct prb_map *m, unsigned long from, unsigned long n)
+{
+    ulong desc_size = SIZE(prb_desc), info_size = SIZE(printk_info);
+    ulong count = m->desc_ring_count;
+    unsigned long *ids, nr_ids, nr_left, id, i, off, begin, next;
+    enum desc_state state;
+    struct mem_req *reqs;
+    int nr, try, ret = -1;
+
+    if (!m->prb_check) {
+        m->prb_check = buf_get(gc->bufs, SIZE(printk_ringbuffer));
+        m->descs_check = buf_get(gc->bufs, desc_size * count);
+    }
+
+    ids = buf_get(gc->bufs, n * sizeof(*ids));
+    reqs = buf_get(gc->bufs, (3 * n + 2) * sizeof(*reqs));
 
-    if (begin == next)
-        goto out;
+    for (nr_ids = 0, i = 0, id = from; i < n; i++, id = (id + 1) & DESC_ID_MASK) {
+        state = get_desc_state(id, prb_desc_state_var(m, id));
+        if (state == desc_committed || state == desc_finalized)
+            ids[nr_ids++] = id;
+    }
 
-    ts_nsec = ULONGLONG(info + offsetof(struct printk_info, ts_nsec));
-    nanos = (unsigned long long)ts_nsec / (unsigned long long)1000000000;
-    rem = (unsigned long long)ts_nsec % (unsigned long long)1000000000;
-    snprintf(buf, sizeof(buf), "[%5lld.%06ld] ", nanos, rem/1000);
-    fprintf(fp, "%s", buf);
+    for (try = 0; nr_ids; try++) {
+        nr = 0;
+        reqs[nr].addr = m->prb_kaddr;
+        reqs[nr].len = SIZE(printk_ringbuffer);
+        reqs[nr].dst = m->prb_check;
+        nr++;
 
-    if (begin > next)
-        begin = 0;
+        if (!try) {
+            prb_queue_range(reqs, &nr, m->descs_check, m->descs_kaddr,
+                    desc_size * count, (from % count) * desc_size, n * desc_size);
+        } else {
+            for (i = 0; i < nr_ids; i++)
+                prb_queue_range(reqs, &nr, m->descs_check, m->descs_kaddr,
+                        desc_size * count, (ids[i] % count) * desc_size, desc_size);
+        }
 
-    begin += sizeof(unsigned long);
+        if (readmem_batch(reqs, nr, KVADDR)) {
+            pr_err("Cannot read prb_desc_ring contents");
+            goto out;
+        }
 
-    if (next - begin < text_len)
-        text_len = next - begin;
+        for (nr_left = 0, i = 0; i < nr_ids; i++) {
+            off = (ids[i] % count) * desc_size;
+            if (!prb_desc_same(m->descs + off, m->descs_check + off) ||
+                    prb_text_overrun(m, m->descs_check + off))
+                ids[nr_left++] = ids[i];
+        }
+        nr_ids = nr_left;
+
+        if (!nr_ids)
+            break;
+
+        if (try == PRB_READ_RETRIES) {
+            pr_warning("%lu records changed while they were read", nr_ids);
+            for (i = 0; i < nr_ids; i++)
+                ULONG(m->descs + (ids[i] % count) * desc_size +
+                        offsetof(struct prb_desc, state_var) +
+                        offsetof(atomic_long_t, counter)) = DESC_SV(ids[i], desc_reusable);
+            break;
+        }
 
-    text = m->text_data + begin;
+        if (CRASHDEBUG(1))
+            pr_debug("printk: %lu records changed while they were read", nr_ids);
 
-    for (i = 0, p = text; i < text_len; i++, p++) {
-        if (*p == '\n')
-            fprintf(fp, "\n");
-        else if (isprint(*p) || isspace(*p))
-            fputc(*p, fp);
-        else
-            fputc('.', fp);
+        /* the descriptors read now are the "before" of the next copy */
+        nr = 0;
+        for (nr_left = 0, i = 0; i < nr_ids; i++) {
+            id = ids[i];
+            off = (id % count) * desc_size;
+            memcpy(m->descs + off, m->descs_check + off, desc_size);
+
+            state = get_desc_state(id, prb_desc_state_var(m, id));
+            if (state != desc_committed && state != desc_finalized)
+                continue;    /* gone, or being written again */
+            ids[nr_left++] = id;
+
+            if (m->copied & PRB_COPIED_INFOS)
+                prb_queue_range(reqs, &nr, m->infos, m->infos_kaddr, info_size * count,
+                        (id % count) * info_size, info_size);
+
+            begin = ULONG(m->descs + off + offsetof(struct prb_desc, text_blk_lpos) +
+                    offsetof(struct prb_data_blk_lpos, begin));
+            next = ULONG(m->descs + off + offsetof(struct prb_desc, text_blk_lpos) +
+                    offsetof(struct prb_data_blk_lpos, next));
+            if ((m->copied & PRB_COPIED_TEXT_DATA) && !(begin & 1UL) && next != begin)
+                prb_queue_range(reqs, &nr, m->text_data, m->text_data_kaddr,
+                        m->text_data_ring_size, begin, next - begin);
+        }
+        nr_ids = nr_left;
+
+        if (nr && readmem_batch(reqs, nr, KVADDR)) {
+            pr_err("Cannot read prb_desc_ring contents");
+            goto out;
+        }
     }
 
+    ret = 0;
+
 out:
-    fprintf(fp, "\n");
+    buf_put(gc->bufs, reqs);
+    buf_put(gc->bufs, ids);
+    return ret;
 }
 
-void dump_lockless_record_log()
+/*
+ * Read the records from..head, and when they are copied make sure none
+ * of them was torn by a writer meanwhile.
+ */
+static int prb_map_fetch(struct prb_map *m, unsigned long from)
 {
-    unsigned long head_id;
-    unsigned long tail_id;
-    unsigned long kaddr;
-    unsigned long id;
-    struct prb_map m;
+    unsigned long n = prb_fetch_count(m, from);
+
+    if (!n)
+        return 0;
+
+    if (prb_map_copy(m, from, n))
+        return -1;
+
+    if (!(m->copied & PRB_COPIED_DESCS))
+        return 0;
+
+    return prb_map_validate(m, from, n);
+}
+
+/* re-read the ring heads, then what was added since the last pass */
+static int prb_map_update(struct prb_map *m, unsigned long from)
+{
+    if ((m->copied & PRB_COPIED_PRB) &&
+            readmem(m->prb_kaddr, KVADDR, m->prb, SIZE(printk_ringbuffer))) {
+        pr_err("Cannot read printk_ringbuffer contents");
+        return -1;
+    }
+
+    return prb_map_fetch(m, from);
+}
+
+/* the seq or ts_nsec of the info of a record, member says which */
+static int prb_info_u64(struct prb_map *m, unsigned long id, ulong member, uint64_t *v)
+{
+    ulong off = (id % m->desc_ring_count) * SIZE(printk_info) + member;
+
+    if ((m->copied & PRB_COPIED_INFOS) &&
+            readmem(m->infos_kaddr + off, KVADDR, m->infos + off, sizeof(*v)))
+        return -1;
+
+    *v = ULONGLONG(m->infos + off);
+    return 0;
+}
+
+/*
+ * The first record to print: the tail of the ring, or later when only
+ * the last pc->tail records or those since pc->since are wanted.  The
+ * records are in time order, so the latter is a binary search that
+ * reads one timestamp per step instead of all the infos.
+ */
+static unsigned long prb_first_id(struct prb_map *m)
+{
+    unsigned long first = prb_tail_id(m);
+    unsigned long head_id = prb_head_id(m);
+    unsigned long n, half, id;
+    uint64_t ts_nsec;
+
+    n = ((head_id - first) & DESC_ID_MASK) + 1;
+    if (pc->tail && n > pc->tail) {
+        first = (head_id - pc->tail + 1) & DESC_ID_MASK;
+        n = pc->tail;
+    }
+
+    if (!pc->since)
+        return first;
+
+    while (n) {
+        half = n / 2;
+        id = (first + half) & DESC_ID_MASK;
+        if (prb_info_u64(m, id, offsetof(struct printk_info, ts_nsec), &ts_nsec))
+            break;
+
+        if (ts_nsec < pc->since) {
+            first = (id + 1) & DESC_ID_MASK;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+
+    return first;
+}
+
+/*
+ * With a spool, the first record it does not have.  The last one it has
+ * is looked for by its sequence number: if the ring has it, with the
+ * same timestamp, this is the same boot and what follows it is new.  A
+ * ring that is all past it, in sequence numbers and in time, is still
+ * the same boot if the kernel was not moved, and records were
+ * overwritten before they could be spooled.  Anything else is a new
+ * boot and all of it is new.
+ */
+static unsigned long prb_spool_first_id(struct prb_map *m)
+{
+    unsigned long tail_id = prb_tail_id(m);
+    unsigned long first = tail_id, n, half, id;
+    uint64_t last_seq, last_ts, seq, ts_nsec;
+    int moved, same = FALSE;
+
+    if (!spool_last(gc->spool, &last_seq, &last_ts, &moved)) {
+        spool_start(gc->spool, TRUE);
+        return tail_id;
+    }
+
+    n = ((prb_head_id(m) - first) & DESC_ID_MASK) + 1;
+    while (n) {
+        half = n / 2;
+        id = (first + half) & DESC_ID_MASK;
+        if (prb_info_u64(m, id, offsetof(struct printk_info, seq), &seq))
+            break;
+
+        if (seq <= last_seq) {
+            first = (id + 1) & DESC_ID_MASK;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+
+    if (first != tail_id) {
+        id = (first - 1) & DESC_ID_MASK;
+        same = !prb_info_u64(m, id, offsetof(struct printk_info, seq), &seq) &&
+            !prb_info_u64(m, id, offsetof(struct printk_info, ts_nsec), &ts_nsec) &&
+            seq == last_seq && ts_nsec == last_ts;
+    } else if (!moved &&
+            !prb_info_u64(m, first, offsetof(struct printk_info, seq), &seq) &&
+            !prb_info_u64(m, first, offsetof(struct printk_info, ts_nsec), &ts_nsec) &&
+            seq > last_seq && ts_nsec >= last_ts) {
+        same = TRUE;
+        pr_warning("%lu records overwritten before they could be spooled",
+                (ulong)(seq - last_seq - 1));
+    }
+
+    spool_start(gc->spool, !same);
+    return same ? first : tail_id;
+}
+
+/*
+ * Once the ring is in memory, decoding and formatting it is all that
+ * is left, and a big one is split into runs of records decoded on
+ * threads of their own.  Each formats its run into a buffer, and the
+ * buffers go out in the order of the runs, so the output is the same
+ * as that of a single thread.  The first run is decoded by the caller
+ * straight to fp.
+ */
+#define PRB_DECODE_CHUNK        (4096)      /* records per thread at least */
+#define PRB_DECODE_THREADS_MAX  (64)
+
+struct prb_decoder {
+    struct guest_context *ctx;
+    struct prb_map *m;
+    unsigned long from, n;
+    pthread_t thread;
+    int started;
+    char *buf;
+    size_t len;
+    int ret;
+};
+
+static void prb_decode_run(struct prb_map *m, unsigned long from, unsigned long n)
+{
+    for (; n; n--, from = (from + 1) & DESC_ID_MASK)
+        dump_record(m, from);
+}
+
+static void *prb_decode_worker(void *arg)
+{
+    struct prb_decoder *d = arg;
+
+    guest_context_bind(d->ctx);
+
+    if (!(fp = open_memstream(&d->buf, &d->len))) {
+        d->ret = -1;
+        return NULL;
+    }
+
+    prb_decode_run(d->m, d->from, d->n);
+    out_flush();
+    fclose(fp);
+
+    return NULL;
+}
+
+static int prb_decode_threads(unsigned long n)
+{
+    long cpus;
+    int nr = pc->threads;
+
+    if (!nr) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nr = cpus > 0 ? cpus : 1;
+    }
+
+    if ((unsigned long)nr > n / PRB_DECODE_CHUNK)
+        nr = n / PRB_DECODE_CHUNK;
+
+    return nr > PRB_DECODE_THREADS_MAX ? PRB_DECODE_THREADS_MAX : nr;
+}
+
+/* print the n records from from on */
+static void prb_decode(struct prb_map *m, unsigned long from, unsigned long n)
+{
+    struct prb_decoder *d;
+    unsigned long per, left = n;
+    int nr, i;
+
+    /*
+     * The records of a library session go out on the caller's thread,
+     * and those of a spool in order.
+     */
+    nr = gc->record_fn || gc->spool ? 1 : prb_decode_threads(n);
+    if (nr <= 1) {
+        prb_decode_run(m, from, n);
+        return;
+    }
+
+    d = buf_get(gc->bufs, nr * sizeof(*d));
+    memset(d, 0, nr * sizeof(*d));
+    per = (n + nr - 1) / nr;
+
+    for (i = 0; i < nr; i++) {
+        d[i].ctx = gc;
+        d[i].m = m;
+        d[i].from = from;
+        d[i].n = left < per ? left : per;
+        from = (from + d[i].n) & DESC_ID_MASK;
+        left -= d[i].n;
+
+        if (i && !pthread_create(&d[i].thread, NULL, prb_decode_worker, &d[i]))
+            d[i].started = TRUE;
+    }
+
+    prb_decode_run(m, d[0].from, d[0].n);
+    out_flush();
+
+    for (i = 1; i < nr; i++) {
+        if (d[i].started)
+            pthread_join(d[i].thread, NULL);
+
+        /* a run no thread could take is done here */
+        if (!d[i].started || d[i].ret) {
+            prb_decode_run(m, d[i].from, d[i].n);
+            out_flush();
+        } else if (d[i].len) {
+            fwrite(d[i].buf, 1, d[i].len, fp);
+        }
+        free(d[i].buf);
+    }
+
+    if (CRASHDEBUG(1))
+        pr_debug("printk: %lu records decoded on %d threads", n, nr);
+
+    buf_put(gc->bufs, d);
+}
+
+/*
+ * Print the records of the ring.  With follow set the mapping and a
+ * cursor are kept, and the next call only fetches and prints the
+ * records that came in since.  Following stops at the first record a
+ * writer has not finalized yet and picks it up on a later pass.
+ */
+int dump_lockless_record_log(int follow)
+{
+    struct prb_map one_shot = { 0 };
+    struct prb_map *m = &one_shot;
+    unsigned long head_id, tail_id, id, sv_id;
+    enum desc_state state;
+    uint64_t start;
+
+    /* kept in the guest context between the passes of follow mode */
+    if (follow) {
+        if (!gc->prb)
+            gc->prb = arena_calloc(&gc->arena, 1, sizeof(struct prb_map));
+        m = gc->prb;
+    }
 
     if (SIZE(printk_info) == 0) {
         vmcoreinfo_init();
     }
 
-    get_symbol_data("prb", sizeof(char *), &kaddr);
-    m.prb = xmalloc(SIZE(printk_ringbuffer));
+    start = xclock_ns();
+    if (!m->prb) {
+        if (prb_map_init(m))
+            return -1;
+        id = gc->spool ? prb_spool_first_id(m) : prb_first_id(m);
+        if (prb_map_fetch(m, id)) {
+            prb_map_release(m);
+            return -1;
+        }
+    } else {
+        id = gc->prb_next_id;
+        if (prb_map_update(m, id))
+            return -1;
+    }
+    stats_stop(STATS_FETCH, start);
 
-    if (readmem(kaddr, KVADDR, m.prb, SIZE(printk_ringbuffer))) {
-        pr_err("Cannot read printk_ringbuffer contents");
-        goto out_prb;
+    tail_id = prb_tail_id(m);
+    head_id = prb_head_id(m);
+
+    start = xclock_ns();
+    if (!follow) {
+        if (!prb_id_before(head_id, id))
+            prb_decode(m, id, ((head_id - id) & DESC_ID_MASK) + 1);
+
+        out_flush();
+        stats_stop(STATS_DECODE, start);
+        prb_map_release(m);
+        return 0;
     }
 
-    m.desc_ring = m.prb + OFFSET(prb_desc_ring);
-    m.desc_ring_count = 1 << UINT(m.desc_ring + OFFSET(prb_desc_ring_count_bits));
+    if (prb_id_before(id, tail_id)) {
+        pr_warning("%lu records overwritten before they could be read",
+                (tail_id - id) & DESC_ID_MASK);
+        id = tail_id;
+    }
 
-    kaddr = ULONG(m.desc_ring + OFFSET(prb_desc_ring_descs));
-    m.descs = xmalloc(SIZE(prb_desc) * m.desc_ring_count);
+    for (; !prb_id_before(head_id, id); id = (id + 1) & DESC_ID_MASK) {
+        sv_id = DESC_ID(prb_desc_state_var(m, id));
+        state = get_desc_state(id, prb_desc_state_var(m, id));
 
-    if (readmem(kaddr, KVADDR, m.descs, SIZE(prb_desc) * m.desc_ring_count)) {
-        pr_err("Cannot read prb_desc_ring contents");
-        goto out_descs;
+        /* reserved, but the descriptor is not written yet */
+        if (state == desc_miss && prb_id_before(sv_id, id))
+            break;
+
+        if (state == desc_reserved || state == desc_committed)
+            break;
+
+        if (state == desc_finalized)
+            dump_record(m, id);
     }
 
-    kaddr = ULONG(m.desc_ring + OFFSET(prb_desc_ring_infos));
-    m.infos = xmalloc(SIZE(printk_info) * m.desc_ring_count);
+    gc->prb_next_id = id;
+    out_flush();
+    stats_stop(STATS_DECODE, start);
+    return 0;
+}
 
-    if (readmem(kaddr, KVADDR, m.infos, SIZE(printk_info) * m.desc_ring_count)) {
-        pr_err("Cannot read prb_info_ring contents");
-        goto out_infos;
+void dump_lockless_record_log_release()
+{
+    if (gc->prb) {
+        /* the map itself goes with the arena of the context */
+        prb_map_release(gc->prb);
+        gc->prb = NULL;
     }
+}
 
-    m.text_data_ring = m.prb + OFFSET(prb_text_data_ring);
-    m.text_data_ring_size = 1 << UINT(m.text_data_ring + OFFSET(prb_data_ring_size_bits));
+/*
+ * The log_buf of kernels before 5.10: variable length records one after
+ * the other, see struct log.  A record of length 0, or no room left for
+ * one, sends the reader back to the start of the buffer.
+ *
+ * log_buf can be as big as the guest wants, so it is never read as a
+ * whole.  The records are walked through a window of LOG_WINDOW bytes
+ * that moves on with them; a record is at most 64K, so it always fits.
+ * A window that starts before end stops there, so a follow pass only
+ * reads what was logged since the last one.
+ */
+#define LOG_WINDOW          (128 * 1024)
 
-    kaddr = ULONG(m.text_data_ring + OFFSET(prb_data_ring_data));
-    m.text_data = xmalloc(m.text_data_ring_size);
+/*
+ * What log_buf_len can be at most: CONFIG_LOG_BUF_SHIFT goes up to 25,
+ * but log_buf_len= on the command line is only clamped to this by
+ * log_buf_len_update() in the kernel.
+ */
+#define LOG_BUF_LEN_MAX     (1U << 31)
 
-    if (readmem(kaddr, KVADDR, m.text_data, m.text_data_ring_size)) {
-        pr_err("Cannot read prb_text_data_ring contents");
-        goto out_text_data;
+struct log_window {
+    ulong log_buf;
+    uint32_t log_buf_len;
+    char *buf;
+    uint32_t start;                 /* of log_buf in buf */
+    uint32_t len;                   /* 0 when nothing is read */
+    uint32_t end;                   /* log_next_idx, or log_buf_len */
+    int failed;                     /* a read of log_buf failed */
+    uint64_t fetch_ns;              /* of the reads, the rest is decoding */
+};
+
+static int log_window_init(struct log_window *w)
+{
+    uint32_t log_buf_len;
+
+    get_symbol_data("log_buf_len", sizeof(uint32_t), &log_buf_len);
+    get_symbol_data("log_buf", sizeof(char *), &w->log_buf);
+
+    if (!log_buf_len || log_buf_len > LOG_BUF_LEN_MAX) {
+        pr_err("Invalid log_buf_len: %u", log_buf_len);
+        return -1;
     }
 
-    tail_id = ULONG(m.desc_ring + OFFSET(prb_desc_ring_tail_id) +
-            offsetof(atomic_long_t, counter));
-    head_id = ULONG(m.desc_ring + OFFSET(prb_desc_ring_head_id) +
-            offsetof(atomic_long_t, counter));
+    w->log_buf_len = log_buf_len;
+    w->buf = buf_get(gc->bufs, LOG_WINDOW);
+    w->start = w->len = 0;
+    w->end = log_buf_len;
+    w->failed = FALSE;
+    w->fetch_ns = 0;
+    return 0;
+}
+
+/*
+ * size bytes of log_buf at idx, NULL if they are beyond its end or
+ * cannot be read, w->failed tells which.
+ */
+static char *log_window_get(struct log_window *w, uint32_t idx, uint32_t size)
+{
+    uint64_t start, ns;
+    uint32_t n;
+
+    if (idx >= w->start && idx - w->start + size <= w->len)
+        return w->buf + (idx - w->start);
+
+    if (idx >= w->log_buf_len || size > w->log_buf_len - idx)
+        return NULL;
+
+    n = w->log_buf_len - idx;
+    if (idx < w->end && n > w->end - idx)
+        n = w->end - idx > size ? w->end - idx : size;
+    if (n > LOG_WINDOW)
+        n = LOG_WINDOW;
+
+    start = xclock_ns();
+    if (readmem(w->log_buf + idx, KVADDR, w->buf, n)) {
+        w->len = 0;
+        w->failed = TRUE;
+        return NULL;
+    }
+    ns = xclock_ns() - start;
+    stats_phase(STATS_FETCH, ns);
+    w->fetch_ns += ns;
+
+    w->start = idx;
+    w->len = n;
+    return w->buf;
+}
+
+/*
+ * The record at idx, where it really is in *pos, and the index of the
+ * one after it in *next.  NULL at a record that makes no sense, in a
+ * buffer overwritten under us, or when log_buf cannot be read; only a
+ * record read fine that has length 0 is the wrap back to the start.
+ */
+static char *log_window_record(struct log_window *w, uint32_t idx,
+        uint32_t *pos, uint32_t *next)
+{
+    char *logptr;
+    uint16_t msglen;
+
+    logptr = log_window_get(w, idx, sizeof(struct log));
+    if (!logptr && w->failed)
+        return NULL;
+    if (!logptr || !USHORT(logptr + offsetof(struct log, len))) {
+        idx = 0;
+        logptr = log_window_get(w, idx, sizeof(struct log));
+    }
+    if (!logptr)
+        return NULL;
+
+    msglen = USHORT(logptr + offsetof(struct log, len));
+    if (msglen < sizeof(struct log) ||
+            USHORT(logptr + offsetof(struct log, text_len)) > msglen - sizeof(struct log))
+        return NULL;
+
+    if (!(logptr = log_window_get(w, idx, msglen)))
+        return NULL;
+
+    *pos = idx;
+    *next = idx + msglen;
+    return logptr;
+}
+
+/*
+ * Where the last pc->tail records before next_idx start: a pass that
+ * keeps the index of the last pc->tail records it saw.  There are no
+ * more of them than fit in log_buf.
+ */
+static uint32_t log_skip_to_tail(struct log_window *w, uint32_t idx,
+        uint32_t next_idx, uint64_t *seq)
+{
+    ulong n = 0, max = w->log_buf_len / sizeof(struct log);
+    ulong tail = pc->tail < max ? pc->tail : max;
+    uint32_t *last, pos, next;
+
+    last = buf_get(gc->bufs, tail * sizeof(*last));
+
+    while (idx != next_idx && n < max &&
+            log_window_record(w, idx, &pos, &next)) {
+        last[n++ % tail] = idx;
+        idx = next;
+    }
+
+    if (n > tail) {
+        idx = last[n % tail];
+        *seq += n - tail;
+    } else if (n) {
+        idx = last[0];
+    }
+
+    buf_put(gc->bufs, last);
+    return idx;
+}
+
+static void dump_log_entry(char *logptr, uint64_t seq)
+{
+    const struct kvmdmesg_record r = {
+        .seq = seq,
+        .ts_nsec = ULONGLONG(logptr + offsetof(struct log, ts_nsec)),
+        .level = LOG_LEVEL(logptr),
+        .facility = UCHAR(logptr + offsetof(struct log, facility)),
+        .text = logptr + sizeof(struct log),
+        .len = USHORT(logptr + offsetof(struct log, text_len)),
+    };
+
+    if (record_wanted(r.ts_nsec, r.level, r.facility) && text_wanted(r.text, r.len))
+        out_record(&r);
+}
+
+/*
+ * With a spool, where in log_buf to start, as prb_spool_first_id() does
+ * for the ring: walked from the first record to the last one the spool
+ * has, which is the same boot if the timestamps match, and what follows
+ * it is new.  A log_buf that is all past it is the same boot if the
+ * kernel was not moved and its first record is not older.  Anything
+ * else is a new boot, started from the first record.
+ */
+static void log_spool_first(struct log_window *w, uint32_t *idx, uint64_t *seq,
+        uint32_t next_idx)
+{
+    ulong max = w->log_buf_len / sizeof(struct log);
+    uint64_t last_seq, last_ts, s;
+    uint32_t i, pos, next;
+    int moved, same = FALSE;
+    char *logptr;
+
+    if (!spool_last(gc->spool, &last_seq, &last_ts, &moved) || moved) {
+        spool_start(gc->spool, TRUE);
+        return;
+    }
+
+    if (*seq <= last_seq) {
+        for (i = *idx, s = *seq; i != next_idx && max--; i = next, s++) {
+            if (!(logptr = log_window_record(w, i, &pos, &next)))
+                break;
+            if (s < last_seq)
+                continue;
+
+            same = ULONGLONG(logptr + offsetof(struct log, ts_nsec)) == last_ts;
+            if (same) {
+                *idx = next;
+                *seq = s + 1;
+            }
+            break;
+        }
+    } else if ((logptr = log_window_record(w, *idx, &pos, &next)) &&
+            ULONGLONG(logptr + offsetof(struct log, ts_nsec)) >= last_ts) {
+        same = TRUE;
+        pr_warning("%lu records overwritten before they could be spooled",
+                (ulong)(*seq - last_seq - 1));
+    }
+
+    spool_start(gc->spool, !same);
+}
+
+/*
+ * With follow set, the index and sequence number of the next record are
+ * kept in the guest context, and later calls start from there.
+ */
+int dump_variable_length_record_log(int follow)
+{
+    struct log_window w;
+    uint32_t idx, pos, next, log_first_idx, log_next_idx;
+    uint64_t seq = 0, log_first_seq = 0, start = xclock_ns();
+    ulong max;
+    char *logptr;
+    int ret = 0;
+
+    if (log_window_init(&w))
+        return -1;
+
+    get_symbol_data("log_next_idx", sizeof(uint32_t), &log_next_idx);
+    get_symbol_data("log_first_idx", sizeof(uint32_t), &log_first_idx);
+    if (kernel_symbol_exists("log_first_seq"))
+        get_symbol_data("log_first_seq", sizeof(uint64_t), &log_first_seq);
+    w.end = log_next_idx;
+
+    if (gc->log_started && gc->log_seq < log_first_seq) {
+        /* the guest wrapped log_buf past where the last pass stopped */
+        pr_warning("%lu records overwritten before they could be read",
+                (ulong)(log_first_seq - gc->log_seq));
+        idx = log_first_idx;
+        seq = log_first_seq;
+    } else if (gc->log_started) {
+        idx = gc->log_idx;
+        seq = gc->log_seq;
+    } else {
+        seq = log_first_seq;
+
+        if (CRASHDEBUG(1)) {
+            pr_debug("log_buf: %lx", w.log_buf);
+            pr_debug("log_buf_len: %u", w.log_buf_len);
+            pr_debug("log_first_idx: %u", log_first_idx);
+            pr_debug("log_next_idx: %u", log_next_idx);
+        }
+
+        idx = log_first_idx;
+        if (pc->tail)
+            idx = log_skip_to_tail(&w, idx, log_next_idx, &seq);
+        if (w.failed)
+            goto out;
+
+        if (gc->spool)
+            log_spool_first(&w, &idx, &seq, log_next_idx);
+        if (w.failed)
+            goto out;
+    }
+
+    /* a buffer overwritten under us must not send us round in circles */
+    max = w.log_buf_len / sizeof(struct log);
+    while (idx != log_next_idx && max--) {
+        if (!(logptr = log_window_record(&w, idx, &pos, &next)))
+            break;
+
+        dump_log_entry(logptr, seq);
+        idx = next;
+        seq++;
+    }
+
+    out_flush();
+
+    /* a pass that failed to read on goes on from there the next time */
+    if (follow) {
+        gc->log_started = TRUE;
+        gc->log_idx = idx;
+        gc->log_seq = seq;
+    }
+
+out:
+    if (w.failed) {
+        pr_err("Cannot read log_buf contents");
+        ret = -1;
+    }
 
-    for (id = tail_id; id != head_id; id = (id + 1) & DESC_ID_MASK) {
-        dump_record(&m, id);
+    buf_put(gc->bufs, w.buf);
+    stats_phase(STATS_DECODE, xclock_ns() - start - w.fetch_ns);
+    return ret;
+}
+
+/*
+ * For the output formats made of records, each line of a plain log_buf
+ * is one, numbered in order.  A "<N>" in front is its level, a line
+ * without one has the kernel's default level.
+ */
+#define PLAIN_LINE_MAX          (1024)
+#define PLAIN_LEVEL_DEFAULT     (4)
+
+struct plain_line {
+    char text[PLAIN_LINE_MAX];
+    size_t len;
+    uint64_t seq;
+};
+
+static void plain_line_end(struct plain_line *l)
+{
+    struct kvmdmesg_record r = {
+        .seq = l->seq++,
+        .level = PLAIN_LEVEL_DEFAULT,
+        .text = l->text,
+        .len = l->len,
+    };
+
+    if (!l->len)
+        return;
+
+    if (r.len >= 3 && r.text[0] == '<' && r.text[1] >= '0' && r.text[1] <= '7' &&
+            r.text[2] == '>') {
+        r.level = r.text[1] - '0';
+        r.text += 3;
+        r.len -= 3;
+    }
+
+    out_record(&r);
+    l->len = 0;
+}
+
+static void plain_line_add(struct plain_line *l, const char *buf, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        if (!buf[i] || buf[i] == '\n') {
+            plain_line_end(l);
+        } else if ((unsigned char)buf[i] <= 0x7f) {
+            if (l->len == PLAIN_LINE_MAX)
+                plain_line_end(l);
+            l->text[l->len++] = buf[i];
+        }
+    }
+}
+
+/*
+ * The log_buf of kernels before 3.5 is plain text, printed as it is in
+ * the buffer, a window at a time.
+ */
+int dump_plain_log_buf(void)
+{
+    struct plain_line *line = NULL;
+    struct log_window w;
+    uint32_t idx, n, i;
+    int next_line = FALSE;
+    uint64_t start = xclock_ns();
+    char *buf;
+
+    if (log_window_init(&w))
+        return -1;
+
+    if (CRASHDEBUG(1)) {
+        pr_debug("log_buf len: %u (0x%x)", w.log_buf_len, w.log_buf_len);
+        pr_debug("log_buf addr: 0x%lx", w.log_buf);
+    }
+
+    if (pc->output != OUTPUT_TEXT) {
+        line = buf_get(gc->bufs, sizeof(*line));
+        line->len = line->seq = 0;
     }
 
-    dump_record(&m, id);
+    for (idx = 0; idx < w.log_buf_len; idx += n) {
+        n = w.log_buf_len - idx < LOG_WINDOW ? w.log_buf_len - idx : LOG_WINDOW;
+        if (!(buf = log_window_get(&w, idx, n)))
+            break;
+
+        if (line) {
+            plain_line_add(line, buf, n);
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (buf[i]) {
+                if ((unsigned char)buf[i] <= 0x7f) {
+                    next_line = TRUE;
+                    fputc(buf[i], fp);
+                }
+            } else {
+                if (next_line)
+                    fputc('\n', fp);
+                next_line = FALSE;
+            }
+        }
+    }
+
+    if (line) {
+        plain_line_end(line);
+        out_flush();
+        buf_put(gc->bufs, line);
+    } else {
+        fprintf(fp, "\n");
+    }
+
+    buf_put(gc->bufs, w.buf);
+    stats_phase(STATS_DECODE, xclock_ns() - start - w.fetch_ns);
+
+    if (w.failed) {
+        pr_err("Cannot read log_buf contents");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The records of the spool of guest, filtered like those of a ring.
+ * Time is since the boot of each, so in text, where a boot starts is
+ * marked.
+ */
+static void dump_spool_record(const struct kvmdmesg_record *r, uint32_t boot, void *arg)
+{
+    uint32_t *last_boot = arg;
+
+    if (!record_wanted(r->ts_nsec, r->level, r->facility) || !text_wanted(r->text, r->len))
+        return;
+
+    if (pc->output == OUTPUT_TEXT && *last_boot && boot != *last_boot) {
+        out_flush();
+        fprintf(fp, "-- boot %u --\n", boot);
+    }
+    *last_boot = boot;
+
+    out_record(r);
+}
+
+int dump_spool_log(const char *guest)
+{
+    struct spool *sp;
+    uint32_t boot = 0;
+    uint64_t start = xclock_ns();
+    int ret;
+
+    if (!(sp = spool_open(pc->spool, guest, FALSE)))
+        return -1;
+
+    ret = spool_query(sp, pc->since, pc->until, pc->tail, dump_spool_record, &boot);
+    out_flush();
+    spool_close(sp);
 
-out_text_data:
-    xfree(m.text_data);
-out_infos:
-    xfree(m.infos);
-out_descs:
-    xfree(m.descs);
-out_prb:
-    xfree(m.prb);
+    stats_stop(STATS_DECODE, start);
+    return ret;
 }
@@ -80,18 +80,37 @@ struct printk_ringbuffer {
 };
 
 struct prb_map {
+    unsigned long copied;           /* PRB_COPIED_* of the buffers we own */
+
     char *prb;
+    unsigned long prb_kaddr;
 
     char *desc_ring;
     unsigned long desc_ring_count;
     char *descs;
     char *infos;
+    unsigned long descs_kaddr;
+    unsigned long infos_kaddr;
 
     char *text_data_ring;
     unsigned long text_data_ring_size;
     char *text_data;
+    unsigned long text_data_kaddr;
+
+    /* what the guest has after a copy, to tell torn records, see printk.c */
+    char *prb_check;
+    char *descs_check;
 };
 
-void dump_lockless_record_log();
+#define PRB_COPIED_PRB        (0x1)
+#define PRB_COPIED_DESCS      (0x2)
+#define PRB_COPIED_INFOS      (0x4)
+#define PRB_COPIED_TEXT_DATA  (0x8)
+
+int dump_lockless_record_log(int follow);
+void dump_lockless_record_log_release();
+int dump_variable_length_record_log(int follow);
+int dump_plain_log_buf(void);
+int dump_spool_log(const char *guest);
 
 #endif
@@ -0,0 +1,318 @@
+/* process_client.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "xutil.h"
+#include "defs.h"
+#include "log.h"
+
+/*
+ * Guest RAM is read straight out of the QEMU process with
+ * process_vm_readv().  The monitor is only used once, to learn where
+ * each guest RAM range lives in QEMU's address space: "info mtree -f"
+ * gives the guest physical ranges backed by RAM and "gpa2hva" the host
+ * virtual address of each of them.
+ */
+
+#define MAX_RAM_REGIONS  (32)
+#define MTREE_BUF_SIZE   (256 * 1024)
+
+struct ram_region {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t hva;
+};
+
+struct process_conn {
+    struct qmp_conn *qmp;
+    pid_t qemu_pid;
+    struct ram_region ram_regions[MAX_RAM_REGIONS];
+    int nr_ram_regions;
+};
+
+/*
+ * the flat view of the "memory" address space looks like
+ *
+ * FlatView #0
+ *  AS "memory", root: system
+ *  Root memory region: system
+ *   0000000000000000-000000000009ffff (prio 0, ram): pc.ram kvm
+ *   00000000000a0000-00000000000bffff (prio 1, i/o): vga-lowmem
+ *   0000000000100000-000000007fffffff (prio 0, ram): pc.ram @0000000000100000 kvm
+ */
+static int process_parse_mtree(struct process_conn *p, char *mtree)
+{
+    char *line, *saveptr = NULL;
+    int in_memory_as = FALSE;
+    uint64_t start, end;
+    int prio;
+    char type[16];
+
+    for (line = strtok_r(mtree, "\r\n", &saveptr); line;
+            line = strtok_r(NULL, "\r\n", &saveptr)) {
+
+        if (strncmp(line, "FlatView", strlen("FlatView")) == 0) {
+            if (in_memory_as)
+                break;
+            continue;
+        }
+
+        if (strstr(line, "AS \"memory\"")) {
+            in_memory_as = TRUE;
+            continue;
+        }
+
+        if (!in_memory_as)
+            continue;
+
+        if (sscanf(line, " %" SCNx64 "-%" SCNx64 " (prio %d, %15[^)])",
+                    &start, &end, &prio, type) != 4)
+            continue;
+
+        if (!STREQ(type, "ram"))
+            continue;
+
+        if (p->nr_ram_regions == MAX_RAM_REGIONS) {
+            pr_warning("Too many guest RAM regions, ignoring the rest");
+            break;
+        }
+
+        p->ram_regions[p->nr_ram_regions].gpa = start;
+        p->ram_regions[p->nr_ram_regions].size = end - start + 1;
+        p->nr_ram_regions++;
+    }
+
+    return p->nr_ram_regions ? 0 : -1;
+}
+
+/* "Host virtual address for 0x0 (pc.ram) is 0x7f3a2c000000" */
+static int process_gpa2hva(struct process_conn *p, uint64_t gpa, uint64_t *hva)
+{
+    char cmd[64];
+    char out[512];
+    char *s;
+
+    snprintf(cmd, sizeof(cmd), "gpa2hva 0x%" PRIx64, gpa);
+    if (qmp_hmp(p->qmp, cmd, out, sizeof(out)) == -1) {
+        return -1;
+    }
+
+    s = strstr(out, " is ");
+    if (!s || sscanf(s + strlen(" is "), "%" SCNx64, hva) != 1) {
+        pr_debug("gpa2hva: %s", out);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The mtree lines are the pieces of the flat view, a RAM block split by
+ * holes shows up as several of them.  Each one is looked up on its own,
+ * so a piece only has to be contiguous in QEMU's address space.
+ */
+static int process_map_regions(struct process_conn *p)
+{
+    char *mtree;
+    int i, r = -1;
+
+    mtree = xmalloc(MTREE_BUF_SIZE);
+    if (qmp_hmp(p->qmp, "info mtree -f", mtree, MTREE_BUF_SIZE) == -1) {
+        goto out;
+    }
+
+    if (process_parse_mtree(p, mtree) == -1) {
+        pr_debug("no guest RAM found in info mtree");
+        goto out;
+    }
+
+    for (i = 0; i < p->nr_ram_regions; i++) {
+        if (process_gpa2hva(p, p->ram_regions[i].gpa, &p->ram_regions[i].hva) == -1) {
+            goto out;
+        }
+
+        if (CRASHDEBUG(1)) {
+            pr_debug("guest ram: %016" PRIx64 "-%016" PRIx64 " at hva %" PRIx64,
+                    p->ram_regions[i].gpa,
+                    p->ram_regions[i].gpa + p->ram_regions[i].size - 1,
+                    p->ram_regions[i].hva);
+        }
+    }
+    r = 0;
+
+out:
+    xfree(mtree);
+    return r;
+}
+
+static struct ram_region *process_find_region(struct process_conn *p, uint64_t gpa)
+{
+    int i;
+
+    for (i = 0; i < p->nr_ram_regions; i++) {
+        if (gpa >= p->ram_regions[i].gpa &&
+                gpa - p->ram_regions[i].gpa < p->ram_regions[i].size)
+            return &p->ram_regions[i];
+    }
+
+    return NULL;
+}
+
+int process_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size)
+{
+    struct process_conn *p = c->priv;
+    struct iovec local[MAX_RAM_REGIONS];
+    struct iovec remote[MAX_RAM_REGIONS];
+    struct ram_region *r;
+    uint64_t off, len;
+    size_t done = 0, total = 0;
+    ssize_t n;
+    int cnt = 0, i;
+
+    /* one segment per RAM region the range runs across */
+    while (total < size) {
+        if (!(r = process_find_region(p, addr + total)) || cnt == MAX_RAM_REGIONS) {
+            pr_err("Guest physical address 0x%" PRIx64 " is not in RAM",
+                    addr + total);
+            return -1;
+        }
+
+        off = addr + total - r->gpa;
+        len = r->size - off;
+        if (len > size - total)
+            len = size - total;
+
+        local[cnt].iov_base = (char *)buffer + total;
+        local[cnt].iov_len = len;
+        remote[cnt].iov_base = (void *)(uintptr_t)(r->hva + off);
+        remote[cnt].iov_len = len;
+        cnt++;
+        total += len;
+    }
+
+    /* the kernel may stop short, carry on from where it left off */
+    i = 0;
+    while (done < size) {
+        n = process_vm_readv(p->qemu_pid, &local[i], cnt - i, &remote[i], cnt - i, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            pr_err("process_vm_readv: %s", strerror(errno));
+            return -1;
+        }
+
+        done += n;
+        stats_add(&gc->stats.bytes_received, n);
+        while (i < cnt && (size_t)n >= local[i].iov_len) {
+            n -= local[i].iov_len;
+            i++;
+        }
+        if (n > 0) {
+            local[i].iov_base = (char *)local[i].iov_base + n;
+            local[i].iov_len -= n;
+            remote[i].iov_base = (char *)remote[i].iov_base + n;
+            remote[i].iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Are we allowed to look into QEMU at all?  Access is checked before
+ * anything is copied, so reading the unmapped page 0 fails with EFAULT
+ * if we are, and EPERM if not; no monitor command is needed to find
+ * out, nor any guest RAM read.
+ */
+static int process_may_read(pid_t pid)
+{
+    struct iovec local, remote;
+    uint8_t probe;
+
+    local.iov_base = &probe;
+    local.iov_len = sizeof(probe);
+    remote.iov_base = NULL;
+    remote.iov_len = sizeof(probe);
+
+    if (process_vm_readv(pid, &local, 1, &remote, 1, 0) < 0 && errno != EFAULT) {
+        pr_debug("cannot read QEMU process %d: %s", pid, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+int process_client_init(guest_client_t *c, char *sock_path)
+{
+    struct process_conn *p;
+
+    p = xcalloc(1, sizeof(*p));
+    p->qemu_pid = -1;
+    c->priv = p;
+
+    if (!(p->qmp = qmp_open(sock_path))) {
+        goto err_exit;
+    }
+
+    if ((p->qemu_pid = qmp_peer_pid(p->qmp)) <= 0) {
+        pr_debug("cannot get the pid of the QEMU process");
+        goto err_exit;
+    }
+
+    /* before the monitor is asked where the RAM is */
+    if (!process_may_read(p->qemu_pid)) {
+        goto err_exit;
+    }
+
+    if (process_map_regions(p) == -1) {
+        goto err_exit;
+    }
+
+    pr_info("Reading guest memory from QEMU process %d", p->qemu_pid);
+    return 0;
+
+err_exit:
+    process_client_uninit(c);
+    return -1;
+}
+
+int process_client_uninit(guest_client_t *c)
+{
+    struct process_conn *p = c->priv;
+
+    if (p) {
+        qmp_close(p->qmp);
+        xfree(p);
+    }
+    c->priv = NULL;
+    return 0;
+}
+
+int process_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
+{
+    struct process_conn *p = c->priv;
+
+    return qmp_registers(p->qmp, idtr, cr3, cr4);
+}
@@ -1,4 +1,4 @@
-/* qmp_client.h
+/* qmp_client.c
  *
  * Copyright (C) 2024 Ray Lee
  *
@@ -13,6 +13,8 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,53 +25,291 @@
 #include <sys/un.h>
 #include <poll.h>
 #include <stdint.h>
+#include <fcntl.h>
 
 #include "xutil.h"
+#include "defs.h"
 #include "log.h"
-
-static int qmp_fd;
+#include "chunk.h"
 
 #define QMP_GREETING            "{\"QMP\":"
 #define QMP_ENTER_COMMAND_MODE  "{ \"execute\": \"qmp_capabilities\" }"
-#define QMP_COMMAND_MODE_OK     "{\"return\": {}}\r\n"
 
 #define QMP_COMMAND_INFO_REGS   "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"info registers\"}}"
-#define QMP_COMMAND_XP          "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"xp /%" PRIu64 "xb 0x%zx\"}}"
+#define QMP_COMMAND_HMP         "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"%s\"}}"
+#define QMP_COMMAND_XP          "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"xp /%zuxb 0x%" PRIx64 "\"}, \"id\": %u}"
+#define QMP_COMMAND_ADD_FD      "{\"execute\": \"add-fd\"}"
+#define QMP_COMMAND_REMOVE_FD   "{\"execute\": \"remove-fd\", \"arguments\": {\"fdset-id\": %d}}"
+#define QMP_COMMAND_PMEMSAVE    "{\"execute\": \"pmemsave\", \"arguments\": {\"val\": %" PRIu64 ", \"size\": %zu, \"filename\": \"%s\"}}"
+
+#define QMP_RETURN              "\"return\""
 
-static int qmp_read(int fd, void *buf, size_t *len)
+/* how long to wait for the first byte of a reply, in ms */
+#define QMP_REPLY_TIMEOUT       (10000)
+
+/*
+ * xp reads are chunks of XP_CHUNK_MIN up to XP_CHUNK_MAX bytes, sized by
+ * how the monitor performs, and up to XP_PIPELINE_DEPTH of them are in
+ * flight, matched to their replies by "id".  A 4K chunk comes back as
+ * roughly 30K of monitor text, so a full one stays below half a MB.
+ */
+#define XP_CHUNK_MIN            (4096)
+#define XP_CHUNK_MAX            (64 * 1024)
+#define XP_PIPELINE_DEPTH       (16)
+
+/*
+ * One monitor connection.
+ *
+ * Everything QEMU sends is read into rbuf, which grows as needed.  A
+ * message is complete once the braces of its outermost JSON object
+ * balance; braces inside strings do not count.  Whatever follows it
+ * belongs to the next message and stays in the buffer.  The message
+ * handed out is NUL terminated in place and stays valid until the next
+ * read.
+ *
+ * Bulk transfer state: QEMU dumps guest memory with pmemsave into a
+ * scratch file on tmpfs, which we then read back as raw bytes.  The
+ * write side is preferably handed to QEMU with add-fd over the socket,
+ * so it works even when QEMU can not open our path.
+ */
+struct qmp_conn {
+    int fd;
+
+    char *rbuf;
+    size_t rbuf_size;           /* allocated */
+    size_t rbuf_len;            /* filled */
+    size_t msg_len;             /* message handed out last */
+    char msg_saved;             /* byte overwritten by its NUL */
+
+    /* framing state, kept across reads so no byte is scanned twice */
+    size_t scan_pos;
+    int scan_depth;
+    int scan_in_str;
+    int scan_esc;
+
+    int bulk;
+    int bulk_rfd;
+    int bulk_wfd;
+    int bulk_fdset;
+    char bulk_path[64];
+
+    unsigned int xp_next_id;
+    uint64_t xp_last_reply;     /* when the last xp reply came in */
+    struct chunk_tune xp_tune;
+};
+
+static void qmp_reset_reader(struct qmp_conn *q)
+{
+    q->rbuf_len = q->msg_len = q->scan_pos = 0;
+    q->scan_depth = 0;
+    q->scan_in_str = q->scan_esc = FALSE;
+}
+
+static int qmp_fill(struct qmp_conn *q)
 {
     struct pollfd pfd;
-    size_t tread = 0, nread;
+    ssize_t n;
     int r;
 
-    pfd.fd = fd;
+    if (q->rbuf_size - q->rbuf_len < 4096) {
+        q->rbuf_size = q->rbuf_size ? q->rbuf_size * 2 : 65536;
+        q->rbuf = xrealloc(q->rbuf, q->rbuf_size + 1);
+    }
+
+    pfd.fd = q->fd;
     pfd.events = POLLIN;
 
-    while ((r = poll(&pfd, 1, 5)) != 0) {
+    for (;;) {
+        n = read(q->fd, q->rbuf + q->rbuf_len, q->rbuf_size - q->rbuf_len);
+        if (n > 0) {
+            q->rbuf_len += n;
+            stats_add(&gc->stats.bytes_received, n);
+            return 0;
+        }
+
+        if (n == 0) {
+            pr_err("QEMU closed the monitor connection");
+            return -1;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+
+        r = poll(&pfd, 1, QMP_REPLY_TIMEOUT);
+        if (r == 0) {
+            pr_err("Timed out waiting for the monitor");
+            return -1;
+        }
+
+        if (r == -1 && errno != EINTR)
+            return -1;
+    }
+}
+
+static int qmp_read_msg(struct qmp_conn *q, char **msg, size_t *len)
+{
+    size_t start;
+    char ch;
+
+    /* drop the previous message */
+    if (q->msg_len) {
+        q->rbuf[q->msg_len] = q->msg_saved;
+        memmove(q->rbuf, q->rbuf + q->msg_len, q->rbuf_len - q->msg_len);
+        q->rbuf_len -= q->msg_len;
+        q->scan_pos -= q->msg_len;
+        q->msg_len = 0;
+    }
+
+    for (;;) {
+        while (q->scan_pos < q->rbuf_len) {
+            ch = q->rbuf[q->scan_pos++];
+
+            if (q->scan_in_str) {
+                if (q->scan_esc)
+                    q->scan_esc = FALSE;
+                else if (ch == '\\')
+                    q->scan_esc = TRUE;
+                else if (ch == '"')
+                    q->scan_in_str = FALSE;
+            } else if (ch == '"') {
+                q->scan_in_str = TRUE;
+            } else if (ch == '{') {
+                q->scan_depth++;
+            } else if (ch == '}' && q->scan_depth > 0 && --q->scan_depth == 0) {
+                goto found;
+            }
+        }
 
-        if (r == -1)
+        if (qmp_fill(q) == -1)
             return -1;
+    }
+
+found:
+    /* skip the \r\n left over from the message before */
+    for (start = 0; start < q->scan_pos && q->rbuf[start] != '{'; start++)
+        ;
+
+    q->msg_len = q->scan_pos;
+    q->msg_saved = q->rbuf[q->msg_len];
+    q->rbuf[q->msg_len] = '\0';
+
+    *msg = q->rbuf + start;
+    *len = q->msg_len - start;
+    return 0;
+}
+
+/*
+ * Whether a message is an asynchronous event, told by its top-level
+ * keys: a reply has "return" or "error", an event has "event".  QEMU
+ * puts "timestamp" before "event", and the monitor output in the
+ * "return" of a reply can have any text in it, so neither the first key
+ * nor a search of the whole message will do.  The keys are looked at in
+ * order, and a reply is done with at its first one.
+ */
+static int qmp_is_event(const char *msg)
+{
+    int depth = 0, in_str = FALSE, esc = FALSE;
+    const char *p, *str = NULL;
+    size_t n;
+
+    for (p = msg; *p; p++) {
+        if (in_str) {
+            if (esc) {
+                esc = FALSE;
+            } else if (*p == '\\') {
+                esc = TRUE;
+            } else if (*p == '"') {
+                in_str = FALSE;
+                if (depth != 1 || p[1 + strspn(p + 1, " ")] != ':')
+                    continue;
+
+                n = p - str;
+                if (n == strlen("event") && !strncmp(str, "event", n))
+                    return TRUE;
+                if ((n == strlen("return") && !strncmp(str, "return", n)) ||
+                        (n == strlen("error") && !strncmp(str, "error", n)))
+                    return FALSE;
+            }
+        } else if (*p == '"') {
+            in_str = TRUE;
+            str = p + 1;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            depth--;
+        }
+    }
+
+    return FALSE;
+}
+
+/* next reply to a command, asynchronous events are skipped */
+static int qmp_read_reply(struct qmp_conn *q, char **reply, size_t *len)
+{
+    for (;;) {
+        if (qmp_read_msg(q, reply, len) == -1)
+            return -1;
+
+        if (!qmp_is_event(*reply))
+            return 0;
+
+        pr_debug("qmp event: %s", *reply);
+    }
+}
+
+static int qmp_write(struct qmp_conn *q, const char *buf, size_t len)
+{
+    struct pollfd pfd;
+    ssize_t n;
+
+    pfd.fd = q->fd;
+    pfd.events = POLLOUT;
+
+    /* every write is a command */
+    stats_add(&gc->stats.round_trips, 1);
+
+    while (len) {
+        /* a monitor that went away must not kill the whole sweep */
+        n = send(q->fd, buf, len, MSG_NOSIGNAL);
+        if (n > 0) {
+            buf += n;
+            len -= n;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
 
-        if (pfd.revents & POLLIN) {
-            /* read at max 1k at a time */
-            nread = xread(fd, buf, 1024);
-            tread += nread;
-            buf += nread;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (poll(&pfd, 1, QMP_REPLY_TIMEOUT) <= 0)
+                return -1;
+            continue;
         }
+
+        return -1;
     }
 
-    *len = tread;
     return 0;
 }
 
-static int qmp_establish_conn(char *sock_path)
+static int qmp_command(struct qmp_conn *q, const char *cmd, char **reply, size_t *len)
+{
+    if (qmp_write(q, cmd, strlen(cmd)) == -1)
+        return -1;
+
+    return qmp_read_reply(q, reply, len);
+}
+
+static int qmp_establish_conn(struct qmp_conn *q, char *sock_path)
 {
     int s;
     struct sockaddr_un saddr;
     size_t path_len;
-    size_t nread;
-
-    char buf[512];
+    size_t len;
+    char *greeting;
 
     path_len = strlen(sock_path);
     if (path_len == 0) {
@@ -86,90 +326,283 @@ static int qmp_establish_conn(char *sock_path)
     memcpy(saddr.sun_path, sock_path, path_len);
     saddr.sun_path[path_len] = '\0';
 
-    qmp_fd = s;
+    q->fd = s;
 
     /* connect */
-    if (connect(qmp_fd, (struct sockaddr *) &saddr,
+    if (connect(q->fd, (struct sockaddr *) &saddr,
                 sizeof(struct sockaddr_un)) == -1) {
         pr_err("Failed to connect to '%s' ('%s')", sock_path, strerror(errno));
-        close(qmp_fd);
+        return -1;
+    }
+
+    xsetnonblock(q->fd);
+    qmp_reset_reader(q);
 
+    if (qmp_read_msg(q, &greeting, &len) == -1 ||
+            strncasecmp(greeting, QMP_GREETING, strlen(QMP_GREETING))) {
+        pr_err("Failed to get QMP greeting message");
         return -1;
     }
 
-    xsetnonblock(qmp_fd);
+    return 0;
+}
 
-    memset(buf, 0, sizeof(buf));
+static int qmp_negotiate(struct qmp_conn *q)
+{
+    size_t len;
+    char *reply;
 
-    if (qmp_read(qmp_fd, buf, &nread) == -1) {
+    if (qmp_command(q, QMP_ENTER_COMMAND_MODE, &reply, &len) == -1) {
+        goto err_exit;
+    }
+
+    if (!strstr(reply, QMP_RETURN)) {
+        goto err_exit;
+    }
+
+    return 0;
+
+err_exit:
+    pr_err("Failed to enter in command mode");
+    return -1;
+}
+
+/*
+ * Pass fd to QEMU as a new fdset, the reply looks like
+ *
+ * {"return": {"fdset-id": 1, "fd": 23}}
+ */
+static int qmp_add_fd(struct qmp_conn *q, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    char *reply, *p;
+    size_t len;
+    int fdset;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+
+    iov.iov_base = QMP_COMMAND_ADD_FD;
+    iov.iov_len = strlen(QMP_COMMAND_ADD_FD);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    stats_add(&gc->stats.round_trips, 1);
+    if (sendmsg(q->fd, &msg, MSG_NOSIGNAL) != (ssize_t)iov.iov_len) {
         return -1;
     }
 
-    if (nread == 0 && strncasecmp(buf, QMP_GREETING, strlen(QMP_GREETING))) {
-        pr_err("Failed to get QMP greeting message");
+    if (qmp_read_reply(q, &reply, &len) == -1) {
+        return -1;
+    }
+
+    p = strstr(reply, "\"fdset-id\":");
+    if (!p || sscanf(p + strlen("\"fdset-id\":"), "%d", &fdset) != 1) {
+        return -1;
+    }
+
+    return fdset;
+}
+
+static int qmp_pmemsave(struct qmp_conn *q, uint64_t addr, size_t size)
+{
+    char cmd[256] = {0};
+    char fdset_path[32];
+    const char *filename = q->bulk_path;
+    char *reply;
+    size_t len;
+
+    if (q->bulk_fdset >= 0) {
+        /* QEMU writes through a dup of q->bulk_wfd, sharing its offset */
+        if (lseek(q->bulk_wfd, 0, SEEK_SET) == -1) {
+            return -1;
+        }
+        snprintf(fdset_path, sizeof(fdset_path), "/dev/fdset/%d", q->bulk_fdset);
+        filename = fdset_path;
+    }
+
+    snprintf(cmd, sizeof(cmd), QMP_COMMAND_PMEMSAVE, addr, size, filename);
+
+    if (qmp_command(q, cmd, &reply, &len) == -1) {
+        return -1;
+    }
+
+    if (!strstr(reply, QMP_RETURN)) {
+        pr_debug("pmemsave failed: %s", reply);
         return -1;
     }
 
     return 0;
 }
 
-static int qmp_negotiate()
+static int qmp_bulk_readmem(struct qmp_conn *q, uint64_t addr, void *buffer, size_t size)
 {
-    size_t cmd_len, nwrite, nread;
-    char buf[512];
+    ssize_t r;
+    size_t done = 0;
 
+    if (qmp_pmemsave(q, addr, size) == -1) {
+        return -1;
+    }
 
-    cmd_len = strlen(QMP_ENTER_COMMAND_MODE);
-    nwrite = xwrite(qmp_fd, QMP_ENTER_COMMAND_MODE, cmd_len);
-    if (nwrite == 0) {
-        goto err_exit;
+    while (done < size) {
+        r = pread(q->bulk_rfd, (char *)buffer + done, size - done, done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        done += r;
+        stats_add(&gc->stats.bytes_received, r);
     }
 
-    memset(buf, 0, sizeof(buf));
-    if (qmp_read(qmp_fd, buf, &nread) == -1) {
-        goto err_exit;
+    return 0;
+}
+
+static void qmp_remove_fd(struct qmp_conn *q, int fdset)
+{
+    char cmd[128];
+    char *reply;
+    size_t len;
+
+    snprintf(cmd, sizeof(cmd), QMP_COMMAND_REMOVE_FD, fdset);
+    qmp_command(q, cmd, &reply, &len);
+}
+
+static void qmp_bulk_uninit(struct qmp_conn *q)
+{
+    if (q->bulk_fdset >= 0) {
+        qmp_remove_fd(q, q->bulk_fdset);
+        q->bulk_fdset = -1;
+    }
+
+    if (q->bulk_wfd >= 0) {
+        close(q->bulk_wfd);
+        q->bulk_wfd = -1;
     }
 
-    if (strncasecmp(buf, QMP_COMMAND_MODE_OK, nread)) {
+    if (q->bulk_rfd >= 0) {
+        close(q->bulk_rfd);
+        q->bulk_rfd = -1;
+    }
+
+    if (q->bulk_path[0]) {
+        unlink(q->bulk_path);
+        q->bulk_path[0] = '\0';
+    }
+
+    q->bulk = FALSE;
+}
+
+static int qmp_bulk_init(struct qmp_conn *q)
+{
+    char proc_path[64];
+    uint8_t probe;
+
+    snprintf(q->bulk_path, sizeof(q->bulk_path), "/dev/shm/kvm-dmesg.XXXXXX");
+    if ((q->bulk_rfd = mkstemp(q->bulk_path)) == -1) {
+        snprintf(q->bulk_path, sizeof(q->bulk_path), "/tmp/kvm-dmesg.XXXXXX");
+        if ((q->bulk_rfd = mkstemp(q->bulk_path)) == -1) {
+            q->bulk_path[0] = '\0';
+            return -1;
+        }
+    }
+
+    /* a write-only twin of the scratch file, for add-fd */
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", q->bulk_rfd);
+    q->bulk_wfd = open(proc_path, O_WRONLY);
+    if (q->bulk_wfd >= 0) {
+        q->bulk_fdset = qmp_add_fd(q, q->bulk_wfd);
+    }
+
+    /* make sure QEMU can actually write the file */
+    if (q->bulk_fdset >= 0 && qmp_bulk_readmem(q, 0, &probe, sizeof(probe)) == -1) {
+        pr_debug("pmemsave via fdset failed, trying %s", q->bulk_path);
+        qmp_remove_fd(q, q->bulk_fdset);
+        q->bulk_fdset = -1;
+    }
+
+    if (q->bulk_fdset < 0 && qmp_bulk_readmem(q, 0, &probe, sizeof(probe)) == -1) {
         goto err_exit;
     }
 
+    q->bulk = TRUE;
     return 0;
 
 err_exit:
-    pr_err("Failed to enter in command mode");
+    qmp_bulk_uninit(q);
     return -1;
 }
 
-int qmp_client_init(char *sock_path)
+struct qmp_conn *qmp_open(char *sock_path)
 {
-    int r;
+    struct qmp_conn *q;
 
-    r = qmp_establish_conn(sock_path);
-    if (r == -1) {
+    q = xcalloc(1, sizeof(*q));
+    q->fd = -1;
+    q->bulk_rfd = q->bulk_wfd = q->bulk_fdset = -1;
+    chunk_tune_init(&q->xp_tune, XP_CHUNK_MIN, XP_CHUNK_MAX);
+
+    if (qmp_establish_conn(q, sock_path) == -1) {
         pr_err("Unable to talk to qemu monitor");
         goto err_exit;
     }
 
-
-    r = qmp_negotiate();
-    if (r == -1) {
+    if (qmp_negotiate(q) == -1) {
         pr_err("Failed to negotiate qmp commands");
         goto err_exit;
     }
 
-    return 0;
+    return q;
 
 err_exit:
-	return -1;
+    qmp_close(q);
+    return NULL;
+}
+
+void qmp_close(struct qmp_conn *q)
+{
+    if (!q)
+        return;
+
+    if (q->fd >= 0) {
+        qmp_bulk_uninit(q);
+        close(q->fd);
+    }
+
+    xfree(q->rbuf);
+    xfree(q);
 }
 
-int qmp_client_uninit()
+int qmp_client_init(guest_client_t *c, char *sock_path)
 {
-    if (close(qmp_fd) == -1) {
+    struct qmp_conn *q;
+
+    if (!(q = qmp_open(sock_path))) {
         return -1;
     }
 
+    if (qmp_bulk_init(q) == -1) {
+        pr_info("pmemsave not usable, reading memory with xp");
+    }
+
+    c->priv = q;
+    return 0;
+}
+
+int qmp_client_uninit(guest_client_t *c)
+{
+    qmp_close(c->priv);
+    c->priv = NULL;
     return 0;
 }
 
@@ -203,46 +636,111 @@ static int qmp_populate_reg(const char *buf, const char *reg_name, uint64_t *reg
 	return 0;
 }
 
-int qmp_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
+int qmp_registers(struct qmp_conn *q, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
 {
-	size_t nread, nwrite, cmd_len_regs;
+	size_t len;
 	char *buf;
 
-	cmd_len_regs = strlen(QMP_COMMAND_INFO_REGS);
-
-	nwrite = xwrite(qmp_fd, QMP_COMMAND_INFO_REGS, cmd_len_regs);
-	if (nwrite != cmd_len_regs) {
-		return -1;
-	}
-
-	buf = xmalloc(8192);
-
-	if (qmp_read(qmp_fd, buf, &nread) == -1 || nread <= 0) {
+	if (qmp_command(q, QMP_COMMAND_INFO_REGS, &buf, &len) == -1) {
 		pr_err("Failed to get read");
-		goto err_exit;
+		return -1;
 	}
 
 	if (qmp_populate_reg(buf, "CR3", cr3) == -1) {
 		pr_err("Failed to get register CR3");
-		goto err_exit;
+		return -1;
 	}
 
 	if (qmp_populate_reg(buf, "CR4", cr4) == -1) {
 		pr_err("Failed to get register CR4");
-		goto err_exit;
+		return -1;
 	}
 
 	if (qmp_populate_reg(buf, "IDT", idtr) == -1) {
 		pr_err("Failed to get register IDT");
-		goto err_exit;
+		return -1;
 	}
 
-	xfree(buf);
 	return 0;
+}
 
-err_exit:
-    xfree(buf);
-	return -1;
+/*
+ * Copy the decoded "return" string of a human-monitor-command reply
+ * into out, turning the JSON escapes back into plain characters.
+ */
+static int qmp_unescape_return(const char *input, size_t len, char *out, size_t size)
+{
+    const char *return_start = "\"return\": \"";
+    const char *p, *end = input + len;
+    size_t pos = 0;
+
+    p = strstr(input, return_start);
+    if (!p || size == 0) {
+        return -1;
+    }
+    p += strlen(return_start);
+
+    while (p < end && *p != '\"' && pos < size - 1) {
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+            switch (*p) {
+                case 'n': out[pos++] = '\n'; break;
+                case 'r': out[pos++] = '\r'; break;
+                case 't': out[pos++] = '\t'; break;
+                case 'b': out[pos++] = '\b'; break;
+                case 'f': out[pos++] = '\f'; break;
+                case 'u':
+                    /* monitor output is ascii, anything else is dropped */
+                    if (p + 4 < end) {
+                        unsigned int c = 0;
+                        sscanf(p + 1, "%4x", &c);
+                        out[pos++] = c < 0x80 ? (char)c : '?';
+                        p += 4;
+                    }
+                    break;
+                default: out[pos++] = *p; break;
+            }
+            p++;
+        } else {
+            out[pos++] = *p++;
+        }
+    }
+    out[pos] = '\0';
+
+    return 0;
+}
+
+/*
+ * Run an HMP command and return its output in out, e.g. "info mtree -f"
+ * or "gpa2hva 0x0".
+ */
+int qmp_hmp(struct qmp_conn *q, const char *cmdline, char *out, size_t size)
+{
+    char cmd[256];
+    char *reply;
+    size_t len;
+
+    snprintf(cmd, sizeof(cmd), QMP_COMMAND_HMP, cmdline);
+
+    if (qmp_command(q, cmd, &reply, &len) == -1) {
+        pr_err("Failed to get read");
+        return -1;
+    }
+
+    return qmp_unescape_return(reply, len, out, size);
+}
+
+/* pid of the QEMU process on the other end of the monitor socket */
+int qmp_peer_pid(struct qmp_conn *q)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(q->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        return -1;
+    }
+
+    return cred.pid;
 }
 
 int qmp_populate_mem(char *input, size_t len, uint8_t *buffer, size_t size)
@@ -287,62 +785,172 @@ int qmp_populate_mem(char *input, size_t len, uint8_t *buffer, size_t size)
     return 0;
 }
 
-static int qmp_readmem_part(uint64_t addr, uint8_t *buffer, size_t size)
+struct xp_slot {
+    unsigned int id;
+    uint8_t *dst;
+    size_t len;
+    int busy;
+    uint64_t sent;
+};
+
+static int qmp_reply_id(const char *reply, size_t len, unsigned int *id)
 {
-	size_t nread, nwrite, cmd_len_regs;
-    char cmd[256] = {0};
-	char *buf;
+    const char *p;
 
-    if (size <= 0) {
-        pr_warning("Invalid input size: %ld", size);
-        return size;
+    /* QEMU puts the id last, after the (escaped) monitor output */
+    for (p = reply + len - strlen("\"id\":"); p >= reply; p--) {
+        if (strncmp(p, "\"id\":", strlen("\"id\":")) == 0)
+            return sscanf(p + strlen("\"id\":"), " %u", id) == 1 ? 0 : -1;
     }
 
-    snprintf(cmd, sizeof(cmd), QMP_COMMAND_XP, size, addr);
-	cmd_len_regs = strlen(cmd);
+    return -1;
+}
 
-	nwrite = xwrite(qmp_fd, cmd, cmd_len_regs);
-	if (nwrite != cmd_len_regs) {
-		return -1;
-	}
+static int qmp_xp_send(struct qmp_conn *q, struct xp_slot *slot, uint64_t addr, uint8_t *dst, size_t len)
+{
+    char cmd[256];
 
-    size_t buf_len = 1024 + size * 8;
-    buf= xmalloc(buf_len);
+    slot->id = q->xp_next_id++;
+    slot->dst = dst;
+    slot->len = len;
+    slot->busy = TRUE;
+    slot->sent = xclock_ns();
 
-    if (qmp_read(qmp_fd, buf, &nread) == -1 || nread <= 0) {
-		pr_err("Failed to get read");
-		goto err_exit;
-	}
+    snprintf(cmd, sizeof(cmd), QMP_COMMAND_XP, len, addr, slot->id);
+    return qmp_write(q, cmd, strlen(cmd));
+}
 
-    qmp_populate_mem(buf, buf_len, buffer, size);
+static int qmp_xp_receive(struct qmp_conn *q, struct xp_slot *slots)
+{
+    struct xp_slot *slot;
+    unsigned int id;
+    uint64_t now, start;
+    char *buf;
+    size_t len;
+
+    if (qmp_read_reply(q, &buf, &len) == -1) {
+        pr_err("Failed to get read");
+        return -1;
+    }
 
-    xfree(buf);
-	return 0;
+    if (qmp_reply_id(buf, len, &id) == -1) {
+        pr_err("Reply without id: %.*s", (int)(len < 128 ? len : 128), buf);
+        return -1;
+    }
 
-err_exit:
-    xfree(buf);
-	return -1;
+    slot = &slots[id % XP_PIPELINE_DEPTH];
+    if (!slot->busy || slot->id != id) {
+        pr_err("Unexpected reply id %u", id);
+        return -1;
+    }
+    slot->busy = FALSE;
+
+    if (qmp_populate_mem(buf, len, slot->dst, slot->len) == -1)
+        return -1;
+
+    /* with the pipeline full, a chunk costs the time between two replies */
+    now = xclock_ns();
+    start = slot->sent > q->xp_last_reply ? slot->sent : q->xp_last_reply;
+    chunk_tune_done(&q->xp_tune, slot->len, now - start);
+    q->xp_last_reply = now;
+
+    return 0;
 }
 
-int qmp_readmem(uint64_t addr, void *buffer, size_t size)
+/*
+ * Split the requests into xp sized chunks and keep the pipeline full:
+ * a new command goes out whenever a reply comes in.
+ */
+static int qmp_readmem_xp(struct qmp_conn *q, struct mem_req *reqs, int nr)
 {
-    int step = 4096;
-    uint8_t *buf = (uint8_t *)buffer;
-    size_t left = size % step;
+    struct xp_slot slots[XP_PIPELINE_DEPTH];
+    struct xp_slot *slot;
+    size_t off = 0, len;
+    int inflight = 0, i = 0;
+
+    memset(slots, 0, sizeof(slots));
+
+    while (i < nr || inflight) {
+        /* the slot stays taken until its own reply is in */
+        while (i < nr && !slots[q->xp_next_id % XP_PIPELINE_DEPTH].busy) {
+            if (off == reqs[i].len) {
+                i++;
+                off = 0;
+                continue;
+            }
 
-    for (size_t i = 0; i < size / step; i++) {
-        if (qmp_readmem_part(addr, buf, step) != 0) {
-            return -1;
+            len = reqs[i].len - off;
+            if (len > q->xp_tune.size)
+                len = q->xp_tune.size;
+
+            slot = &slots[q->xp_next_id % XP_PIPELINE_DEPTH];
+            if (qmp_xp_send(q, slot, reqs[i].addr + off,
+                        (uint8_t *)reqs[i].dst + off, len) == -1) {
+                goto err_exit;
+            }
+            inflight++;
+            off += len;
         }
-        addr += step;
-        buf += step;
-    }
 
-    if (left > 0) {
-        if (qmp_readmem_part(addr, buf, left) != 0) {
-            return -1;
+        if (inflight) {
+            inflight--;
+            if (qmp_xp_receive(q, slots) == -1) {
+                goto err_exit;
+            }
         }
     }
 
     return 0;
+
+err_exit:
+    /* the replies still on their way would be taken for later ones */
+    while (inflight-- > 0) {
+        char *buf;
+        size_t len;
+
+        if (qmp_read_reply(q, &buf, &len) == -1)
+            break;
+    }
+    return -1;
+}
+
+int qmp_read_batch(struct qmp_conn *q, struct mem_req *reqs, int nr)
+{
+    int i = 0;
+
+    if (q->bulk) {
+        /* pmemsave always writes the same scratch file, one at a time */
+        for (; i < nr; i++) {
+            if (qmp_bulk_readmem(q, reqs[i].addr, reqs[i].dst, reqs[i].len))
+                break;
+        }
+        if (i == nr) {
+            return 0;
+        }
+        pr_warning("pmemsave failed, falling back to xp");
+        qmp_bulk_uninit(q);
+    }
+
+    return qmp_readmem_xp(q, reqs + i, nr - i);
+}
+
+int qmp_get_registers(guest_client_t *c, uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
+{
+    return qmp_registers(c->priv, idtr, cr3, cr4);
+}
+
+int qmp_readmem_batch(guest_client_t *c, struct mem_req *reqs, int nr)
+{
+    return qmp_read_batch(c->priv, reqs, nr);
+}
+
+int qmp_readmem(guest_client_t *c, uint64_t addr, void *buffer, size_t size)
+{
+    struct mem_req req = {
+        .addr = addr,
+        .len = size,
+        .dst = buffer,
+    };
+
+    return qmp_read_batch(c->priv, &req, 1);
 }
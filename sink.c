@@ -0,0 +1,582 @@
+/* sink.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "xutil.h"
+#include "defs.h"
+#include "log.h"
+#include "sink.h"
+
+/*
+ * Records for a collector on the network.  The output goes to a FILE
+ * like any other, whose writes are copied into a ring buffer and sent
+ * by a thread of the sink, so reading the guests never waits for the
+ * network.  The thread sends whatever piled up in one sendmsg() as soon
+ * as the socket takes it, with epoll telling it when that is, so a busy
+ * sink does large writes and an idle one none at all.
+ *
+ * The ring is bounded.  When it is full a write waits for the thread to
+ * make room, up to SINK_WAIT_MS, and is dropped after that, or right
+ * away while the collector cannot be reached.  A lost connection is made
+ * again with a growing delay once there is something to send.  Each
+ * write of the output layer is whole records and is sent whole or not
+ * at all on a connection, so a collector only sees half a record when
+ * the connection breaks in the middle of it.
+ */
+#define SINK_CHUNKS             (4096)      /* writes in the ring, at most */
+#define SINK_BACKOFF_MIN_MS     (100)
+#define SINK_BACKOFF_MAX_MS     (5000)
+#define SINK_CLOSE_MS           (5000)      /* to send what is left */
+
+struct sink {
+    char host[256];
+    char port[32];
+
+    int fd;                         /* -1 while not connected */
+    int connecting;
+    int want_out;                   /* EPOLLOUT is asked for */
+    int epfd;
+    int efd;                        /* eventfd waking the thread */
+    pthread_t thread;
+    uint64_t retry_ns;              /* of the next connect */
+    unsigned int backoff_ms;
+
+    char *preamble;
+    size_t preamble_len;
+    size_t preamble_sent;
+
+    pthread_mutex_t lock;           /* for the rest */
+    pthread_cond_t room;
+    char *buf;
+    uint64_t head;                  /* bytes taken in */
+    uint64_t tail;                  /* bytes sent or dropped */
+    uint64_t start;                 /* of the write being sent */
+    uint64_t ends[SINK_CHUNKS];     /* of the writes in the ring */
+    unsigned int first, nr;
+    uint64_t dropped;
+    int down;                       /* the collector cannot be reached */
+    int stop;
+
+    FILE *file;
+};
+
+/* "host:port", or "[v6addr]:port" */
+static int sink_parse(struct sink *s, const char *addr)
+{
+    const char *colon;
+    size_t len;
+
+    if (addr[0] == '[') {
+        if (!(colon = strstr(addr, "]:")))
+            return -1;
+        addr++;
+        len = colon - addr;
+        colon++;
+    } else {
+        if (!(colon = strrchr(addr, ':')))
+            return -1;
+        len = colon - addr;
+    }
+
+    if (!len || len >= sizeof(s->host) || !colon[1] ||
+            strlen(colon + 1) >= sizeof(s->port))
+        return -1;
+
+    memcpy(s->host, addr, len);
+    s->host[len] = '\0';
+    strcpy(s->port, colon + 1);
+    return 0;
+}
+
+static void sink_wake(struct sink *s)
+{
+    uint64_t one = 1;
+
+    if (write(s->efd, &one, sizeof(one)) < 0) {
+        /* the counter is already set */
+    }
+}
+
+static void sink_watch(struct sink *s, int out)
+{
+    struct epoll_event ev = { 0 };
+
+    ev.events = EPOLLIN | EPOLLRDHUP | (out ? EPOLLOUT : 0);
+    ev.data.fd = s->fd;
+    epoll_ctl(s->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->want_out = out;
+}
+
+/* the next connect is some time away, and writes stop waiting for room */
+static void sink_fail(struct sink *s, int err)
+{
+    pthread_mutex_lock(&s->lock);
+    if (!s->down) {
+        pr_warning("%s %s:%s: %s", s->connecting ? "Cannot connect to" :
+                "Lost the connection to", s->host, s->port, strerror(err));
+        s->down = TRUE;
+        pthread_cond_broadcast(&s->room);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    s->connecting = FALSE;
+    s->retry_ns = xclock_ns() + (uint64_t)s->backoff_ms * 1000000;
+    s->backoff_ms *= 2;
+    if (s->backoff_ms > SINK_BACKOFF_MAX_MS)
+        s->backoff_ms = SINK_BACKOFF_MAX_MS;
+}
+
+/* start a connect, it is done when the socket turns writable */
+static void sink_connect(struct sink *s)
+{
+    struct addrinfo hints = { 0 }, *res, *ai;
+    struct epoll_event ev = { 0 };
+    int fd = -1, err = EHOSTUNREACH;
+
+    s->connecting = TRUE;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(s->host, s->port, &hints, &res)) {
+        sink_fail(s, err);
+        return;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen) || errno == EINPROGRESS)
+            break;
+
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        sink_fail(s, err);
+        return;
+    }
+
+    xset_tcp_keepalive(fd);
+
+    s->fd = fd;
+    s->preamble_sent = 0;
+
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+    s->want_out = TRUE;
+}
+
+static void sink_connected(struct sink *s)
+{
+    s->connecting = FALSE;
+    s->backoff_ms = SINK_BACKOFF_MIN_MS;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->down)
+        pr_info("Connected to %s:%s", s->host, s->port);
+    s->down = FALSE;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* the writes up to tail are gone, under the lock */
+static void sink_consume(struct sink *s, uint64_t tail)
+{
+    s->tail = tail;
+    while (s->nr && s->ends[s->first] <= tail) {
+        s->start = s->ends[s->first];
+        s->first = (s->first + 1) % SINK_CHUNKS;
+        s->nr--;
+    }
+    pthread_cond_broadcast(&s->room);
+}
+
+/*
+ * What is left of the write the connection was sending is dropped, the
+ * next connection starts with the one after it.
+ */
+static void sink_disconnect(struct sink *s, int err)
+{
+    close(s->fd);
+    s->fd = -1;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->tail != s->start) {
+        s->dropped += s->ends[s->first] - s->tail;
+        sink_consume(s, s->ends[s->first]);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    sink_fail(s, err);
+}
+
+/* 1 when there is more to send, 0 when all went, -1 on errors */
+static int sink_send(struct sink *s)
+{
+    struct iovec iov[3];
+    struct msghdr msg = { 0 };
+    uint64_t tail, head;
+    size_t off, len, n;
+    ssize_t ret;
+    int nr = 0, more;
+
+    if (s->preamble_sent < s->preamble_len) {
+        iov[nr].iov_base = s->preamble + s->preamble_sent;
+        iov[nr++].iov_len = s->preamble_len - s->preamble_sent;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    tail = s->tail;
+    head = s->head;
+    pthread_mutex_unlock(&s->lock);
+
+    /* the writes never touch what is between tail and head */
+    off = tail % SINK_BUF_SIZE;
+    len = head - tail;
+    if (len) {
+        n = len < SINK_BUF_SIZE - off ? len : SINK_BUF_SIZE - off;
+        iov[nr].iov_base = s->buf + off;
+        iov[nr++].iov_len = n;
+        if (len > n) {
+            iov[nr].iov_base = s->buf;
+            iov[nr++].iov_len = len - n;
+        }
+    }
+
+    if (!nr)
+        return 0;
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nr;
+    ret = sendmsg(s->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (ret < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 1 : -1;
+
+    n = s->preamble_len - s->preamble_sent;
+    if (n > (size_t)ret)
+        n = ret;
+    s->preamble_sent += n;
+    ret -= n;
+
+    /* what was written meanwhile did not wake the thread, see sink_write() */
+    more = (size_t)ret < len;
+    if (ret) {
+        pthread_mutex_lock(&s->lock);
+        sink_consume(s, tail + ret);
+        more = s->head != s->tail;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return s->preamble_sent < s->preamble_len || more;
+}
+
+/* anything from the collector is ignored, but its close is not */
+static int sink_drain(struct sink *s)
+{
+    char buf[256];
+    ssize_t n;
+
+    while ((n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        ;
+
+    if (!n)
+        errno = ECONNRESET;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+    return -1;
+}
+
+static void sink_event(struct sink *s, struct epoll_event *ev)
+{
+    socklen_t len = sizeof(int);
+    uint64_t val;
+    int err = 0;
+
+    if (ev->data.fd == s->efd) {
+        if (read(s->efd, &val, sizeof(val)) < 0) {
+            /* nothing to clear */
+        }
+        return;
+    }
+
+    if (ev->data.fd != s->fd)
+        return;
+
+    if (s->connecting) {
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (ev->events & (EPOLLERR | EPOLLHUP))) {
+            sink_disconnect(s, err ? err : ECONNREFUSED);
+            return;
+        }
+        sink_connected(s);
+        return;
+    }
+
+    if (ev->events & (EPOLLERR | EPOLLHUP)) {
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        sink_disconnect(s, err ? err : ECONNRESET);
+        return;
+    }
+
+    if ((ev->events & (EPOLLIN | EPOLLRDHUP)) && sink_drain(s))
+        sink_disconnect(s, errno);
+}
+
+static void *sink_thread(void *arg)
+{
+    struct sink *s = arg;
+    struct epoll_event ev[2];
+    uint64_t now, deadline = 0;
+    int pending, timeout, n, i, ret;
+
+    for (;;) {
+        now = xclock_ns();
+
+        pthread_mutex_lock(&s->lock);
+        pending = s->head != s->tail;
+        if (s->stop && !deadline)
+            deadline = now + (uint64_t)SINK_CLOSE_MS * 1000000;
+        pthread_mutex_unlock(&s->lock);
+
+        if (deadline && (!pending || now >= deadline))
+            break;
+
+        if (s->fd < 0 && pending && now >= s->retry_ns)
+            sink_connect(s);
+
+        if (s->fd >= 0 && !s->connecting) {
+            ret = sink_send(s);
+            if (ret < 0)
+                sink_disconnect(s, errno);
+            else if (ret != s->want_out)
+                sink_watch(s, ret);
+        }
+
+        timeout = -1;
+        if (s->fd < 0 && pending)
+            timeout = s->retry_ns > now ? (s->retry_ns - now) / 1000000 + 1 : 0;
+        if (deadline && (timeout < 0 || (uint64_t)timeout > (deadline - now) / 1000000))
+            timeout = (deadline - now) / 1000000 + 1;
+
+        n = epoll_wait(s->epfd, ev, 2, timeout);
+        for (i = 0; i < n; i++)
+            sink_event(s, &ev[i]);
+    }
+
+    return NULL;
+}
+
+/* under the lock, FALSE when the write is to be dropped */
+static int sink_wait_room(struct sink *s, size_t n)
+{
+    struct timespec ts;
+    int timed = FALSE;
+
+    while (SINK_BUF_SIZE - (s->head - s->tail) < n || s->nr == SINK_CHUNKS) {
+        if (s->down)
+            return FALSE;
+
+        if (!timed) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += SINK_WAIT_MS / 1000;
+            ts.tv_nsec += (SINK_WAIT_MS % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            timed = TRUE;
+        }
+
+        sink_wake(s);
+        if (pthread_cond_timedwait(&s->room, &s->lock, &ts) == ETIMEDOUT)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static ssize_t sink_write(void *cookie, const char *data, size_t size)
+{
+    struct sink *s = cookie;
+    size_t left, off, n, m;
+    int idle;
+
+    /* the thread only waits for a wake up once it has sent everything */
+    pthread_mutex_lock(&s->lock);
+    idle = s->head == s->tail;
+    for (left = size; left; data += n, left -= n) {
+        n = left < SINK_BUF_SIZE ? left : SINK_BUF_SIZE;
+        if (!sink_wait_room(s, n)) {
+            s->dropped += n;
+            continue;
+        }
+
+        off = s->head % SINK_BUF_SIZE;
+        m = n < SINK_BUF_SIZE - off ? n : SINK_BUF_SIZE - off;
+        memcpy(s->buf + off, data, m);
+        memcpy(s->buf, data + m, n - m);
+
+        s->head += n;
+        s->ends[(s->first + s->nr) % SINK_CHUNKS] = s->head;
+        s->nr++;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (idle)
+        sink_wake(s);
+    return size;
+}
+
+static int sink_cookie_close(void *cookie)
+{
+    (void)cookie;
+    return 0;
+}
+
+static void sink_free(struct sink *s)
+{
+    if (s->fd >= 0)
+        close(s->fd);
+    if (s->efd >= 0)
+        close(s->efd);
+    if (s->epfd >= 0)
+        close(s->epfd);
+    xfree(s->preamble);
+    xfree(s->buf);
+    xfree(s);
+}
+
+struct sink *sink_open(const char *addr, const void *preamble, size_t len)
+{
+    cookie_io_functions_t io = { .write = sink_write, .close = sink_cookie_close };
+    struct addrinfo hints = { 0 }, *res;
+    struct epoll_event ev = { 0 };
+    pthread_condattr_t attr;
+    struct sink *s;
+    int err;
+
+    s = xcalloc(1, sizeof(*s));
+    s->fd = s->efd = s->epfd = -1;
+
+    if (sink_parse(s, addr)) {
+        pr_err("Invalid sink address: %s", addr);
+        goto fail;
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(s->host, s->port, &hints, &res))) {
+        pr_err("Cannot resolve %s:%s: %s", s->host, s->port, gai_strerror(err));
+        goto fail;
+    }
+    freeaddrinfo(res);
+
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    s->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->epfd < 0 || s->efd < 0) {
+        pr_err("Cannot set up the sink: %s", strerror(errno));
+        goto fail;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = s->efd;
+    epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->efd, &ev);
+
+    s->buf = xmalloc(SINK_BUF_SIZE);
+    s->backoff_ms = SINK_BACKOFF_MIN_MS;
+    if (len) {
+        s->preamble = xmalloc(len);
+        memcpy(s->preamble, preamble, len);
+        s->preamble_len = len;
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->room, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* unbuffered, each write of the output layer is one write here */
+    if (!(s->file = fopencookie(s, "w", io))) {
+        pr_err("Cannot set up the sink: %s", strerror(errno));
+        goto fail;
+    }
+    setvbuf(s->file, NULL, _IONBF, 0);
+
+    if ((err = pthread_create(&s->thread, NULL, sink_thread, s))) {
+        pr_err("Cannot start the sink: %s", strerror(err));
+        fclose(s->file);
+        goto fail;
+    }
+
+    return s;
+
+fail:
+    sink_free(s);
+    return NULL;
+}
+
+FILE *sink_file(struct sink *s)
+{
+    return s->file;
+}
+
+/* sends what is left, for SINK_CLOSE_MS at most */
+void sink_close(struct sink *s)
+{
+    uint64_t lost;
+
+    if (!s)
+        return;
+
+    fclose(s->file);
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = TRUE;
+    pthread_mutex_unlock(&s->lock);
+    sink_wake(s);
+    pthread_join(s->thread, NULL);
+
+    lost = s->dropped + s->head - s->tail;
+    if (lost)
+        pr_warning("%" PRIu64 " bytes could not be sent to %s:%s", lost, s->host, s->port);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->room);
+    sink_free(s);
+}
@@ -0,0 +1,35 @@
+/* sink.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __SINK_H__
+#define __SINK_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define SINK_BUF_SIZE       (4 << 20)   /* not sent yet, at most */
+#define SINK_WAIT_MS        (1000)      /* for room before a write is dropped */
+
+struct sink;
+
+/*
+ * A TCP collector at "host:port" or "[v6addr]:port".  preamble goes out
+ * first on every connection, like the magic of a binary stream.
+ */
+struct sink *sink_open(const char *addr, const void *preamble, size_t len);
+FILE *sink_file(struct sink *s);
+void sink_close(struct sink *s);
+
+#endif
@@ -0,0 +1,446 @@
+/* spool.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "defs.h"
+#include "log.h"
+#include "xutil.h"
+#include "cache.h"
+#include "spool.h"
+
+/*
+ * A spool keeps every record ever read from a guest, over all of its
+ * boots, in two files of the spool directory:
+ *
+ *   <guest>.spool  the records, as --output=binary writes them, with
+ *                  the boot they are from in each; only ever appended
+ *   <guest>.idx    a header, then an entry for the first record of each
+ *                  boot and for every SPOOL_INDEX_EVERY records
+ *
+ * Within a boot the records are in the order of their sequence numbers
+ * and timestamps, so the entries of the index find the first of them
+ * from a time on, or the last N, with a binary search.
+ *
+ * Only what the header says is there counts.  It is written last, once
+ * the records and entries it counts are, so a scrape that dies halfway
+ * leaves the spool as it was, and the rest is cut off by the next one.
+ * Readers take no lock; there is one writer at a time.
+ */
+#define SPOOL_MAGIC     "KDSPOOL1"
+
+struct spool_header {
+    char magic[8];
+    uint64_t size;              /* of the records file */
+    uint64_t nr;                /* records */
+    uint64_t nr_index;          /* entries of the index */
+    uint64_t boot_key;          /* where the kernel of the last boot was */
+    uint64_t last_seq;          /* of the last record */
+    uint64_t last_ts_nsec;
+    uint32_t boot;              /* the last boot, from 1 */
+    uint32_t reserved;
+};
+
+struct spool_entry {
+    uint64_t nr;                /* records before this one */
+    uint64_t seq;
+    uint64_t ts_nsec;
+    uint64_t offset;            /* in the records file */
+    uint32_t boot;
+    uint32_t reserved;
+};
+
+struct spool {
+    char path[4096];            /* of the records */
+    int fd;
+    int index_fd;
+    int append;
+    int failed;                 /* could not write, nothing more is */
+    struct spool_header h;      /* with what is not committed yet */
+    uint64_t last_entry_nr;
+    int started;
+    int new_boot;               /* the next record starts one */
+    uint64_t next_seq;          /* the records of this boot before it are in */
+    char *buf;                  /* records for the end of the file */
+    size_t len;
+};
+
+/* where KASLR put the kernel, which changes with every boot that has it */
+static uint64_t spool_boot_key(void)
+{
+    uint64_t key;
+
+    key = cache_hash(&kt->relocate, sizeof(kt->relocate), CACHE_HASH_INIT);
+    return cache_hash(&machdep->machspec->phys_base,
+            sizeof(machdep->machspec->phys_base), key);
+}
+
+/* DIR/<guest><ext>, with the slashes of a path turned into '_' */
+static int spool_path(char *path, size_t len, const char *dir, const char *guest,
+        const char *ext)
+{
+    size_t n;
+    char *p;
+
+    while (*guest == '/')
+        guest++;
+
+    n = snprintf(path, len, "%s/", dir);
+    if ((size_t)snprintf(path + n, len - n, "%s%s", guest, ext) >= len - n)
+        return -1;
+
+    for (p = path + n; *p; p++) {
+        if (*p == '/')
+            *p = '_';
+    }
+
+    return 0;
+}
+
+static int spool_new(struct spool *sp)
+{
+    memset(&sp->h, 0, sizeof(sp->h));
+    memcpy(sp->h.magic, SPOOL_MAGIC, sizeof(sp->h.magic));
+    sp->h.size = sizeof(KVMDMESG_BIN_MAGIC) - 1;
+
+    if (pwrite(sp->fd, KVMDMESG_BIN_MAGIC, sp->h.size, 0) != (ssize_t)sp->h.size) {
+        pr_err("Cannot write %s: %s", sp->path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+struct spool *spool_open(const char *dir, const char *guest, int append)
+{
+    struct spool_entry e;
+    char index[4096];
+    struct spool *sp;
+    struct stat sb;
+    int flags = append ? O_RDWR | O_CREAT : O_RDONLY;
+
+    sp = xcalloc(1, sizeof(*sp));
+    sp->append = append;
+    sp->fd = sp->index_fd = -1;
+
+    if (spool_path(sp->path, sizeof(sp->path), dir, guest, ".spool") ||
+            spool_path(index, sizeof(index), dir, guest, ".idx")) {
+        pr_err("The spool path of %s is too long", guest);
+        goto err;
+    }
+
+    if ((sp->index_fd = open(index, flags, 0600)) == -1 ||
+            (sp->fd = open(sp->path, flags, 0600)) == -1) {
+        if (errno == ENOENT)
+            pr_err("No spool of %s in %s", guest, dir);
+        else
+            pr_err("Cannot open the spool of %s: %s", guest, strerror(errno));
+        goto err;
+    }
+
+    if (append && flock(sp->index_fd, LOCK_EX | LOCK_NB)) {
+        pr_err("%s is being spooled by another kvm-dmesg", guest);
+        goto err;
+    }
+
+    if (fstat(sp->index_fd, &sb))
+        goto err;
+
+    if (sb.st_size == 0 && append) {
+        if (spool_new(sp))
+            goto err;
+    } else if (pread(sp->index_fd, &sp->h, sizeof(sp->h), 0) != sizeof(sp->h) ||
+            memcmp(sp->h.magic, SPOOL_MAGIC, sizeof(sp->h.magic))) {
+        pr_err("%s is not a spool", index);
+        goto err;
+    }
+
+    if (!append)
+        return sp;
+
+    /* what a scrape that died left behind */
+    if (ftruncate(sp->fd, sp->h.size) ||
+            ftruncate(sp->index_fd, sizeof(sp->h) + sp->h.nr_index * sizeof(e))) {
+        pr_err("Cannot write %s: %s", sp->path, strerror(errno));
+        goto err;
+    }
+
+    if (sp->h.nr_index) {
+        if (pread(sp->index_fd, &e, sizeof(e), sizeof(sp->h) +
+                    (sp->h.nr_index - 1) * sizeof(e)) != sizeof(e)) {
+            pr_err("%s is not a spool", index);
+            goto err;
+        }
+        sp->last_entry_nr = e.nr;
+    }
+
+    sp->buf = xmalloc(SPOOL_BUF_SIZE);
+    return sp;
+
+err:
+    spool_close(sp);
+    return NULL;
+}
+
+/* the last record of the spool, FALSE if there is none */
+int spool_last(struct spool *sp, uint64_t *seq, uint64_t *ts_nsec, int *moved)
+{
+    if (!sp->h.nr)
+        return FALSE;
+
+    *seq = sp->h.last_seq;
+    *ts_nsec = sp->h.last_ts_nsec;
+    *moved = sp->h.boot_key != spool_boot_key();
+    return TRUE;
+}
+
+void spool_start(struct spool *sp, int new_boot)
+{
+    sp->started = TRUE;
+    sp->new_boot = new_boot || !sp->h.nr;
+    sp->next_seq = sp->new_boot ? 0 : sp->h.last_seq + 1;
+
+    if (CRASHDEBUG(1))
+        pr_debug("spool: %s, %lu records in %u boots, from seq %lu of %s boot",
+                sp->path, (ulong)sp->h.nr, sp->h.boot, (ulong)sp->next_seq,
+                sp->new_boot ? "a new" : "the same");
+}
+
+static void spool_fail(struct spool *sp)
+{
+    pr_err("Cannot write %s: %s, the records are not spooled", sp->path, strerror(errno));
+    sp->failed = TRUE;
+}
+
+static int spool_write(struct spool *sp)
+{
+    if (sp->len && pwrite(sp->fd, sp->buf, sp->len, sp->h.size - sp->len) != (ssize_t)sp->len) {
+        spool_fail(sp);
+        return -1;
+    }
+
+    sp->len = 0;
+    return 0;
+}
+
+static void spool_index(struct spool *sp, const struct kvmdmesg_record *r)
+{
+    struct spool_entry e = { 0 };
+
+    e.nr = sp->h.nr;
+    e.seq = r->seq;
+    e.ts_nsec = r->ts_nsec;
+    e.offset = sp->h.size;
+    e.boot = sp->h.boot;
+
+    if (pwrite(sp->index_fd, &e, sizeof(e), sizeof(sp->h) +
+                sp->h.nr_index * sizeof(e)) != sizeof(e)) {
+        spool_fail(sp);
+        return;
+    }
+
+    sp->h.nr_index++;
+    sp->last_entry_nr = e.nr;
+}
+
+/*
+ * Keep r unless the spool has it already, which is what the return
+ * value says.  Records that could not be written are still new.
+ */
+int spool_append(struct spool *sp, const struct kvmdmesg_record *r)
+{
+    static const char zero[8];
+    struct kvmdmesg_bin_record b;
+    size_t len = r->text ? r->len : 0;
+
+    if (!sp->started)
+        spool_start(sp, FALSE);
+
+    if (r->seq < sp->next_seq)
+        return FALSE;
+    sp->next_seq = r->seq + 1;
+
+    if (sp->failed)
+        return TRUE;
+
+    memset(&b, 0, sizeof(b));
+    b.size = roundup(sizeof(b) + len, 8);
+    b.text_len = len;
+    b.level = r->level;
+    b.facility = r->facility;
+    b.caller_id = r->caller_id;
+    b.seq = r->seq;
+    b.ts_nsec = r->ts_nsec;
+
+    if (sp->len + b.size > SPOOL_BUF_SIZE && spool_write(sp))
+        return TRUE;
+
+    if (sp->new_boot) {
+        sp->new_boot = FALSE;
+        sp->h.boot++;
+        sp->h.boot_key = spool_boot_key();
+        spool_index(sp, r);
+    } else if (!sp->h.nr_index || sp->h.nr - sp->last_entry_nr >= SPOOL_INDEX_EVERY) {
+        spool_index(sp, r);
+    }
+    if (sp->failed)
+        return TRUE;
+
+    b.boot = sp->h.boot;
+    memcpy(sp->buf + sp->len, &b, sizeof(b));
+    memcpy(sp->buf + sp->len + sizeof(b), r->text, len);
+    memcpy(sp->buf + sp->len + sizeof(b) + len, zero, b.size - sizeof(b) - len);
+    sp->len += b.size;
+
+    sp->h.size += b.size;
+    sp->h.nr++;
+    sp->h.last_seq = r->seq;
+    sp->h.last_ts_nsec = r->ts_nsec;
+
+    return TRUE;
+}
+
+/* the records so far are in the spool for good */
+int spool_commit(struct spool *sp)
+{
+    if (!sp || !sp->append || sp->failed)
+        return sp && sp->failed ? -1 : 0;
+
+    if (spool_write(sp))
+        return -1;
+
+    if (pwrite(sp->index_fd, &sp->h, sizeof(sp->h), 0) != sizeof(sp->h)) {
+        spool_fail(sp);
+        return -1;
+    }
+
+    return 0;
+}
+
+void spool_close(struct spool *sp)
+{
+    if (!sp)
+        return;
+
+    spool_commit(sp);
+
+    if (sp->fd != -1)
+        close(sp->fd);
+    if (sp->index_fd != -1)
+        close(sp->index_fd);
+    xfree(sp->buf);
+    xfree(sp);
+}
+
+/*
+ * The last entry of a boot that no record wanted comes before: those
+ * before an entry have no later timestamp, and fewer records before
+ * them.  The first entry of a boot is at its first record.
+ */
+static uint64_t spool_find(const struct spool_entry *e, uint64_t n, uint64_t since,
+        uint64_t first_nr)
+{
+    uint64_t lo = 0, half;
+
+    while (n > 1) {
+        half = n / 2;
+        if (e[lo + half].nr <= first_nr || e[lo + half].ts_nsec < since) {
+            lo += half;
+            n -= half;
+        } else {
+            n = half;
+        }
+    }
+
+    return lo;
+}
+
+int spool_query(struct spool *sp, uint64_t since, uint64_t until, unsigned long tail,
+        spool_fn fn, void *arg)
+{
+    const struct kvmdmesg_bin_record *b;
+    struct kvmdmesg_record r;
+    struct spool_entry *e;
+    uint64_t lo, hi, i, nr, first_nr, off, end;
+    size_t size;
+    char *map;
+    int ret = 0;
+
+    if (!sp->h.nr)
+        return 0;
+
+    size = sp->h.nr_index * sizeof(*e);
+    e = xmalloc(size);
+    if (pread(sp->index_fd, e, size, sizeof(sp->h)) != (ssize_t)size) {
+        pr_err("%s is not a spool", sp->path);
+        xfree(e);
+        return -1;
+    }
+
+    map = mmap(NULL, sp->h.size, PROT_READ, MAP_PRIVATE, sp->fd, 0);
+    if (map == MAP_FAILED) {
+        pr_err("Cannot map %s: %s", sp->path, strerror(errno));
+        xfree(e);
+        return -1;
+    }
+
+    first_nr = tail && tail < sp->h.nr ? sp->h.nr - tail : 0;
+
+    for (lo = 0; lo < sp->h.nr_index; lo = hi) {
+        for (hi = lo + 1; hi < sp->h.nr_index && e[hi].boot == e[lo].boot; hi++)
+            ;
+        end = hi < sp->h.nr_index ? e[hi].offset : sp->h.size;
+        if (hi < sp->h.nr_index && e[hi].nr <= first_nr)
+            continue;
+
+        i = lo + spool_find(e + lo, hi - lo, since, first_nr);
+        for (off = e[i].offset, nr = e[i].nr; off < end; off += b->size, nr++) {
+            b = (const struct kvmdmesg_bin_record *)(map + off);
+            if (end - off < sizeof(*b) || b->size < sizeof(*b) || b->size % 8 ||
+                    b->size > end - off || b->text_len > b->size - sizeof(*b)) {
+                pr_err("%s is damaged at %lu", sp->path, (ulong)off);
+                ret = -1;
+                goto out;
+            }
+
+            if (nr < first_nr || b->ts_nsec < since)
+                continue;
+            if (until && b->ts_nsec > until)
+                break;
+
+            r.seq = b->seq;
+            r.ts_nsec = b->ts_nsec;
+            r.level = b->level;
+            r.facility = b->facility;
+            r.caller_id = b->caller_id;
+            r.text = (const char *)(b + 1);
+            r.len = b->text_len;
+            fn(&r, b->boot, arg);
+        }
+    }
+
+out:
+    munmap(map, sp->h.size);
+    xfree(e);
+    return ret;
+}
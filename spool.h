@@ -0,0 +1,53 @@
+/* spool.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include <stdint.h>
+
+#include "kvmdmesg.h"
+
+#define SPOOL_INDEX_EVERY   (256)       /* records between entries of the index */
+#define SPOOL_BUF_SIZE      (256 << 10) /* records not written out yet, at most */
+
+struct spool;
+
+/* the spool of guest in dir, to add records to or to read */
+struct spool *spool_open(const char *dir, const char *guest, int append);
+void spool_close(struct spool *sp);
+
+/*
+ * Adding the records of a scrape: spool_last() tells what the spool
+ * has of the guest, the caller finds out from the ring whether that
+ * was this boot of it and says so with spool_start().  spool_append()
+ * then keeps the records the spool does not have yet, and says which
+ * those are; spool_commit() makes them last.
+ */
+int spool_last(struct spool *sp, uint64_t *seq, uint64_t *ts_nsec, int *moved);
+void spool_start(struct spool *sp, int new_boot);
+int spool_append(struct spool *sp, const struct kvmdmesg_record *r);
+int spool_commit(struct spool *sp);
+
+/*
+ * Hand fn the records from since to until after the boot of each boot,
+ * or of the last tail records only, oldest first.
+ */
+typedef void (*spool_fn)(const struct kvmdmesg_record *r, uint32_t boot, void *arg);
+
+int spool_query(struct spool *sp, uint64_t since, uint64_t until, unsigned long tail,
+        spool_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,141 @@
+/* stats.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "xutil.h"
+#include "defs.h"
+#include "stats.h"
+
+/*
+ * The phases of a scrape are timed and the traffic with the backend is
+ * counted all the time, into the stats of the guest context; it costs a
+ * clock read per phase and an add per backend call.  --stats prints
+ * them when the guest is done.
+ */
+static const char *phase_names[STATS_NR_PHASES] = {
+    [STATS_SYMTAB]      = "symtab",
+    [STATS_CONNECT]     = "connect",
+    [STATS_KASLR]       = "kaslr",
+    [STATS_VMCOREINFO]  = "vmcoreinfo",
+    [STATS_FETCH]       = "fetch",
+    [STATS_DECODE]      = "decode",
+};
+
+void stats_phase(enum stats_phase phase, uint64_t ns)
+{
+    stats_add(&gc->stats.ns[phase], ns);
+    stats_add(&gc->stats.runs[phase], 1);
+}
+
+void stats_stop(enum stats_phase phase, uint64_t start)
+{
+    stats_phase(phase, xclock_ns() - start);
+}
+
+void stats_merge(struct guest_stats *to, const struct guest_stats *from)
+{
+    const uint64_t *f = (const uint64_t *)from;
+    uint64_t *t = (uint64_t *)to;
+    size_t i;
+
+    /* nothing but counters in there */
+    for (i = 0; i < sizeof(*to) / sizeof(uint64_t); i++)
+        t[i] += f[i];
+}
+
+static double stats_ratio(uint64_t hits, uint64_t misses)
+{
+    return hits + misses ? 100.0 * hits / (hits + misses) : 0;
+}
+
+static void stats_report_text(FILE *f, const char *guest, const struct guest_stats *s)
+{
+    const char *sep = "";
+    int i;
+
+    fprintf(f, "stats: %s:", guest);
+    for (i = 0; i < STATS_NR_PHASES; i++) {
+        if (!s->runs[i])
+            continue;
+        fprintf(f, "%s %s %.2f ms", sep, phase_names[i], s->ns[i] / 1e6);
+        if (s->runs[i] > 1)
+            fprintf(f, " in %" PRIu64, s->runs[i]);
+        sep = ",";
+    }
+    fprintf(f, "\n");
+
+    fprintf(f, "stats: %s: %" PRIu64 " calls, %" PRIu64 " round trips, "
+            "%.2f MB requested, %.2f MB received\n", guest,
+            s->calls, s->round_trips,
+            s->bytes_requested / 1e6, s->bytes_received / 1e6);
+
+    fprintf(f, "stats: %s: cache %" PRIu64 "/%" PRIu64 " hits (%.0f%%), "
+            "tlb %" PRIu64 "/%" PRIu64 " hits (%.0f%%), "
+            "%" PRIu64 " records, %.2f MB out\n", guest,
+            s->cache_hits, s->cache_hits + s->cache_misses,
+            stats_ratio(s->cache_hits, s->cache_misses),
+            s->tlb_hits, s->tlb_hits + s->tlb_misses,
+            stats_ratio(s->tlb_hits, s->tlb_misses),
+            s->records, s->bytes_out / 1e6);
+}
+
+static void stats_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/* one object per line */
+static void stats_report_json(FILE *f, const char *guest, const struct guest_stats *s)
+{
+    int i;
+
+    fprintf(f, "{\"guest\":");
+    stats_json_string(f, guest);
+
+    fprintf(f, ",\"phases\":{");
+    for (i = 0; i < STATS_NR_PHASES; i++) {
+        fprintf(f, "%s\"%s\":{\"ns\":%" PRIu64 ",\"runs\":%" PRIu64 "}",
+                i ? "," : "", phase_names[i], s->ns[i], s->runs[i]);
+    }
+
+    fprintf(f, "},\"calls\":%" PRIu64 ",\"round_trips\":%" PRIu64
+            ",\"bytes_requested\":%" PRIu64 ",\"bytes_received\":%" PRIu64
+            ",\"cache_hits\":%" PRIu64 ",\"cache_misses\":%" PRIu64
+            ",\"tlb_hits\":%" PRIu64 ",\"tlb_misses\":%" PRIu64
+            ",\"records\":%" PRIu64 ",\"bytes_out\":%" PRIu64 "}\n",
+            s->calls, s->round_trips, s->bytes_requested, s->bytes_received,
+            s->cache_hits, s->cache_misses, s->tlb_hits, s->tlb_misses,
+            s->records, s->bytes_out);
+}
+
+void stats_report(FILE *f, const char *guest, const struct guest_stats *s, int format)
+{
+    if (format == STATS_JSON)
+        stats_report_json(f, guest, s);
+    else
+        stats_report_text(f, guest, s);
+    fflush(f);
+}
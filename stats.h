@@ -0,0 +1,69 @@
+/* stats.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* where the time of a scrape goes, see stats.c */
+enum stats_phase {
+    STATS_SYMTAB,           /* symtab_init() */
+    STATS_CONNECT,          /* guest_client_new() */
+    STATS_KASLR,            /* kaslr_init(), from the cache or probed */
+    STATS_VMCOREINFO,       /* vmcoreinfo_init() */
+    STATS_FETCH,            /* reading the ring, each pass */
+    STATS_DECODE,           /* decoding and formatting it */
+    STATS_NR_PHASES
+};
+
+/*
+ * What a guest cost, kept in its context for as long as the context
+ * lives, so follow mode adds up all of its passes.  The counters may be
+ * bumped from more than one thread at a time, see stats_add().
+ */
+struct guest_stats {
+    uint64_t ns[STATS_NR_PHASES];
+    uint64_t runs[STATS_NR_PHASES];
+
+    uint64_t calls;                 /* into the backend */
+    uint64_t round_trips;           /* commands sent to a monitor */
+    uint64_t bytes_requested;       /* of guest memory */
+    uint64_t bytes_received;        /* from the backend, monitor replies as they are */
+
+    uint64_t cache_hits;            /* cache.c */
+    uint64_t cache_misses;
+    uint64_t tlb_hits;              /* x86_64_kvtop() */
+    uint64_t tlb_misses;
+
+    uint64_t records;               /* printed */
+    uint64_t bytes_out;
+};
+
+#define STATS_TEXT      (1)
+#define STATS_JSON      (2)
+
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+    __sync_fetch_and_add(counter, n);
+}
+
+void stats_phase(enum stats_phase phase, uint64_t ns);
+void stats_stop(enum stats_phase phase, uint64_t start);
+void stats_merge(struct guest_stats *to, const struct guest_stats *from);
+void stats_report(FILE *f, const char *guest, const struct guest_stats *s, int format);
+
+#endif
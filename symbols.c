@@ -14,37 +14,101 @@
  */
 
 #include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "defs.h"
 #include "log.h"
+#include "xutil.h"
+#include "cache.h"
+#include "vmcoreinfo.h"
+#include "ksym.h"
 
 #define MAX_LINE_LENGTH 256
 
-int symbol_needed(const char *symbol)
+static const char *symtab_array[] = {
+    "log_first_idx",
+    "log_next_idx",
+    "log_first_seq",
+    "log_buf",
+    "log_end",
+    "log_buf_len",
+    "divide_error",
+    "asm_exc_divide_error",
+    "idt_table",
+    "vmcoreinfo_data",
+    "vmcoreinfo_size",
+    "page_offset_base",
+    "vmalloc_base",
+    "init_top_pgt",
+    "prb"
+};
+
+#define NR_SYMTAB_NEEDED    (sizeof(symtab_array) / sizeof(symtab_array[0]))
+
+/* index into symtab_array of the name, -1 if we do not need it */
+static int symbol_needed_index(const char *name, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < NR_SYMTAB_NEEDED; i++) {
+        if (symtab_array[i][0] == name[0] &&
+                strlen(symtab_array[i]) == len &&
+                !memcmp(symtab_array[i], name, len))
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Some of them only one kernel or another has: the divide error handler
+ * is one of two names, and the log is either prb, log_first_idx with
+ * log_next_idx and log_first_seq, or the log_end of the oldest ones.
+ * All of the others are needed as well for a System.map to be done
+ * with early.
+ */
+static const char *symtab_alternatives[] = {
+    "divide_error",
+    "asm_exc_divide_error",
+    "prb",
+    "log_first_idx",
+    "log_next_idx",
+    "log_first_seq",
+    "log_end",
+};
+
+static int symbol_found(const char *found, const char *name)
+{
+    return found[symbol_needed_index(name, strlen(name))];
+}
+
+static int symbol_all_found(const char *found)
 {
-    static char *symtab_array[] = {
-        "log_first_idx",
-        "log_next_idx",
-        "log_buf",
-        "log_end",
-        "log_buf_len",
-        "divide_error",
-        "asm_exc_divide_error",
-        "idt_table",
-        "vmcoreinfo_data",
-        "vmcoreinfo_size",
-        "page_offset_base",
-        "vmalloc_base",
-        "prb"
-    };
-    size_t array_size = sizeof(symtab_array) / sizeof(symtab_array[0]);
-
-    for (size_t i = 0; i < array_size; i++) {
-        if (STREQ(symbol, symtab_array[i])) {
-            return TRUE;
+    size_t i, j;
+
+    for (i = 0; i < NR_SYMTAB_NEEDED; i++) {
+        for (j = 0; j < sizeof(symtab_alternatives) / sizeof(symtab_alternatives[0]); j++) {
+            if (STREQ(symtab_array[i], symtab_alternatives[j]))
+                break;
         }
+        if (!found[i] && j == sizeof(symtab_alternatives) / sizeof(symtab_alternatives[0]))
+            return FALSE;
     }
-    return FALSE;
+
+    return (symbol_found(found, "divide_error") ||
+                symbol_found(found, "asm_exc_divide_error")) &&
+        (symbol_found(found, "prb") || symbol_found(found, "log_end") ||
+                (symbol_found(found, "log_first_idx") && symbol_found(found, "log_next_idx") &&
+                 symbol_found(found, "log_first_seq")));
+}
+
+int symbol_needed(const char *symbol)
+{
+    return symbol_needed_index(symbol, strlen(symbol)) >= 0;
 }
 
 static void symname_hash_install(struct syment *spn)
@@ -88,29 +152,208 @@ static struct syment *symname_hash_search(const char *name)
     return NULL;
 }
 
+static void symname_hash_add(const char *name, ulong value)
+{
+    struct syment *sp = arena_calloc(&st->arena, 1, sizeof(struct syment));
+
+    sp->value = value;
+    sp->name = arena_strdup(&st->arena, name);
+    symname_hash_install(sp);
+}
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Pick the symbols we need out of the "<address> <type> <name>" lines of
+ * a System.map, stopping early once those of this kernel turned up.
+ */
+static void symname_hash_scan(const char *map, size_t size)
+{
+    const char *p, *q, *eol, *end = map + size;
+    char found[NR_SYMTAB_NEEDED] = { 0 };
+    char name[MAX_LINE_LENGTH];
+    int done = FALSE;
+    size_t len;
+    ulong address;
+    int i, v;
+
+    for (p = map; p < end && !done; p = eol + 1) {
+        if (!(eol = memchr(p, '\n', end - p)))
+            eol = end;
+
+        for (q = p, address = 0; q < eol && (v = hexval(*q)) >= 0; q++)
+            address = (address << 4) | v;
+        if (q == p || q == eol || *q != ' ')
+            continue;
+
+        /* the type */
+        for (q++; q < eol && *q != ' '; q++)
+            ;
+        for (; q < eol && *q == ' '; q++)
+            ;
+
+        for (len = 0; q + len < eol && !isspace((unsigned char)q[len]); len++)
+            ;
+        if (!len || len >= sizeof(name) || (i = symbol_needed_index(q, len)) < 0)
+            continue;
+
+        memcpy(name, q, len);
+        name[len] = '\0';
+        symname_hash_add(name, address);
+
+        if (!found[i]) {
+            found[i] = TRUE;
+            done = symbol_all_found(found);
+        }
+    }
+}
+
+/*
+ * The cache index of a System.map: the symbols we need.  It is found by a
+ * key made of the size, modification time and a sample of the contents
+ * of the file.  The vmcoreinfo of the kernel is cached under the same key
+ * once a guest running it was read, see vmcoreinfo.c.
+ */
+#define SYMTAB_INDEX_MAGIC  "KDSYMID4"
+#define SYMTAB_INDEX_NAME   (32)
+#define SYMTAB_INDEX_SAMPLE (64 * 1024)
+
+struct symtab_index {
+    char magic[8];
+    uint64_t map_key;
+    uint32_t nr_syms;
+    struct {
+        char name[SYMTAB_INDEX_NAME];
+        uint64_t value;
+    } syms[NR_SYMTAB_NEEDED];
+};
+
+static uint64_t symtab_map_key(const char *map, const struct stat *sb)
+{
+    uint64_t key = CACHE_HASH_INIT;
+    size_t n = sb->st_size < SYMTAB_INDEX_SAMPLE ? sb->st_size : SYMTAB_INDEX_SAMPLE;
+
+    key = cache_hash(&sb->st_size, sizeof(sb->st_size), key);
+    key = cache_hash(&sb->st_mtim, sizeof(sb->st_mtim), key);
+    key = cache_hash(map, n, key);
+    key = cache_hash(map + sb->st_size - n, n, key);
+
+    return key;
+}
+
+static int symtab_index_path(char *buf, size_t len, uint64_t key)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "symtab-%016llx", (unsigned long long)key);
+    return cache_path(buf, len, name);
+}
+
+static int symtab_index_load(uint64_t key)
+{
+    struct symtab_index *idx;
+    char path[4096];
+    uint32_t i;
+    int ret = -1;
+
+    if (symtab_index_path(path, sizeof(path), key))
+        return -1;
+
+    idx = xmalloc(sizeof(*idx));
+    if (cache_load(path, idx, sizeof(*idx)) ||
+            memcmp(idx->magic, SYMTAB_INDEX_MAGIC, sizeof(idx->magic)) ||
+            idx->map_key != key || idx->nr_syms > NR_SYMTAB_NEEDED)
+        goto out;
+
+    for (i = 0; i < idx->nr_syms; i++) {
+        idx->syms[i].name[SYMTAB_INDEX_NAME - 1] = '\0';
+        symname_hash_add(idx->syms[i].name, idx->syms[i].value);
+    }
+
+    if (CRASHDEBUG(1))
+        pr_debug("symbols: %u from %s", idx->nr_syms, path);
+    ret = 0;
+
+out:
+    xfree(idx);
+    return ret;
+}
+
+static void symtab_index_store(void)
+{
+    struct symtab_index *idx;
+    struct syment *sp;
+    char path[4096];
+    size_t i;
+
+    if (!st->map_key || symtab_index_path(path, sizeof(path), st->map_key))
+        return;
+
+    idx = xcalloc(1, sizeof(*idx));
+    memcpy(idx->magic, SYMTAB_INDEX_MAGIC, sizeof(idx->magic));
+    idx->map_key = st->map_key;
+
+    for (i = 0; i < NR_SYMTAB_NEEDED; i++) {
+        if (!(sp = symname_hash_search(symtab_array[i])))
+            continue;
+        xstrlcpy(idx->syms[idx->nr_syms].name, sp->name, SYMTAB_INDEX_NAME);
+        idx->syms[idx->nr_syms].value = sp->value;
+        idx->nr_syms++;
+    }
+
+    cache_store(path, idx, sizeof(*idx));
+    xfree(idx);
+}
+
 static void symname_hash_init(const char *map_file)
 {
-   FILE *file = fopen(map_file, "r");
-    if (file == NULL) {
+    struct stat sb;
+    char *map;
+    int fd;
+
+    if ((fd = open(map_file, O_RDONLY)) < 0 || fstat(fd, &sb)) {
         pr_err("Error opening file");
+        if (fd >= 0)
+            close(fd);
         return;
     }
 
-    char line[MAX_LINE_LENGTH];
-    while (fgets(line, sizeof(line), file)) {
-        ulong address;
-        char symbol[MAX_LINE_LENGTH];
+    if (sb.st_size == 0) {
+        close(fd);
+        return;
+    }
 
-        if (sscanf(line, "%lx %*s %s", &address, symbol) == 2) {
-            if (symbol_needed(symbol)) {
-                struct syment *sp = (struct syment *)calloc(1, sizeof(struct syment));
-                sp->value = address;
-                sp->name = strdup(symbol);
-                symname_hash_install(sp);
-            }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        pr_err("Cannot map %s", map_file);
+        return;
+    }
 
-        }
+    st->map_key = symtab_map_key(map, &sb);
+    if (symtab_index_load(st->map_key)) {
+        symname_hash_scan(map, sb.st_size);
+        symtab_index_store();
     }
+    st->vmcoreinfo = vmcoreinfo_cache_load(st->map_key);
+
+    if (pc->symbolize) {
+        st->ksyms = ksym_index_build(map, sb.st_size);
+        if (CRASHDEBUG(1))
+            pr_debug("symbols: %u text symbols to symbolize with",
+                    st->ksyms ? st->ksyms->nr : 0);
+    }
+
+    munmap(map, sb.st_size);
 }
 
 int kernel_symbol_exists(char *symbol)
@@ -155,8 +398,14 @@ void get_symbol_data(char *symbol, long size, void *local)
         pr_err("cannot resolve symbol");
 }
 
+/* without a System.map, kaslr_init() takes the symbols from vmcoreinfo */
 void symtab_init(const char *map_file)
 {
+    uint64_t start = xclock_ns();
+
+    if (!map_file)
+        return;
+
     symname_hash_init(map_file);
 
     if (kernel_symbol_exists("asm_exc_divide_error")) {
@@ -166,4 +415,35 @@ void symtab_init(const char *map_file)
     }
 
     st->idt_table_vmlinux = symbol_value("idt_table");
+
+    stats_stop(STATS_SYMTAB, start);
+}
+
+/*
+ * The SYMBOL() lines of vmcoreinfo have the symbols we need of a recent
+ * kernel, where KASLR put them; they are kept the way a System.map has
+ * them, so get_symbol_data() moves them back.
+ */
+void symtab_from_vmcoreinfo(const struct vmcoreinfo *vi)
+{
+    const struct vmcoreinfo_entry *e;
+    char key[64];
+    long offset = 0;
+    size_t i;
+
+    vmcoreinfo_number(vi, "KERNELOFFSET", &offset);
+
+    for (i = 0; i < NR_SYMTAB_NEEDED; i++) {
+        snprintf(key, sizeof(key), "SYMBOL(%s)", symtab_array[i]);
+        if ((e = vmcoreinfo_lookup(vi, key)))
+            symname_hash_add(symtab_array[i], (ulong)e->number - offset);
+    }
+}
+
+void symtab_free(struct symbol_table_data *symtab)
+{
+    arena_release(&symtab->arena);
+    ksym_index_free(symtab->ksyms);
+    vmcoreinfo_free(symtab->vmcoreinfo);
+    free(symtab);
 }
@@ -0,0 +1,347 @@
+/* vmcoreinfo.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "log.h"
+#include "xutil.h"
+#include "cache.h"
+#include "client.h"
+#include "vmcoreinfo.h"
+
+/*
+ * vmcoreinfo is a list of KEY=VALUE lines.  The values are decimal,
+ * except for the addresses of SYMBOL() and KERNELOFFSET, which are hex
+ * without a prefix.
+ */
+static int vmcoreinfo_is_hex(const char *key)
+{
+    return !strncmp(key, "SYMBOL(", 7) || STREQ(key, "KERNELOFFSET");
+}
+
+static int vmcoreinfo_cmp(const void *a, const void *b)
+{
+    const struct vmcoreinfo_entry *x = a, *y = b;
+
+    return strcmp(x->key, y->key);
+}
+
+struct vmcoreinfo *vmcoreinfo_parse(const char *data, size_t size)
+{
+    struct vmcoreinfo *vi;
+    char *p, *end, *eol, *eq;
+    int alloc = 0;
+
+    vi = xcalloc(1, sizeof(*vi));
+    vi->raw = xmalloc(size + 1);
+    memcpy(vi->raw, data, size);
+    vi->raw[size] = '\0';
+    vi->size = size;
+
+    vi->buf = xmalloc(size + 1);
+    memcpy(vi->buf, data, size);
+    vi->buf[size] = '\0';
+
+    for (p = vi->buf, end = vi->buf + size; p < end; p = eol + 1) {
+        if (!(eol = memchr(p, '\n', end - p)))
+            eol = end;
+        *eol = '\0';
+
+        if (!(eq = strchr(p, '=')) || eq == p)
+            continue;
+        *eq = '\0';
+
+        if (vi->nr == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            vi->entries = xrealloc(vi->entries, alloc * sizeof(*vi->entries));
+        }
+
+        vi->entries[vi->nr].key = p;
+        vi->entries[vi->nr].value = eq + 1;
+        /* kernel addresses do not fit a long, but their bits do */
+        if (vmcoreinfo_is_hex(p))
+            vi->entries[vi->nr].number = (long)strtoul(eq + 1, NULL, 16);
+        else
+            vi->entries[vi->nr].number = strtol(eq + 1, NULL, 10);
+        vi->nr++;
+    }
+
+    qsort(vi->entries, vi->nr, sizeof(*vi->entries), vmcoreinfo_cmp);
+
+    return vi;
+}
+
+void vmcoreinfo_free(struct vmcoreinfo *vi)
+{
+    if (!vi)
+        return;
+
+    xfree(vi->entries);
+    xfree(vi->buf);
+    xfree(vi->raw);
+    xfree(vi);
+}
+
+const struct vmcoreinfo_entry *vmcoreinfo_lookup(const struct vmcoreinfo *vi,
+        const char *key)
+{
+    struct vmcoreinfo_entry k = { .key = key };
+
+    if (!vi || !vi->nr)
+        return NULL;
+
+    return bsearch(&k, vi->entries, vi->nr, sizeof(*vi->entries), vmcoreinfo_cmp);
+}
+
+const char *vmcoreinfo_string(const struct vmcoreinfo *vi, const char *key)
+{
+    const struct vmcoreinfo_entry *e = vmcoreinfo_lookup(vi, key);
+
+    return e ? e->value : NULL;
+}
+
+int vmcoreinfo_number(const struct vmcoreinfo *vi, const char *key, long *value)
+{
+    const struct vmcoreinfo_entry *e = vmcoreinfo_lookup(vi, key);
+
+    if (!e)
+        return -1;
+
+    *value = e->number;
+    return 0;
+}
+
+/*
+ * The vmcoreinfo of a kernel build is kept with its System.map in the
+ * cache, see symbols.c.  Per boot entries like KERNELOFFSET come from
+ * whichever guest was read first, so nothing should rely on them.
+ */
+static int vmcoreinfo_cache_path(char *buf, size_t len, uint64_t map_key)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "vmcoreinfo-%016llx", (unsigned long long)map_key);
+    return cache_path(buf, len, name);
+}
+
+struct vmcoreinfo *vmcoreinfo_cache_load(uint64_t map_key)
+{
+    struct vmcoreinfo *vi;
+    char path[4096];
+    char *data = NULL;
+    size_t size;
+
+    if (!map_key || vmcoreinfo_cache_path(path, sizeof(path), map_key) ||
+            file_read(path, &data, &size))
+        return NULL;
+
+    vi = vmcoreinfo_parse(data, size);
+    xfree(data);
+
+    if (!vmcoreinfo_lookup(vi, "OSRELEASE")) {
+        vmcoreinfo_free(vi);
+        return NULL;
+    }
+
+    if (CRASHDEBUG(1))
+        pr_debug("vmcoreinfo: %d entries from %s", vi->nr, path);
+
+    return vi;
+}
+
+void vmcoreinfo_cache_store(const struct vmcoreinfo *vi, uint64_t map_key)
+{
+    char path[4096];
+
+    if (!map_key || vmcoreinfo_cache_path(path, sizeof(path), map_key))
+        return;
+
+    cache_store(path, vi->raw, vi->size);
+}
+
+/*
+ * Without a System.map, vmcoreinfo is looked for in the RAM of the guest.
+ * Since 4.15 the kernel keeps it in pages of its own twice: the ELF note
+ * for kdump, and vmcoreinfo_data the note is made from.  Both start a
+ * page, so a look at the start of every page finds them, which beats
+ * searching all of the bytes.  Copies left over from an earlier boot are
+ * turned down by valid().  Where it was found is kept in the cache, and
+ * looked at first the next time.
+ */
+#define VMCOREINFO_NOTE_NAME    "VMCOREINFO"
+#define VMCOREINFO_NOTE_DESC    (24)            /* Elf64_Nhdr and the name */
+#define VMCOREINFO_START        "OSRELEASE="
+#define VMCOREINFO_MAX          (PAGE_SIZE)
+#define VMCOREINFO_SCAN_CHUNK   (1UL << 20)
+#define VMCOREINFO_SCAN_MAX     (1UL << 30)     /* read through the backend */
+#define VMCOREINFO_AT_MAGIC     "KDVMCAT1"
+
+struct vmcoreinfo_at {
+    char magic[8];
+    uint64_t key;
+    uint64_t paddr;
+};
+
+/* the size of the vmcoreinfo starting page, and where in it, 0 if none */
+static size_t vmcoreinfo_page(const char *page, size_t *off)
+{
+    uint32_t nhdr[3];
+
+    memcpy(nhdr, page, sizeof(nhdr));
+    if (nhdr[0] == sizeof(VMCOREINFO_NOTE_NAME) && nhdr[2] == 0 &&
+            nhdr[1] < VMCOREINFO_MAX &&
+            !memcmp(page + sizeof(nhdr), VMCOREINFO_NOTE_NAME, sizeof(VMCOREINFO_NOTE_NAME)) &&
+            !memcmp(page + VMCOREINFO_NOTE_DESC, VMCOREINFO_START, strlen(VMCOREINFO_START))) {
+        *off = VMCOREINFO_NOTE_DESC;
+        return nhdr[1];
+    }
+
+    if (!memcmp(page, VMCOREINFO_START, strlen(VMCOREINFO_START))) {
+        *off = 0;
+        return strnlen(page, VMCOREINFO_MAX);
+    }
+
+    return 0;
+}
+
+/* the vmcoreinfo at paddr, if there is one and it is the one */
+static struct vmcoreinfo *vmcoreinfo_at(physaddr_t paddr,
+        int (*valid)(const struct vmcoreinfo *, void *), void *arg)
+{
+    struct vmcoreinfo *vi = NULL;
+    size_t size, off;
+    char *buf;
+
+    buf = buf_get(gc->bufs, VMCOREINFO_NOTE_DESC + VMCOREINFO_MAX);
+    if (readmem(paddr, PHYSADDR, buf, PAGE_SIZE) ||
+            !(size = vmcoreinfo_page(buf, &off)))
+        goto out;
+
+    /* the note goes on into the next page */
+    if (off + size > PAGE_SIZE &&
+            readmem(paddr + PAGE_SIZE, PHYSADDR, buf + PAGE_SIZE, off + size - PAGE_SIZE))
+        goto out;
+
+    vi = vmcoreinfo_parse(buf + off, size);
+    if (!valid(vi, arg)) {
+        vmcoreinfo_free(vi);
+        vi = NULL;
+    }
+
+out:
+    buf_put(gc->bufs, buf);
+    return vi;
+}
+
+/*
+ * RAM the backend maps is searched all through, but reading all of it
+ * through a monitor can take very long, so no more than pc->scan_max
+ * of that is read.
+ */
+static struct vmcoreinfo *vmcoreinfo_scan(const struct phys_range *ram, int nr,
+        int (*valid)(const struct vmcoreinfo *, void *), void *arg, physaddr_t *paddr)
+{
+    ulong max = pc->scan_max ? pc->scan_max : VMCOREINFO_SCAN_MAX, read = 0;
+    struct vmcoreinfo *vi = NULL;
+    physaddr_t addr, end;
+    size_t len, off, i;
+    char *buf, *p;
+    int r;
+
+    buf = buf_get(gc->bufs, VMCOREINFO_SCAN_CHUNK);
+
+    for (r = 0; r < nr && !vi; r++) {
+        for (addr = ram[r].start; addr < ram[r].end && !vi; addr += len) {
+            end = ram[r].end;
+            len = end - addr < VMCOREINFO_SCAN_CHUNK ? end - addr : VMCOREINFO_SCAN_CHUNK;
+
+            if (!(p = peekmem(addr, PHYSADDR, len))) {
+                if (read + len > max) {
+                    pr_err("No vmcoreinfo in the %lu MB of guest RAM read up to %llx, "
+                            "giving up; see --scan-max", read >> 20, (unsigned long long)addr);
+                    goto out;
+                }
+                read += len;
+                if (readmem(addr, PHYSADDR, buf, len))
+                    continue;
+                p = buf;
+            }
+
+            for (i = 0; i + PAGE_SIZE <= len; i += PAGE_SIZE) {
+                if (vmcoreinfo_page(p + i, &off) &&
+                        (vi = vmcoreinfo_at(addr + i, valid, arg))) {
+                    *paddr = addr + i;
+                    break;
+                }
+            }
+        }
+    }
+
+out:
+    buf_put(gc->bufs, buf);
+    return vi;
+}
+
+static uint64_t vmcoreinfo_at_key(const char *guest_ac, char *path, size_t len)
+{
+    uint64_t key;
+    char name[64];
+
+    key = cache_hash(guest_ac, strlen(guest_ac), CACHE_HASH_INIT);
+    snprintf(name, sizeof(name), "vmcoreinfo-at-%016llx", (unsigned long long)key);
+    if (cache_path(path, len, name))
+        return 0;
+
+    return key;
+}
+
+/*
+ * The vmcoreinfo of the running kernel of a guest, from the runs of its
+ * RAM; valid() tells whether one found is it.  NULL if there is none.
+ */
+struct vmcoreinfo *vmcoreinfo_find(const char *guest_ac, const struct phys_range *ram,
+        int nr, int (*valid)(const struct vmcoreinfo *, void *), void *arg)
+{
+    struct vmcoreinfo_at at;
+    struct vmcoreinfo *vi;
+    char path[4096];
+    uint64_t key;
+
+    key = vmcoreinfo_at_key(guest_ac, path, sizeof(path));
+    if (key && !cache_load(path, &at, sizeof(at)) &&
+            !memcmp(at.magic, VMCOREINFO_AT_MAGIC, sizeof(at.magic)) && at.key == key &&
+            (vi = vmcoreinfo_at(at.paddr, valid, arg))) {
+        if (CRASHDEBUG(1))
+            pr_debug("vmcoreinfo: at %llx, from %s", (unsigned long long)at.paddr, path);
+        return vi;
+    }
+
+    if (!(vi = vmcoreinfo_scan(ram, nr, valid, arg, &at.paddr)))
+        return NULL;
+
+    if (CRASHDEBUG(1))
+        pr_debug("vmcoreinfo: %d entries at %llx", vi->nr, (unsigned long long)at.paddr);
+
+    if (key) {
+        memcpy(at.magic, VMCOREINFO_AT_MAGIC, sizeof(at.magic));
+        at.key = key;
+        cache_store(path, &at, sizeof(at));
+    }
+
+    return vi;
+}
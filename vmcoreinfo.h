@@ -0,0 +1,52 @@
+/* vmcoreinfo.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __VMCOREINFO_H__
+#define __VMCOREINFO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct vmcoreinfo_entry {
+    const char *key;                /* "SIZE(printk_info)", "OSRELEASE", ... */
+    const char *value;
+    long number;                    /* value as a number, 0 if it is none */
+};
+
+/* the vmcoreinfo note of a kernel, split into a table sorted by key */
+struct vmcoreinfo {
+    char *raw;                      /* as the kernel has it */
+    size_t size;
+    char *buf;                      /* keys and values, NUL terminated */
+    struct vmcoreinfo_entry *entries;
+    int nr;
+};
+
+struct vmcoreinfo *vmcoreinfo_parse(const char *data, size_t size);
+void vmcoreinfo_free(struct vmcoreinfo *vi);
+
+const struct vmcoreinfo_entry *vmcoreinfo_lookup(const struct vmcoreinfo *vi,
+        const char *key);
+const char *vmcoreinfo_string(const struct vmcoreinfo *vi, const char *key);
+int vmcoreinfo_number(const struct vmcoreinfo *vi, const char *key, long *value);
+
+struct vmcoreinfo *vmcoreinfo_cache_load(uint64_t map_key);
+void vmcoreinfo_cache_store(const struct vmcoreinfo *vi, uint64_t map_key);
+
+struct phys_range;
+struct vmcoreinfo *vmcoreinfo_find(const char *guest_ac, const struct phys_range *ram,
+        int nr, int (*valid)(const struct vmcoreinfo *, void *), void *arg);
+
+#endif
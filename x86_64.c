@@ -0,0 +1,318 @@
+/* x86_64.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "defs.h"
+#include "client.h"
+
+static ulong * x86_64_kpgd_offset(ulong kvaddr)
+{
+    ulong *pgd;
+    pgd = ((ulong *)machdep->pgd) + pgd_index(kvaddr);
+    return pgd;
+}
+
+static ulong x86_64_p4d_offset(ulong pgd_pte, ulong vaddr)
+{
+    ulong *p4d;
+    ulong p4d_paddr;
+    ulong p4d_pte;
+
+    p4d_paddr = pgd_pte & PHYSICAL_PAGE_MASK;
+
+    FILL_P4D(p4d_paddr, PAGESIZE());
+    p4d = ((ulong *)p4d_paddr) + p4d_index(vaddr);
+    p4d_pte = ULONG(machdep->p4d + PAGEOFFSET(p4d));
+
+    return p4d_pte;
+}
+
+static ulong x86_64_pud_offset(ulong pgd_pte, ulong vaddr)
+{
+    ulong *pud;
+    ulong pud_paddr;
+    ulong pud_pte;
+
+    pud_paddr = pgd_pte & PHYSICAL_PAGE_MASK;
+
+    FILL_PUD(pud_paddr, PAGESIZE());
+    pud = ((ulong *)pud_paddr) + pud_index(vaddr);
+    pud_pte = ULONG(machdep->pud + PAGEOFFSET(pud));
+
+    return pud_pte;
+}
+
+static ulong x86_64_pmd_offset(ulong pud_pte, ulong vaddr)
+{
+    ulong *pmd;
+    ulong pmd_paddr;
+    ulong pmd_pte;
+
+    pmd_paddr = pud_pte & PHYSICAL_PAGE_MASK;
+
+    FILL_PMD(pmd_paddr, PAGESIZE());
+
+    pmd = ((ulong *)pmd_paddr) + pmd_index(vaddr);
+    pmd_pte = ULONG(machdep->pmd + PAGEOFFSET(pmd));
+    return pmd_pte;
+}
+
+static ulong x86_64_pte_offset(ulong pmd_pte, ulong vaddr)
+{
+    ulong *ptep;
+    ulong pte_paddr;
+    ulong pte;
+
+    pte_paddr = pmd_pte & PHYSICAL_PAGE_MASK;
+
+    FILL_PTBL(pte_paddr, PAGESIZE());
+    ptep = ((ulong *)pte_paddr) + pte_index(vaddr);
+    pte = ULONG(machdep->ptbl + PAGEOFFSET(ptep));
+
+    return pte;
+}
+
+/*
+ * Walk the kernel page tables for kvaddr.  On success page is the start
+ * of the page it is in, otherwise the walk ended at a hole; either way
+ * size is how much of the address space that page or hole spans.  Only
+ * the table pages that differ from the last walk are read from the guest.
+ */
+static int x86_64_walk(ulong kvaddr, physaddr_t *page, ulong *size)
+{
+    ulong pgd_pte;
+    ulong pud_pte;
+    ulong pmd_pte;
+    ulong pte;
+
+    FILL_PGD(vt->kernel_pgd[0], PAGESIZE());
+    pgd_pte = *x86_64_kpgd_offset(kvaddr);
+    *size = 1UL << __PGDIR_SHIFT;
+    if (machdep->machspec->pgtable_l5) {
+        if (!(pgd_pte & _PAGE_PRESENT))
+            return -1;
+        pgd_pte = x86_64_p4d_offset(pgd_pte, kvaddr);
+        *size = 1UL << P4D_SHIFT;
+    }
+    if (!(pgd_pte & _PAGE_PRESENT))
+        return -1;
+
+    pud_pte = x86_64_pud_offset(pgd_pte, kvaddr);
+    *size = PUD_SIZE;
+    if (!(pud_pte & _PAGE_PRESENT))
+        return -1;
+    if (pud_pte & _PAGE_PSE) {
+        *page = pud_pte & PHYSICAL_PAGE_MASK & ~(PUD_SIZE - 1);
+        return 0;
+    }
+
+    pmd_pte = x86_64_pmd_offset(pud_pte, kvaddr);
+    *size = PMD_SIZE;
+    if (!(pmd_pte & _PAGE_PRESENT))
+        return -1;
+    if (pmd_pte & _PAGE_PSE) {
+        *page = pmd_pte & PHYSICAL_PAGE_MASK & ~(PMD_SIZE - 1);
+        return 0;
+    }
+
+    pte = x86_64_pte_offset(pmd_pte, kvaddr);
+    *size = PAGESIZE();
+    if (!(pte & _PAGE_PRESENT))
+        return -1;
+    *page = PAGEBASE(pte) & PHYSICAL_PAGE_MASK;
+    return 0;
+}
+
+/*
+ * The page holding kvaddr lands in a small direct-mapped TLB, so reading
+ * a vmalloc'd buffer a page at a time costs one walk per page for the
+ * life of the guest context.
+ */
+int x86_64_kvtop(ulong kvaddr, physaddr_t *paddr)
+{
+    struct tlb_entry *tlb;
+    ulong vpn = kvaddr >> PAGE_SHIFT;
+    physaddr_t page;
+    ulong size;
+
+    tlb = &machdep->tlb[vpn % TLB_ENTRIES];
+    if (tlb->vpn == vpn) {
+        gc->stats.tlb_hits++;
+        *paddr = tlb->paddr + PAGEOFFSET(kvaddr);
+        return 0;
+    }
+    gc->stats.tlb_misses++;
+
+    if (x86_64_walk(kvaddr, &page, &size)) {
+        if (CRASHDEBUG(1))
+            pr_debug("kvtop: %lx is not mapped", kvaddr);
+        return -1;
+    }
+
+    /* the 4k page of a huge one */
+    page += PAGEBASE(kvaddr) & (size - 1);
+
+    tlb->vpn = vpn;
+    tlb->paddr = page;
+    *paddr = page + PAGEOFFSET(kvaddr);
+    return 0;
+}
+
+/*
+ * Where the direct map is, without page_offset_base to tell: KASLR moves
+ * it by whole PUDs, but it is still the first mapping of physical 0 from
+ * the usual PAGE_OFFSET on.  It maps all the RAM of the guest, whose
+ * runs go to ram; the first mapping after it that is not part of it is
+ * where the vmalloc area starts.  Returns the number of runs, -1 if
+ * there is no direct map.
+ */
+int x86_64_find_direct_map(struct phys_range *ram, int max)
+{
+    struct machine_specific *ms = machdep->machspec;
+    ulong va, base, limit, size = 0;
+    physaddr_t page;
+    int nr = 0;
+
+    base = ms->pgtable_l5 ? PAGE_OFFSET_5LEVEL : PAGE_OFFSET_2_6_27;
+    for (va = base; va >= base && va < __START_KERNEL_map;
+            va = (va & ~(size - 1)) + size) {
+        if (!x86_64_walk(va, &page, &size) && !page)
+            break;
+    }
+    if (va < base || va >= __START_KERNEL_map)
+        return -1;
+
+    ms->page_offset = va;
+    limit = va + (1UL << ms->physical_mask_shift);
+
+    for (; va >= ms->page_offset && va < limit; va = (va & ~(size - 1)) + size) {
+        if (x86_64_walk(va, &page, &size))
+            continue;
+
+        if (page != (va & ~(size - 1)) - ms->page_offset) {
+            ms->vmalloc_start = va & ~(size - 1);
+            break;
+        }
+
+        if (nr && ram[nr - 1].end == page) {
+            ram[nr - 1].end += size;
+        } else if (nr < max) {
+            ram[nr].start = page;
+            ram[nr++].end = page + size;
+        } else {
+            break;
+        }
+    }
+
+    if (CRASHDEBUG(1))
+        pr_debug("x86_64: direct map at %lx, %d runs of RAM", ms->page_offset, nr);
+
+    return nr;
+}
+
+/*
+ * The kernel image and the direct map translate by a fixed offset, so
+ * there is no need to walk for them.  The direct map ends where the
+ * vmalloc area starts.
+ */
+int x86_64_is_linear(ulong kvaddr)
+{
+    struct machine_specific *ms = machdep->machspec;
+    ulong end;
+
+    if (kvaddr >= __START_KERNEL_map)
+        return kvaddr - __START_KERNEL_map < KERNEL_IMAGE_SIZE;
+
+    if (ms->vmalloc_start > ms->page_offset)
+        end = ms->vmalloc_start;
+    else
+        end = ms->page_offset + (1UL << __PHYSICAL_MASK_SHIFT);
+
+    return kvaddr >= ms->page_offset && kvaddr < end;
+}
+
+physaddr_t x86_64_linear_to_phys(ulong kvaddr)
+{
+    if (kvaddr >= __START_KERNEL_map)
+        return kvaddr - __START_KERNEL_map + machdep->machspec->phys_base;
+
+    return kvaddr - PAGE_OFFSET;
+}
+
+/*
+ * Start translating with the page tables at pgd, as found in CR3.
+ * CR4.LA57 tells whether they are 4 or 5 levels deep.  Nothing is read
+ * before the first walk.
+ */
+void x86_64_set_pgd(ulong pgd, ulong cr4)
+{
+    struct machine_specific *ms = machdep->machspec;
+
+    ms->pgtable_l5 = !!(cr4 & X86_CR4_LA57);
+    if (ms->pgtable_l5) {
+        ms->pgdir_shift = PGDIR_SHIFT_5LEVEL;
+        ms->physical_mask_shift = __PHYSICAL_MASK_SHIFT_5LEVEL;
+        ms->page_offset = PAGE_OFFSET_5LEVEL;
+    } else {
+        ms->pgdir_shift = PGDIR_SHIFT;
+        ms->physical_mask_shift = __PHYSICAL_MASK_SHIFT_2_6;
+    }
+    ms->ptrs_per_pgd = PTRS_PER_PGD;
+
+    if (CRASHDEBUG(1))
+        pr_debug("x86_64: %d level page tables", ms->pgtable_l5 ? 5 : 4);
+
+    vt->kernel_pgd[0] = pgd;
+    machdep->last_pgd_read = 0;
+    machdep->last_p4d_read = 0;
+    machdep->last_pud_read = 0;
+    machdep->last_pmd_read = 0;
+    machdep->last_ptbl_read = 0;
+    memset(machdep->tlb, 0, sizeof(machdep->tlb));
+}
+
+void x86_64_init()
+{
+    machdep->machspec = &gc->machine_specific;
+
+    machdep->pagesize = 4096;
+    machdep->pageoffset = machdep->pagesize - 1;
+    machdep->pagemask = ~((ulonglong)machdep->pageoffset);
+
+    machdep->pgd = malloc(PAGESIZE());
+    machdep->p4d = malloc(PAGESIZE());
+    machdep->pud = malloc(PAGESIZE());
+    machdep->pmd = malloc(PAGESIZE());
+    machdep->ptbl = malloc(PAGESIZE());
+
+    machdep->machspec->page_offset = PAGE_OFFSET_2_6_27;
+    machdep->machspec->physical_mask_shift = __PHYSICAL_MASK_SHIFT_2_6;
+}
+
+void x86_64_post_reloc()
+{
+    if (kernel_symbol_exists("page_offset_base")) {
+        get_symbol_data("page_offset_base", sizeof(ulong),
+            &machdep->machspec->page_offset);
+    }
+
+    if (kernel_symbol_exists("vmalloc_base")) {
+        get_symbol_data("vmalloc_base", sizeof(ulong),
+            &machdep->machspec->vmalloc_start);
+    }
+}
@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -164,6 +165,15 @@ char *xstrdup(const char *s)
 }
 
 
+/* the monotonic clock in ns, what everything is timed with */
+uint64_t xclock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void daemonize(void)
 {
     pid_t pid, sid;
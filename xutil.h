@@ -17,6 +17,7 @@
 #define __XUTIL_H__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #ifndef offsetof
@@ -42,6 +43,7 @@ size_t to_bytes(unsigned char *d, const char *str, int base_from);
 off_t get_file_len(const char *fn);
 int file_read(const char *fn, char **dst, size_t *flen);
 void daemonize(void);
+uint64_t xclock_ns(void);
 void xsetnonblock(int fd);
 int xset_tcp_reuseaddr(int fd);
 int xset_tcp_keepalive(int fd);